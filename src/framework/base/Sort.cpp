@@ -36,6 +36,10 @@ using namespace FW;
 #define QSORT_MIN_SIZE      16
 #define MULTICORE_MIN_SIZE  (1 << 13)
 
+#define RADIX_BITS          8
+#define RADIX_SIZE          (1 << RADIX_BITS)
+#define RADIX_BLOCK_SIZE    (1 << 16)               // minimum number of entries per task
+
 //------------------------------------------------------------------------
 
 namespace FW
@@ -56,6 +60,23 @@ static int          partition       (int low, int high, void* data, SortCompareF
 static void         qsort           (int low, int high, void* data, SortCompareFunc compareFunc, SortSwapFunc swapFunc);
 static void         qsortMulticore  (MulticoreLauncher::Task& task);
 
+struct RadixTaskSpec
+{
+    RadixSortEntry* src;
+    RadixSortEntry* dst;
+    S32             num;
+    S32             numBlocks;
+    S32             shift;                          // of the current digit
+    S32*            counts;                         // [numBlocks][RADIX_SIZE], become scatter offsets
+    U64*            blockDiff;                      // [numBlocks], key bits that vary within each block
+};
+
+static inline void  getRadixBlock   (const RadixTaskSpec& spec, int block, int& first, int& last);
+static void         runRadixTasks   (MulticoreLauncher::TaskFunc func, RadixTaskSpec& spec);
+static void         radixDiff       (MulticoreLauncher::Task& task);
+static void         radixCount      (MulticoreLauncher::Task& task);
+static void         radixScatter    (MulticoreLauncher::Task& task);
+
 }
 
 //------------------------------------------------------------------------
@@ -237,3 +258,148 @@ void FW::sort(void* data, int start, int end, SortCompareFunc compareFunc, SortS
 }
 
 //------------------------------------------------------------------------
+
+void FW::getRadixBlock(const RadixTaskSpec& spec, int block, int& first, int& last)
+{
+    first = (int)((S64)spec.num * block / spec.numBlocks);
+    last  = (int)((S64)spec.num * (block + 1) / spec.numBlocks);
+}
+
+//------------------------------------------------------------------------
+
+void FW::runRadixTasks(MulticoreLauncher::TaskFunc func, RadixTaskSpec& spec)
+{
+    if (spec.numBlocks > 1)
+    {
+        MulticoreLauncher().push(func, &spec, 0, spec.numBlocks).popAll();
+        return;
+    }
+
+    MulticoreLauncher::Task task;
+    task.launcher   = NULL;
+    task.func       = func;
+    task.data       = &spec;
+    task.idx        = 0;
+    task.result     = NULL;
+    func(task);
+}
+
+//------------------------------------------------------------------------
+
+void FW::radixDiff(MulticoreLauncher::Task& task)
+{
+    RadixTaskSpec& spec = *(RadixTaskSpec*)task.data;
+    int first, last;
+    getRadixBlock(spec, task.idx, first, last);
+
+    U64 ref  = spec.src[0].key;
+    U64 diff = 0;
+    for (int i = first; i < last; i++)
+        diff |= spec.src[i].key ^ ref;
+    spec.blockDiff[task.idx] = diff;
+}
+
+//------------------------------------------------------------------------
+
+void FW::radixCount(MulticoreLauncher::Task& task)
+{
+    RadixTaskSpec& spec = *(RadixTaskSpec*)task.data;
+    int first, last;
+    getRadixBlock(spec, task.idx, first, last);
+
+    S32* counts = spec.counts + task.idx * RADIX_SIZE;
+    for (int i = 0; i < RADIX_SIZE; i++)
+        counts[i] = 0;
+    for (int i = first; i < last; i++)
+        counts[(spec.src[i].key >> spec.shift) & (RADIX_SIZE - 1)]++;
+}
+
+//------------------------------------------------------------------------
+
+void FW::radixScatter(MulticoreLauncher::Task& task)
+{
+    RadixTaskSpec& spec = *(RadixTaskSpec*)task.data;
+    int first, last;
+    getRadixBlock(spec, task.idx, first, last);
+
+    S32 offsets[RADIX_SIZE];
+    memcpy(offsets, spec.counts + task.idx * RADIX_SIZE, sizeof(offsets));
+    for (int i = first; i < last; i++)
+    {
+        const RadixSortEntry& e = spec.src[i];
+        spec.dst[offsets[(e.key >> spec.shift) & (RADIX_SIZE - 1)]++] = e;
+    }
+}
+
+//------------------------------------------------------------------------
+
+void FW::radixSort(RadixSortEntry* data, int num, bool multicore)
+{
+    FW_ASSERT(num >= 0);
+    FW_ASSERT(data || !num);
+
+    // Nothing to do => skip.
+
+    if (num < 2)
+        return;
+
+    // Split into blocks, one task each. The digits of each block are
+    // counted, and scattered to the ranges given by a prefix sum in
+    // (digit, block) order, which keeps the sort stable.
+
+    int numBlocks = (multicore) ? clamp(num / RADIX_BLOCK_SIZE, 1, MulticoreLauncher::getNumCores() * 4) : 1;
+
+    Array<RadixSortEntry> tmp;
+    Array<S32> counts;
+    Array<U64> blockDiff;
+    tmp.reset(num);
+    counts.reset(numBlocks * RADIX_SIZE);
+    blockDiff.reset(numBlocks);
+
+    RadixTaskSpec spec;
+    spec.src        = data;
+    spec.dst        = tmp.getPtr();
+    spec.num        = num;
+    spec.numBlocks  = numBlocks;
+    spec.shift      = 0;
+    spec.counts     = counts.getPtr();
+    spec.blockDiff  = blockDiff.getPtr();
+
+    // Find the key bits that vary.
+
+    runRadixTasks(radixDiff, spec);
+    U64 diff = 0;
+    for (int i = 0; i < numBlocks; i++)
+        diff |= blockDiff[i];
+
+    // One pass per varying digit.
+
+    for (int shift = 0; shift < 64; shift += RADIX_BITS)
+    {
+        if (((diff >> shift) & (RADIX_SIZE - 1)) == 0)
+            continue;
+
+        spec.shift = shift;
+        runRadixTasks(radixCount, spec);
+
+        S32 sum = 0;
+        for (int digit = 0; digit < RADIX_SIZE; digit++)
+        for (int block = 0; block < numBlocks; block++)
+        {
+            S32& c = counts[block * RADIX_SIZE + digit];
+            S32 n = c;
+            c = sum;
+            sum += n;
+        }
+
+        runRadixTasks(radixScatter, spec);
+        swap(spec.src, spec.dst);
+    }
+
+    // Odd number of passes => result is in the temporary array.
+
+    if (spec.src != data)
+        memcpy(data, spec.src, num * sizeof(RadixSortEntry));
+}
+
+//------------------------------------------------------------------------
@@ -58,7 +58,11 @@ App::App(void)
 	m_numReconstructionRays				(256),
 	m_showImage							(0),
 	m_showChannel						(CH_INDIRECT),
-	m_reconstructionMode				(RECONSTRUCT_INDIRECT)
+	m_reconstructionMode				(RECONSTRUCT_INDIRECT),
+	m_hierarchyBuilder					(Reconstruction::BUILDER_MORTON),
+	m_spatialSplits						(false),
+	m_motionPartition					(false),
+	m_densityEngine						(Reconstruction::DENSITY_EXACT)
 {
 	for(int i=0;i<VIZ_MAX;i++)
 		m_images[i] = NULL;
@@ -69,6 +73,7 @@ App::App(void)
 
     m_commonCtrl.addButton((S32*)&m_action, Action_LoadSampleBuffer,    FW_KEY_L,       "Load sample buffer... [L]");
     m_commonCtrl.addButton((S32*)&m_action, Action_SaveSampleBuffer,    FW_KEY_S,       "Save sample buffer... [S]");
+    m_commonCtrl.addButton((S32*)&m_action, Action_SaveSampleBufferCompact, FW_KEY_NONE, "Save sample buffer as compact V3.0...");
 	m_commonCtrl.addToggle(&m_flipY,									FW_KEY_Y,		"Flip Y [Y]");
 	m_commonCtrl.addToggle(&m_exportScreenshot,							FW_KEY_P,		"Output screenshot [P]");
 	m_commonCtrl.addButton((S32*)&m_action, Action_ClearImages,			FW_KEY_DELETE,	"Force recalculate [DELETE]");
@@ -78,6 +83,12 @@ App::App(void)
 
 	m_commonCtrl.addToggle(&m_reconstructionMode, RECONSTRUCT_INDIRECT,	FW_KEY_NONE,  	"Reconstruction mode: indirect");
 	m_commonCtrl.addToggle(&m_reconstructionMode, RECONSTRUCT_AO	,	FW_KEY_NONE,  	"Reconstruction mode: AO");
+	m_commonCtrl.addToggle(&m_hierarchyBuilder, Reconstruction::BUILDER_MORTON,	FW_KEY_NONE,	"Hierarchy builder: Morton");
+	m_commonCtrl.addToggle(&m_hierarchyBuilder, Reconstruction::BUILDER_SAH,		FW_KEY_NONE,	"Hierarchy builder: Morton + SAH rotations");
+	m_commonCtrl.addToggle(&m_spatialSplits,									FW_KEY_NONE,	"Hierarchy: split oversized splats (CPU, static scenes)");
+	m_commonCtrl.addToggle(&m_motionPartition,									FW_KEY_NONE,	"Hierarchy: separate static and moving samples (motion)");
+	m_commonCtrl.addToggle(&m_densityEngine, Reconstruction::DENSITY_EXACT,		FW_KEY_NONE,	"Densities: exact KNN");
+	m_commonCtrl.addToggle(&m_densityEngine, Reconstruction::DENSITY_GRID,		FW_KEY_NONE,	"Densities: hashed grid KNN");
 
     m_commonCtrl.addSeparator();
 
@@ -175,7 +186,21 @@ bool App::handleEvent(const Window::Event& ev)
         name = m_window.showFileSaveDialog("Save sample buffer");
         if (name.getLength())
 		{
-			m_samples->serialize(name.getPtr(), true, true);
+			m_samples->loadChannels(SCH_ALL);
+			m_samples->serialize(name.getPtr(), true, true, true);
+			m_fileName = name;
+		}
+        break;
+
+	case Action_SaveSampleBufferCompact:
+        name = m_window.showFileSaveDialog("Save compact sample buffer");
+        if (name.getLength())
+		{
+			const float version = m_samples->getVersion();
+			m_samples->loadChannels(SCH_ALL);
+			m_samples->setVersion(3.0f);
+			m_samples->serialize(name.getPtr(), true, true, true);
+			m_samples->setVersion(version);
 			m_fileName = name;
 		}
         break;
@@ -257,6 +282,7 @@ void filterNormals(UVTSampleBuffer& sbuf)
 
 	CID_PRI_NORMAL_SMOOTH = sbuf.reserveChannel<Vec3f>(CID_PRI_NORMAL_SMOOTH_NAME);
 
+	sbuf.loadChannels(SCH_PRI_NORMAL);
 	const int CID_PRI_NORMAL = sbuf.getChannelID(CID_PRI_NORMAL_NAME);
 	const int w = sbuf.getWidth();
 	const int h = sbuf.getHeight();
@@ -322,7 +348,7 @@ void App::importSampleBuffer (const String& fileName)
 	if(fp)
 	{
 		fclose(fp);
-		m_samples = new UVTSampleBuffer(fileName.getPtr());
+		m_samples = new UVTSampleBuffer(fileName.getPtr(), true, SCH_SEC_ORIGIN);	// binary V2.2 buffers are memory-mapped. Other channels are loaded on demand.
 		if(m_samples->isIrregular())
 			printf("IRREGULAR sample buffer loaded\n");
 	}
@@ -351,71 +377,99 @@ void App::importSampleBuffer (const String& fileName)
 
 //------------------------------------------------------------------------
 
+template<class T> static const StridedArray<T>* findChannel(const UVTSampleBuffer& sbuf, ChannelHandle<T> h)	{ return sbuf.hasChannel(h) ? &sbuf.getChannel(h) : NULL; }
+static inline Vec3f getExtra(const StridedArray<Vec3f>* channel, int idx)	{ return channel ? (*channel)[idx] : Vec3f(0); }		// absent channels read as zero
+
 void App::getChannel(Image& img, Channel ch) const
 {
 	if(ch != CH_COLOR && m_samples->getVersion() < 2.f)
 		return;
 
-	const int CID_DIRECT       = m_samples->getChannelID(CID_DIRECT_NAME);
-	const int CID_PRI_NORMAL   = m_samples->getChannelID(CID_PRI_NORMAL_NAME);
-	const int CID_SEC_ORIGIN   = m_samples->getChannelID(CID_SEC_ORIGIN_NAME);
-	const int CID_SEC_HITPOINT = m_samples->getChannelID(CID_SEC_HITPOINT_NAME);
-	const int CID_SEC_MV	   = m_samples->getChannelID(CID_SEC_MV_NAME);
-	const int CID_ALBEDO       = m_samples->getChannelID(CID_ALBEDO_NAME);
-	const int CID_SEC_ALBEDO   = m_samples->getChannelID(CID_SEC_ALBEDO_NAME);
-	const int CID_SEC_DIRECT   = m_samples->getChannelID(CID_SEC_DIRECT_NAME);
+	// Load the channels shown (SEC_ORIGIN is needed for the validity test).
+
+	U32 channelMask = SCH_SEC_ORIGIN;
+	switch(ch)
+	{
+	case CH_DIRECT:		channelMask |= SCH_DIRECT; break;
+	case CH_INDIRECT:	channelMask |= SCH_ALBEDO; break;
+	case CH_BOTH:		channelMask |= SCH_ALBEDO | SCH_DIRECT; break;
+	case CH_NORMAL:		channelMask |= SCH_PRI_NORMAL; break;
+	case CH_ALBEDO:		channelMask |= SCH_ALBEDO; break;
+	case CH_AO:			channelMask |= SCH_SEC_HITPOINT; break;
+	case CH_MV:			channelMask |= SCH_SEC_MV; break;
+	case CH_SALBEDO:	channelMask |= SCH_SEC_ALBEDO; break;
+	case CH_SDIRECT:	channelMask |= SCH_SEC_DIRECT; break;
+	default:			break;
+	}
+	m_samples->loadChannels(channelMask);
 
 	if(ch==CH_NORMAL_SMOOTH)
 		filterNormals(*m_samples);
 
-	const int CID_PRI_NORMAL_SMOOTH = m_samples->getChannelID(CID_PRI_NORMAL_SMOOTH_NAME);
+	const StridedArray<Vec3f>* direct       = findChannel(*m_samples, CHANNEL_DIRECT);
+	const StridedArray<Vec3f>* priNormal    = findChannel(*m_samples, CHANNEL_PRI_NORMAL);
+	const StridedArray<Vec3f>* smoothNormal = findChannel(*m_samples, CHANNEL_PRI_NORMAL_SMOOTH);
+	const StridedArray<Vec3f>* secOrigin    = findChannel(*m_samples, CHANNEL_SEC_ORIGIN);
+	const StridedArray<Vec3f>* secHitpoint  = findChannel(*m_samples, CHANNEL_SEC_HITPOINT);
+	const StridedArray<Vec3f>* secMV        = findChannel(*m_samples, CHANNEL_SEC_MV);
+	const StridedArray<Vec3f>* albedo       = findChannel(*m_samples, CHANNEL_ALBEDO);
+	const StridedArray<Vec3f>* secAlbedo    = findChannel(*m_samples, CHANNEL_SEC_ALBEDO);
+	const StridedArray<Vec3f>* secDirect    = findChannel(*m_samples, CHANNEL_SEC_DIRECT);
 
 	for(int y=0;y<m_samples->getHeight();y++)
-	for(int x=0;x<m_samples->getWidth();x++)
 	{
-		Vec4f pixelColor(0);
+		// Samples of a scanline are contiguous; walk them in storage order.
 
-		for(int i=0;i<m_samples->getNumSamples(x,y);i++)
-		if(m_samples->getSampleExtra<Vec3f>(CID_SEC_ORIGIN, x,y,i).max() < 1e10f)		// is valid?
+		const int rowBegin = m_samples->getRowBegin(y);
+		const StridedSpan<const Vec2f> xys    = m_samples->getRowXY(y);
+		const StridedSpan<const Vec4f> colors = m_samples->getRowColor(y);
+		const StridedSpan<const float> ws     = m_samples->getRowW(y);
+
+		for(int x=0;x<m_samples->getWidth();x++)
 		{
-			Vec2f p = m_samples->getSampleXY(x,y,i);
-			Vec2i pi((int)floor(p.x),(int)floor(p.y));
-			FW_ASSERT(pi.x>=0 || pi.y>=0 || pi.x<img.getSize().x || pi.y<img.getSize().y);
+			Vec4f pixelColor(0);
 
-			switch(ch)
+			const int first = m_samples->getSampleIndex(x,y,0);
+			for(int idx=first;idx<first+m_samples->getNumSamples(x,y);idx++)
+			if(getExtra(secOrigin,idx).max() < 1e10f)		// is valid?
 			{
-			case CH_COLOR:		pixelColor += m_samples->getSampleColor(x,y,i); break;
-			case CH_DIRECT:		pixelColor += Vec4f(m_samples->getSampleExtra<Vec3f>(CID_DIRECT, x,y,i),1); break;
-			case CH_NORMAL:		pixelColor += Vec4f(m_samples->getSampleExtra<Vec3f>(CID_PRI_NORMAL, x,y,i)/2+0.5f,1); break;
-			case CH_NORMAL_SMOOTH: pixelColor += Vec4f(m_samples->getSampleExtra<Vec3f>(CID_PRI_NORMAL_SMOOTH, x,y,i)/2+0.5f,1); break;
-			case CH_ALBEDO:		pixelColor += Vec4f(m_samples->getSampleExtra<Vec3f>(CID_ALBEDO, x,y,i),1); break;
-			case CH_SALBEDO:	pixelColor += Vec4f(m_samples->getSampleExtra<Vec3f>(CID_SEC_ALBEDO, x,y,i),1); break;
-			case CH_SDIRECT:	pixelColor += Vec4f(m_samples->getSampleExtra<Vec3f>(CID_SEC_DIRECT, x,y,i),1); break;
-			case CH_MV:			pixelColor += Vec4f(m_samples->getSampleExtra<Vec3f>(CID_SEC_MV, x,y,i)/2.0f+0.5f,1); break;
-			case CH_AO:			pixelColor += (m_samples->getSampleExtra<Vec3f>(CID_SEC_HITPOINT, x,y,i)-m_samples->getSampleExtra<Vec3f>(CID_SEC_ORIGIN, x,y,i)).length() < m_aoLength ? Vec4f(0,0,0,1) : Vec4f(1,1,1,1); break;
-			case CH_BANDWIDTH:  pixelColor += Vec4f(m_samples->getSampleW(x,y,i) * .01f, 1.f); break;
-			case CH_INDIRECT:
-				{
-					const Vec3f& incident = m_samples->getSampleColor(x,y,i).getXYZ();
-					const Vec3f& albedo   = m_samples->getSampleExtra<Vec3f>(CID_ALBEDO, x,y,i);
-					pixelColor += Vec4f(incident*albedo,1);
-					break;
-				}
-			case CH_BOTH:
+				const int j = idx-rowBegin;
+				Vec2f p = xys[j];
+				Vec2i pi((int)floor(p.x),(int)floor(p.y));
+				FW_ASSERT(pi.x>=0 || pi.y>=0 || pi.x<img.getSize().x || pi.y<img.getSize().y);
+
+				switch(ch)
 				{
-					const Vec3f& incident = m_samples->getSampleColor(x,y,i).getXYZ();
-					const Vec3f& albedo   = m_samples->getSampleExtra<Vec3f>(CID_ALBEDO, x,y,i);
-					const Vec3f& direct   = m_samples->getSampleExtra<Vec3f>(CID_DIRECT, x,y,i);
-					pixelColor += Vec4f(direct + incident*albedo,1);				// ASSUMES: sample density according to BDRF
-					break;
+				case CH_COLOR:		pixelColor += colors[j]; break;
+				case CH_DIRECT:		pixelColor += Vec4f(getExtra(direct,idx),1); break;
+				case CH_NORMAL:		pixelColor += Vec4f(getExtra(priNormal,idx)/2+0.5f,1); break;
+				case CH_NORMAL_SMOOTH: pixelColor += Vec4f(getExtra(smoothNormal,idx)/2+0.5f,1); break;
+				case CH_ALBEDO:		pixelColor += Vec4f(getExtra(albedo,idx),1); break;
+				case CH_SALBEDO:	pixelColor += Vec4f(getExtra(secAlbedo,idx),1); break;
+				case CH_SDIRECT:	pixelColor += Vec4f(getExtra(secDirect,idx),1); break;
+				case CH_MV:			pixelColor += Vec4f(getExtra(secMV,idx)/2.0f+0.5f,1); break;
+				case CH_AO:			pixelColor += (getExtra(secHitpoint,idx)-getExtra(secOrigin,idx)).length() < m_aoLength ? Vec4f(0,0,0,1) : Vec4f(1,1,1,1); break;
+				case CH_BANDWIDTH:  pixelColor += Vec4f(ws[j] * .01f, 1.f); break;
+				case CH_INDIRECT:
+					{
+						const Vec3f& incident = colors[j].getXYZ();
+						pixelColor += Vec4f(incident*getExtra(albedo,idx),1);
+						break;
+					}
+				case CH_BOTH:
+					{
+						const Vec3f& incident = colors[j].getXYZ();
+						pixelColor += Vec4f(getExtra(direct,idx) + incident*getExtra(albedo,idx),1);				// ASSUMES: sample density according to BDRF
+						break;
+					}
+				default:
+					fail("App::getChannel, unsupported channel requested");
 				}
-			default:
-				fail("App::getChannel, unsupported channel requested");
 			}
-		}
 
-		if(pixelColor.w)	img.setVec4f(Vec2i(x,y), pixelColor*rcp(pixelColor.w));
-		else				img.setVec4f(Vec2i(x,y), Vec4f(0,1,0,1));					// NO SUPPORT = GREEN
+			if(pixelColor.w)	img.setVec4f(Vec2i(x,y), pixelColor*rcp(pixelColor.w));
+			else				img.setVec4f(Vec2i(x,y), Vec4f(0,1,0,1));					// NO SUPPORT = GREEN
+		}
 	}
 }
 
@@ -453,7 +507,7 @@ void App::render (GLContext* gl)
 	case VIZ_RECONSTRUCTION_INDIRECT_CUDA:
 	case VIZ_RECONSTRUCTION_INDIRECT:
 		{
-			Reconstruction tg;
+			Reconstruction tg((Reconstruction::Builder)m_hierarchyBuilder, m_spatialSplits, m_motionPartition, (Reconstruction::DensityEngine)m_densityEngine);
 			if(m_haveSampleBuffer && !(m_vizDone&(1<<viz)))
 			{
 				m_vizDone |= (1<<viz);
@@ -470,11 +524,13 @@ void App::render (GLContext* gl)
 				{
 					if(aoLength==0)
 					{
+						m_samples->loadChannels(viz==VIZ_RECONSTRUCTION_INDIRECT_CUDA ? Reconstruction::CHANNELS_INDIRECT_CUDA : Reconstruction::CHANNELS_INDIRECT);
 						if(viz==VIZ_RECONSTRUCTION_INDIRECT_CUDA)	tg.reconstructIndirectCuda(*m_samples,m_numReconstructionRays,*m_images[viz]);
 						else										tg.reconstructIndirect    (*m_samples,m_numReconstructionRays,*m_images[viz],m_images[VIZ_DEBUG]);
 					}
 					else
 					{
+						m_samples->loadChannels(viz==VIZ_RECONSTRUCTION_INDIRECT_CUDA ? Reconstruction::CHANNELS_AO_CUDA : Reconstruction::CHANNELS_AO);
 						if(viz==VIZ_RECONSTRUCTION_INDIRECT_CUDA)	tg.reconstructAOCuda(*m_samples,m_numReconstructionRays,aoLength,*m_images[viz]);
 						else										tg.reconstructAO    (*m_samples,m_numReconstructionRays,aoLength,*m_images[viz],m_images[VIZ_DEBUG]);//, Vec4i(401,401,500,500));
 					}
@@ -487,7 +543,7 @@ void App::render (GLContext* gl)
 	case VIZ_RECONSTRUCTION_GLOSSY_CUDA:
 	case VIZ_RECONSTRUCTION_GLOSSY:
 		{
-			Reconstruction tg;
+			Reconstruction tg((Reconstruction::Builder)m_hierarchyBuilder, m_spatialSplits, m_motionPartition, (Reconstruction::DensityEngine)m_densityEngine);
 			if(m_haveSampleBuffer && !(m_vizDone&(1<<viz)))
 			{
 				m_vizDone |= (1<<viz);
@@ -506,6 +562,7 @@ void App::render (GLContext* gl)
 					String rayDumpFileName = m_window.showFileLoadDialog("Load ray dump");
 					if (rayDumpFileName.getLength())
 					{
+						m_samples->loadChannels(viz==VIZ_RECONSTRUCTION_GLOSSY_CUDA ? Reconstruction::CHANNELS_GLOSSY_CUDA : Reconstruction::CHANNELS_GLOSSY);
 						if(viz==VIZ_RECONSTRUCTION_GLOSSY_CUDA)	tg.reconstructGlossyCuda(*m_samples,rayDumpFileName,*m_images[viz]);
 						else									tg.reconstructGlossy    (*m_samples,rayDumpFileName,*m_images[viz],m_images[VIZ_DEBUG]);
 					}
@@ -523,12 +580,13 @@ void App::render (GLContext* gl)
 	// dof+motion
 	case VIZ_RECONSTRUCTION_DOF_MOTION:
 		{
-			Reconstruction tg;
+			Reconstruction tg((Reconstruction::Builder)m_hierarchyBuilder, m_spatialSplits, m_motionPartition, (Reconstruction::DensityEngine)m_densityEngine);
 			if(m_haveSampleBuffer && !(m_vizDone&(1<<viz)))
 			{
 				m_vizDone |= (1<<viz);
 				m_vizDone |= (1<<VIZ_DEBUG);						// HACK
 				getChannel(*m_images[viz],CH_INDIRECT);				// for active window
+				m_samples->loadChannels(Reconstruction::CHANNELS_DOF_MOTION);
 				tg.reconstructDofMotion(*m_samples,m_numReconstructionRays,*m_images[viz],m_images[VIZ_DEBUG]);
 //				tg.reconstructDofMotion(*m_samples,m_numReconstructionRays,*m_images[viz],m_images[VIZ_DEBUG], Vec4i(701,101,800,400));	// reconstruct a partial image
 			}
@@ -538,12 +596,13 @@ void App::render (GLContext* gl)
 	// RPF
 	case VIZ_RECONSTRUCTION_RPF:
 		{
-			Reconstruction tg;
+			Reconstruction tg((Reconstruction::Builder)m_hierarchyBuilder, m_spatialSplits, m_motionPartition, (Reconstruction::DensityEngine)m_densityEngine);
 			if(m_haveSampleBuffer && !(m_vizDone&(1<<viz)))
 			{
 				m_vizDone |= (1<<viz);
 				m_vizDone |= (1<<VIZ_DEBUG);						// HACK
 				getChannel(*m_images[viz],CH_INDIRECT);				// for active window
+				m_samples->loadChannels(Reconstruction::CHANNELS_RPF);
 				filterNormals(*m_samples);
 				tg.reconstructRPF(*m_samples,*m_images[viz],m_images[VIZ_DEBUG],aoLength);			
 			}
@@ -553,12 +612,13 @@ void App::render (GLContext* gl)
 	// ATrous
 	case VIZ_RECONSTRUCTION_ATROUS:
 		{
-			Reconstruction tg;
+			Reconstruction tg((Reconstruction::Builder)m_hierarchyBuilder, m_spatialSplits, m_motionPartition, (Reconstruction::DensityEngine)m_densityEngine);
 			if(m_haveSampleBuffer && !(m_vizDone&(1<<viz)))
 			{
 				m_vizDone |= (1<<viz);
 				m_vizDone |= (1<<VIZ_DEBUG);						// HACK
 				getChannel(*m_images[viz],CH_INDIRECT);				// for active window
+				m_samples->loadChannels(Reconstruction::CHANNELS_ATROUS);
 				filterNormals(*m_samples);
 				tg.reconstructATrous(*m_samples,*m_images[viz],m_images[VIZ_DEBUG],aoLength);			
 			}
@@ -43,6 +43,7 @@ private:
         Action_None,
 		Action_LoadSampleBuffer,
 		Action_SaveSampleBuffer,
+		Action_SaveSampleBufferCompact,
 		Action_ClearImages,
     };
 
@@ -129,6 +130,10 @@ private:
 	S32					m_showImage;
 	S32					m_showChannel;
 	S32					m_reconstructionMode;
+	S32					m_hierarchyBuilder;			// Reconstruction::Builder
+	bool				m_spatialSplits;
+	bool				m_motionPartition;
+	S32					m_densityEngine;			// Reconstruction::DensityEngine
 };
 
 //------------------------------------------------------------------------
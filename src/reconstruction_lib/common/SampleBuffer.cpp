@@ -31,9 +31,12 @@
 #include "SampleBuffer.hpp"
 #include "Util.hpp"
 #include "base/Sort.hpp"
+#include "base/MulticoreLauncher.hpp"
 #include "gui/Image.hpp"
 #include "3d/ConvexPolyhedron.hpp"
+#include "io/File.hpp"
 #include <cstdio>
+#include <cstring>
 
 namespace FW
 {
@@ -105,6 +108,41 @@ bool SampleBuffer::needRealloc(int w,int h, int numSamplesPerPixel) const
 	return false;
 }
 
+int SampleBuffer::getKnownChannelSlot(const String& name)
+{
+	const char* names[NUM_KNOWN_CHANNELS] =		// indexed by CHANNEL_SLOT_*
+	{
+		CID_PRI_MV_NAME,
+		CID_PRI_NORMAL_NAME,
+		CID_ALBEDO_NAME,
+		CID_SEC_ORIGIN_NAME,
+		CID_SEC_HITPOINT_NAME,
+		CID_SEC_MV_NAME,
+		CID_SEC_NORMAL_NAME,
+		CID_DIRECT_NAME,
+		CID_SEC_ALBEDO_NAME,
+		CID_SEC_DIRECT_NAME,
+		CID_PRI_NORMAL_SMOOTH_NAME,
+		CID_SEC_HITPOINT_T0_NAME,
+	};
+	for(int i=0;i<NUM_KNOWN_CHANNELS;i++)
+		if(name == names[i])
+			return i;
+	return -1;
+}
+
+int SampleBuffer::getChannelID(const String& name) const
+{
+	int slot = getKnownChannelSlot(name);
+	if(slot != -1)
+		return (slot<m_channels.getSize() && m_channels[slot]) ? slot : -1;
+
+	for(int i=NUM_KNOWN_CHANNELS;i<m_channels.getSize();i++)
+		if(m_channels[i] && m_channels[i]->name == name)
+			return i;
+	return -1;
+}
+
 void SampleBuffer::clear(const Vec4f& color,float depth,float w)
 {
 	for(int y=0;y<m_height;y++)
@@ -161,6 +199,16 @@ UVTSampleBuffer::UVTSampleBuffer(int w,int h, int numSamplesPerPixel)
 	m_cocCoeff			= Vec2f(FW_F32_MAX,FW_F32_MAX);
 	m_version			= 1.3f;
 	m_pixelToFocalPlane = Mat4f();
+	m_mapFile			= NULL;
+	m_mapping			= NULL;
+	m_mapView			= NULL;
+	m_fileDataOffset	= 0;
+	m_fileBinary		= false;
+	m_fileTileSize		= 0;
+	m_loadedChannels	= 0;
+	m_ingesting			= false;
+	m_ingestT0			= false;
+	m_ingestStats		= false;
 
 	m_uv.reset(m_width*m_height*m_numSamplesPerPixel);
 	m_t. reset(m_width*m_height*m_numSamplesPerPixel);
@@ -178,9 +226,703 @@ UVTSampleBuffer::UVTSampleBuffer(int w,int h, int numSamplesPerPixel)
 	generateSobolCoop(random);
 }
 
-UVTSampleBuffer::UVTSampleBuffer(const char* filename)
+//-------------------------------------------------------------------
+// Sample import. Text is read in large blocks; each block is split
+// into newline-aligned chunks that are parsed on all cores straight
+// into the final sample slots. Binary data is read in bounded blocks.
+//-------------------------------------------------------------------
+
+static const char* getFileChannelName(int c)
+{
+	const char* names[] =		// in file order, matches SCH_*
+	{
+		CID_PRI_NORMAL_NAME,
+		CID_ALBEDO_NAME,
+		CID_SEC_ORIGIN_NAME,
+		CID_SEC_HITPOINT_NAME,
+		CID_SEC_MV_NAME,
+		CID_SEC_NORMAL_NAME,
+		CID_DIRECT_NAME,
+		CID_SEC_ALBEDO_NAME,
+		CID_SEC_DIRECT_NAME,
+	};
+	FW_ASSERT(c>=0 && c<FW_ARRAY_SIZE(names));
+	return names[c];
+}
+
+int UVTSampleBuffer::getNumFileChannels(void) const
+{
+	if(m_version == 2.0f || m_version == 2.1f)	return 7;
+	if(m_version == 2.2f || m_version == 3.0f)	return 9;
+	return 0;
+}
+
+void UVTSampleBuffer::reserveFileChannels(int* cids, U32 channelMask)
+{
+	for(int c=0;c<getNumFileChannels();c++)
+	{
+		cids[c] = -1;
+		if(channelMask & (1<<c))
+		{
+			cids[c] = reserveChannel<Vec3f>(getFileChannelName(c));
+			m_loadedChannels |= 1<<c;
+		}
+	}
+}
+
+void UVTSampleBuffer::mapFileChannels(U32 channelMask)
+{
+	FW_ASSERT(m_mapView && m_version == 2.2f);
+	const Entry22* entries = (const Entry22*)((const U8*)m_mapView + m_fileDataOffset);
+	const UnalignedVec3f* extra = &entries->pri_normal;
+
+	for(int c=0;c<getNumFileChannels();c++)
+		if(channelMask & (1<<c))
+		{
+			mapChannel<Vec3f>(getFileChannelName(c), extra+c, sizeof(Entry22), m_xy.getSize());
+			m_loadedChannels |= 1<<c;
+		}
+}
+
+void UVTSampleBuffer::readSamples(FILE* fp, int num, const int* cids, bool base, U32 channelMask)
+{
+	const int numCids = getNumFileChannels();
+	beginIngest(channelMask);
+
+	if(m_version == 1.3f)
+	{
+		if(m_fileBinary)	readBinary<Entry13>(num, cids,numCids, base, "1.3");
+		else				parseText <Entry13>(fp, num, cids,numCids, base, "1.3");
+	}
+	else if(m_version == 2.0f)
+	{
+		if(m_fileBinary)	readBinary<Entry20>(num, cids,numCids, base, "2.0");
+		else				parseText <Entry20>(fp, num, cids,numCids, base, "2.0");
+	}
+	else if(m_version == 2.1f)
+	{
+		if(m_fileBinary)	readBinary<Entry21>(num, cids,numCids, base, "2.1");
+		else				parseText <Entry21>(fp, num, cids,numCids, base, "2.1");
+	}
+	else if(m_version == 2.2f)
+	{
+		if(m_fileBinary)	readBinary<Entry22>(num, cids,numCids, base, "2.2");
+		else				parseText <Entry22>(fp, num, cids,numCids, base, "2.2");
+	}
+	else if(m_version == 3.0f)
+	{
+		if(m_fileBinary)	readBinary30(num, cids,numCids, base);
+		else				fail("Fileformat 3.0: only binary encoding is supported");
+	}
+	else
+		fail("Unsupported sample stream version (%.1f)", m_version);
+
+	endIngest();
+}
+
+//-------------------------------------------------------------------
+// Streaming ingest. While blocks of samples arrive, the t=0 secondary
+// hit points (the Morton payload of ReconstructIndirect) are computed
+// if SCH_SEC_HITPOINT_T0 was requested. Unless the header had a
+// statistics block, their bounds and the invalid count are gathered as
+// well, so that no extra passes over the buffer are needed later.
+// Each block is split among all cores.
+//-------------------------------------------------------------------
+
+struct UVTSampleBuffer::IngestTask
+{
+	UVTSampleBuffer*	sbuf;
+	int					begin;			// sample indices
+	int					end;
+	SampleBufferStats	stats;			// bounds and numInvalid of [begin,end)
+
+	static void ingest(MulticoreLauncher::Task& task)
+	{
+		IngestTask& t = *(IngestTask*)task.data;
+		UVTSampleBuffer& sbuf = *t.sbuf;
+		const StridedArray<Vec3f>& hitpoints = sbuf.getChannel(CHANNEL_SEC_HITPOINT);
+		const StridedArray<Vec3f>& mvs       = sbuf.getChannel(CHANNEL_SEC_MV);
+		StridedArray<Vec3f>* hitpointsT0     = sbuf.m_ingestT0 ? &sbuf.getChannel(CHANNEL_SEC_HITPOINT_T0) : NULL;
+
+		for(int i=t.begin;i<t.end;i++)
+		{
+			const Vec3f p = hitpoints[i];
+			if(p.max() < 1e10f)		// valid?
+			{
+				const Vec3f pt0 = p - sbuf.m_t[i]*mvs[i];
+				if(hitpointsT0)
+					(*hitpointsT0)[i] = pt0;
+				if(sbuf.m_ingestStats)
+				{
+					const Vec3f pt1 = pt0 + mvs[i];
+					t.stats.hitpointMinT0 = min(t.stats.hitpointMinT0, pt0);
+					t.stats.hitpointMaxT0 = max(t.stats.hitpointMaxT0, pt0);
+					t.stats.hitpointMinT1 = min(t.stats.hitpointMinT1, pt1);
+					t.stats.hitpointMaxT1 = max(t.stats.hitpointMaxT1, pt1);
+				}
+			}
+			else
+			{
+				if(hitpointsT0)
+					(*hitpointsT0)[i] = Vec3f(FW_F32_MAX);
+				t.stats.numInvalid++;
+			}
+		}
+	}
+};
+
+void UVTSampleBuffer::beginIngest(U32 channelMask)
+{
+	const bool sources = getChannelID(CID_SEC_HITPOINT_NAME)!=-1 && getChannelID(CID_SEC_MV_NAME)!=-1;
+	m_ingestT0    = sources && (channelMask & SCH_SEC_HITPOINT_T0) && getChannelID(CID_SEC_HITPOINT_T0_NAME)==-1;
+	m_ingestStats = sources && !m_stats.valid;
+	m_ingesting   = m_ingestT0 || m_ingestStats;
+
+	if(m_ingestT0)
+		reserveChannel<Vec3f>(CID_SEC_HITPOINT_T0_NAME);
+	if(m_ingestStats)
+		m_stats = SampleBufferStats();
+}
+
+void UVTSampleBuffer::ingestSamples(int first, int num)
+{
+	if(!m_ingesting)
+		return;
+
+	const int numTasks = MulticoreLauncher::getNumCores();
+	Array<IngestTask> tasks;
+	tasks.reset(numTasks);
+	MulticoreLauncher launcher;
+	for(int i=0;i<numTasks;i++)
+	{
+		IngestTask& t = tasks[i];
+		t.sbuf  = this;
+		t.begin = first + (int)((S64)num*i/numTasks);
+		t.end   = first + (int)((S64)num*(i+1)/numTasks);
+		t.stats = SampleBufferStats();
+		launcher.push(IngestTask::ingest, &t, i,1);
+	}
+	launcher.popAll();
+
+	if(m_ingestStats)
+		for(int i=0;i<numTasks;i++)
+		{
+			const SampleBufferStats& s = tasks[i].stats;
+			m_stats.hitpointMinT0 = min(m_stats.hitpointMinT0, s.hitpointMinT0);
+			m_stats.hitpointMaxT0 = max(m_stats.hitpointMaxT0, s.hitpointMaxT0);
+			m_stats.hitpointMinT1 = min(m_stats.hitpointMinT1, s.hitpointMinT1);
+			m_stats.hitpointMaxT1 = max(m_stats.hitpointMaxT1, s.hitpointMaxT1);
+			m_stats.numInvalid   += s.numInvalid;
+		}
+}
+
+void UVTSampleBuffer::endIngest(void)
+{
+	if(m_ingestStats)
+		m_stats.valid = true;
+	m_ingesting   = false;
+	m_ingestT0    = false;
+	m_ingestStats = false;
+}
+
+// Optional statistics block between the header fields and the encoding:
+//
+//   Statistics samples <numMomentSamples>, invalid <numInvalid>
+//   Statistics sec_hitpoint bounds t=0: min(3),max(3)
+//   Statistics sec_hitpoint bounds t=1: min(3),max(3)
+//   Statistics color mean,stddev,max: mean(3),stddev(3),max(3)
+//   Statistics <channel> mean,stddev: mean(3),stddev(3)		for each extra channel in file order
+
+bool UVTSampleBuffer::readStats(FILE* fph)
+{
+	SampleBufferStats& s = m_stats;
+	if(fscanf(fph, "Statistics samples %d, invalid %d\n", &s.numMomentSamples,&s.numInvalid) != 2)
+		return false;
+
+	float v[9];
+	if(fscanf(fph, "Statistics sec_hitpoint bounds t=0: %f,%f,%f,%f,%f,%f\n", v+0,v+1,v+2,v+3,v+4,v+5) != 6)
+		fail("Statistics: sec_hitpoint bounds at t=0 need to specify 6 values");
+	s.hitpointMinT0 = Vec3f(v[0],v[1],v[2]);
+	s.hitpointMaxT0 = Vec3f(v[3],v[4],v[5]);
+
+	if(fscanf(fph, "Statistics sec_hitpoint bounds t=1: %f,%f,%f,%f,%f,%f\n", v+0,v+1,v+2,v+3,v+4,v+5) != 6)
+		fail("Statistics: sec_hitpoint bounds at t=1 need to specify 6 values");
+	s.hitpointMinT1 = Vec3f(v[0],v[1],v[2]);
+	s.hitpointMaxT1 = Vec3f(v[3],v[4],v[5]);
+
+	if(fscanf(fph, "Statistics color mean,stddev,max: %f,%f,%f,%f,%f,%f,%f,%f,%f\n", v+0,v+1,v+2,v+3,v+4,v+5,v+6,v+7,v+8) != 9)
+		fail("Statistics: color needs to specify 9 values");
+	s.colorMean   = Vec3f(v[0],v[1],v[2]);
+	s.colorStddev = Vec3f(v[3],v[4],v[5]);
+	s.colorMax    = Vec3f(v[6],v[7],v[8]);
+
+	for(int c=0;c<getNumFileChannels();c++)
+	{
+		char name[1024];
+		if(fscanf(fph, "Statistics %1023s mean,stddev: %f,%f,%f,%f,%f,%f\n", name, v+0,v+1,v+2,v+3,v+4,v+5) != 7 || String(name) != String(getFileChannelName(c)))
+			fail("Statistics: expected mean and stddev of %s", getFileChannelName(c));
+		s.channelMean  [c] = Vec3f(v[0],v[1],v[2]);
+		s.channelStddev[c] = Vec3f(v[3],v[4],v[5]);
+	}
+
+	s.valid      = true;
+	s.hasMoments = true;
+	return true;
+}
+
+//-------------------------------------------------------------------
+
+// Reads consecutive records in blocks with two asynchronous reads in flight,
+// so that the caller's work on one block overlaps the read of the next.
+
+template<class Entry> class AsyncRecordReader
+{
+public:
+	AsyncRecordReader(File& file, int num, const char* version)
+	:	m_file		(file),
+		m_num		(num),
+		m_numIssued	(0),
+		m_numDone	(0),
+		m_block		(0),
+		m_version	(version)
+	{
+		m_blockEntries = max((int)(File::MaxBytesPerSysCall / sizeof(Entry)), 1);
+		for(int i=0;i<2;i++)
+		{
+			m_buffers[i].reset(min(num,m_blockEntries));
+			m_ops[i] = NULL;
+			issue(i);
+		}
+	}
+
+	~AsyncRecordReader(void)
+	{
+		for(int i=0;i<2;i++)
+			if(m_ops[i])
+			{
+				m_ops[i]->wait();
+				delete m_ops[i];
+			}
+	}
+
+	// Returns the next block (valid until the following call), or NULL at the end.
+
+	const Entry* next(int& first, int& num)
+	{
+		if(m_numDone >= m_num)
+			return NULL;
+
+		const int b = m_block++ & 1;
+		m_ops[b]->wait();
+		const int numBytes = m_ops[b]->getNumBytes();
+		delete m_ops[b];
+		m_ops[b] = NULL;
+
+		first = m_numDone;
+		num   = min(m_blockEntries, m_num-m_numDone);
+		if(numBytes != num*(int)sizeof(Entry))
+			fail("Fileformat %s: Buffer contains fewer samples than expected", m_version);
+		m_numDone += num;
+
+		issue(1-b);			// the other buffer was consumed by the previous call
+		return m_buffers[b].getPtr();
+	}
+
+private:
+	void issue(int b)
+	{
+		if(m_numIssued >= m_num || m_ops[b])
+			return;
+		const int n = min(m_blockEntries, m_num-m_numIssued);
+		m_ops[b] = m_file.readAsync(m_buffers[b].getPtr(), n*sizeof(Entry));
+		m_numIssued += n;
+	}
+
+	AsyncRecordReader(const AsyncRecordReader&);				// forbidden
+	AsyncRecordReader& operator=(const AsyncRecordReader&);	// forbidden
+
+	File&				m_file;
+	int					m_num;
+	int					m_numIssued;
+	int					m_numDone;
+	int					m_block;
+	int					m_blockEntries;
+	const char*			m_version;
+	Array<Entry>		m_buffers[2];
+	File::AsyncOp*		m_ops[2];
+};
+
+void UVTSampleBuffer::storeEntry(int idx, const Entry13& e, const int* cids, int numCids, bool base)
+{
+	FW_UNREF(cids);
+	FW_UNREF(numCids);
+	if(!base)
+		return;
+	m_xy   [idx] = Vec2f(e.x,e.y);
+	m_depth[idx] = e.z;
+	m_w    [idx] = e.w;
+	m_uv   [idx] = Vec2f(e.u,e.v);
+	m_t    [idx] = e.t;
+	m_color[idx] = Vec4f(e.r,e.g,e.b,1);			// TODO: alpha
+	m_mv   [idx] = Vec3f(e.mv_x,e.mv_y,e.mv_w);
+	m_wg   [idx] = Vec2f(e.dwdx,e.dwdy);
+}
+
+template<class Entry> void UVTSampleBuffer::storeEntry(int idx, const Entry& e, const int* cids, int numCids, bool base)
+{
+	if(base)
+	{
+		m_xy   [idx] = Vec2f(e.x,e.y);
+		m_w    [idx] = e.w;
+		m_uv   [idx] = Vec2f(e.u,e.v);
+		m_t    [idx] = e.t;
+		m_color[idx] = Vec4f(e.r,e.g,e.b,1);
+		m_mv   [idx] = e.pri_mv;
+		m_depth[idx] = 0;							// clear unused
+		m_wg   [idx] = Vec2f(0);					// clear unused
+	}
+
+	const UnalignedVec3f* extra = &e.pri_normal;	// extra channels are stored back-to-back in file order
+	for(int c=0;c<numCids;c++)
+		if(cids[c] != -1)
+			getChannelData<Vec3f>(cids[c])[idx] = extra[c];
+}
+
+template<class Entry> void UVTSampleBuffer::readBinary(int num, const int* cids, int numCids, bool base, const char* version)
+{
+	File file(m_fileName, File::Read);
+	file.seek(m_fileDataOffset);
+	AsyncRecordReader<Entry> reader(file, num, version);
+
+	int first, n;
+	while(const Entry* entries = reader.next(first,n))
+	{
+		for(int i=0;i<n;i++)
+			storeEntry(first+i, entries[i], cids,numCids, base);
+		ingestSamples(first, n);
+	}
+}
+
+template<class Entry> struct UVTSampleBuffer::TextChunk
+{
+	UVTSampleBuffer*	sbuf;
+	const int*			cids;
+	int					numCids;
+	bool				base;
+	const char*			begin;
+	const char*			end;
+	int					firstEntry;
+	int					numLines;			// non-blank lines; clamped to the remaining entries before parsing
+	int					numBadLines;
+	int					firstBadNumArgs;
+
+	static bool isBlank(const char* ptr, const char* lineEnd)
+	{
+		for(;ptr<lineEnd;ptr++)
+			if(*ptr!=' ' && *ptr!='\t' && *ptr!='\r')
+				return false;
+		return true;
+	}
+
+	static void count(MulticoreLauncher::Task& task)
+	{
+		TextChunk& c = *(TextChunk*)task.data;
+		c.numLines = 0;
+		for(const char* ptr=c.begin; ptr<c.end; )
+		{
+			const char* lineEnd = (const char*)memchr(ptr,'\n',c.end-ptr);
+			if(!lineEnd)
+				lineEnd = c.end;
+			if(!isBlank(ptr,lineEnd))
+				c.numLines++;
+			ptr = lineEnd+1;
+		}
+	}
+
+	static void parse(MulticoreLauncher::Task& task)
+	{
+		TextChunk& c = *(TextChunk*)task.data;
+		const int NUM_ARGS = sizeof(Entry)/sizeof(float);
+		const int w = c.sbuf->m_width;
+		const int h = c.sbuf->m_height;
+		FW_UNREF(w);
+		FW_UNREF(h);
+
+		c.numBadLines = 0;
+		int sidx = c.firstEntry;
+		for(const char* ptr=c.begin; ptr<c.end && sidx<c.firstEntry+c.numLines; )
+		{
+			const char* lineEnd = (const char*)memchr(ptr,'\n',c.end-ptr);
+			if(!lineEnd)
+				lineEnd = c.end;
+			if(isBlank(ptr,lineEnd))
+			{
+				ptr = lineEnd+1;
+				continue;
+			}
+
+			// parseSpace() does not skip newlines, so parsing cannot run into the next line. The last line
+			// of the file may lack one, parseText() terminates the block with '\0' for that.
+			Entry e;
+			float* vals = (float*)&e;
+			const char* linePtr = ptr;
+			int numRead = 0;
+			for(int v=0;v<NUM_ARGS;v++)
+			{
+				parseSpace(linePtr);
+				parseChar (linePtr,',');
+				parseSpace(linePtr);
+				if(parseFloat(linePtr,vals[v]))
+					numRead++;
+			}
+
+			if(numRead != NUM_ARGS)
+			{
+				if(!c.numBadLines++)
+					c.firstBadNumArgs = numRead;
+			}
+			else
+			{
+				FW_ASSERT(e.x>=0 && e.y>=0 && e.x<w && e.y<h);
+				FW_ASSERT(e.u>=-1 && e.v>=-1 && e.u<=1 && e.v<=1);
+				FW_ASSERT(e.t>=0 && e.t<=1);
+			}
+
+			c.sbuf->storeEntry(sidx++, e, c.cids,c.numCids, c.base);
+			ptr = lineEnd+1;
+		}
+	}
+};
+
+template<class Entry> void UVTSampleBuffer::parseText(FILE* fp, int num, const int* cids, int numCids, bool base, const char* version)
+{
+	const int BLOCK_SIZE = 64<<20;
+	const int numChunks  = MulticoreLauncher::getNumCores()*4;
+
+	Array<char> buffer;
+	buffer.reset(2*BLOCK_SIZE+1);		// carried-over partial line + new block + terminator
+	Array<TextChunk<Entry> > chunks;
+	chunks.reset(numChunks);
+	MulticoreLauncher launcher;
+
+	int  numCarry  = 0;
+	int  numParsed = 0;
+	bool eof       = false;
+	while(numParsed<num && !eof)
+	{
+		const int numRead = (int)fread(buffer.getPtr(numCarry),1,BLOCK_SIZE,fp);
+		eof = (numRead < BLOCK_SIZE);
+
+		// Parse up to the last newline, or everything at the end of the file.
+
+		const int size = numCarry+numRead;
+		buffer[size] = '\0';				// stops parseFloat() etc. on a final line without a newline, instead of stale bytes of the previous block
+		int numComplete = size;
+		if(!eof)
+			while(numComplete>0 && buffer[numComplete-1]!='\n')
+				numComplete--;
+		if(numComplete==0 && !eof)
+			fail("Fileformat %s: Line too long", version);
+
+		// Split into newline-aligned chunks and count lines, so that each chunk knows where its samples go.
+
+		const char* blockBegin = buffer.getPtr();
+		const char* ptr        = blockBegin;
+		for(int i=0;i<numChunks;i++)
+		{
+			const char* end = max(ptr, blockBegin + (S64)numComplete*(i+1)/numChunks);
+			while(end>blockBegin && end<blockBegin+numComplete && end[-1]!='\n')
+				end++;
+
+			TextChunk<Entry>& c = chunks[i];
+			c.sbuf    = this;
+			c.cids    = cids;
+			c.numCids = numCids;
+			c.base    = base;
+			c.begin   = ptr;
+			c.end     = end;
+			launcher.push(TextChunk<Entry>::count, &c, i,1);
+			ptr = end;
+		}
+		launcher.popAll();
+
+		const int firstInBlock = numParsed;
+		for(int i=0;i<numChunks;i++)
+		{
+			TextChunk<Entry>& c = chunks[i];
+			c.firstEntry = numParsed;
+			c.numLines   = min(c.numLines, num-numParsed);	// extra lines at the end are ignored
+			numParsed   += c.numLines;
+			launcher.push(TextChunk<Entry>::parse, &c, i,1);
+		}
+		launcher.popAll();
+
+		for(int i=0;i<numChunks;i++)
+			if(chunks[i].numBadLines)
+				fail("Fileformat %s: Wrong number of arguments per line (expected %d, got %d)", version, (int)(sizeof(Entry)/sizeof(float)), chunks[i].firstBadNumArgs);
+		ingestSamples(firstInBlock, numParsed-firstInBlock);
+
+		printf("Parsing: %d%%\r", (int)(100*(S64)numParsed/max(num,1)));
+
+		numCarry = size-numComplete;
+		memmove(buffer.getPtr(), buffer.getPtr(numComplete), numCarry);
+	}
+	printf("                                               \r");
+
+	if(numParsed<num)
+		fail("Fileformat %s: Buffer contains fewer samples than expected", version);
+}
+
+//-------------------------------------------------------------------
+// V3.0: quantized records plus a table of per-tile point boxes.
+//-------------------------------------------------------------------
+
+static const U16 INVALID_POINT30 = 0xFFFF;	// in all three components
+
+static inline void  encodeHalf3		(U16* h, const Vec3f& v)	{ for(int i=0;i<3;i++) h[i] = floatToHalf(v[i]); }
+static inline Vec3f decodeHalf3		(const U16* h)				{ return Vec3f(halfToFloat(h[0]),halfToFloat(h[1]),halfToFloat(h[2])); }
+static inline void  encodeNormal30	(S16* q, const Vec3f& n)	{ const Vec2f e = octEncode(n); q[0] = quantizeSnorm16(e.x); q[1] = quantizeSnorm16(e.y); }
+static inline Vec3f decodeNormal30	(const S16* q)				{ return octDecode(Vec2f(dequantizeSnorm16(q[0]),dequantizeSnorm16(q[1]))); }
+static inline bool  isValidPoint	(const Vec3f& p)			{ return p.max() < 1e10f; }
+
+static inline void encodePoint30(U16* q, const Vec3f& p, const Vec3f& mn, const Vec3f& scale)
+{
+	for(int i=0;i<3;i++)
+		q[i] = isValidPoint(p) ? (U16)min(scale[i] ? int((p[i]-mn[i])/scale[i]+0.5f) : 0, (int)INVALID_POINT30-1) : INVALID_POINT30;
+}
+
+static inline Vec3f decodePoint30(const U16* q, const Vec3f& mn, const Vec3f& scale)
+{
+	if(q[0]==INVALID_POINT30 && q[1]==INVALID_POINT30 && q[2]==INVALID_POINT30)
+		return Vec3f(FW_F32_MAX);
+	return mn + Vec3f(q[0],q[1],q[2])*scale;
+}
+
+int UVTSampleBuffer::getTileIndex30(int idx, int tileSize) const
+{
+	const int pixel   = idx / m_numSamplesPerPixel;
+	const int tilesX  = (m_width+tileSize-1) / tileSize;
+	return (pixel/m_width/tileSize)*tilesX + (pixel%m_width)/tileSize;
+}
+
+void UVTSampleBuffer::storeEntry(int idx, const Entry30& e, const Tile30& tile, const int* cids, int numCids, bool base)
+{
+	if(base)
+	{
+		const int pixel = idx / m_numSamplesPerPixel;
+		m_xy   [idx] = Vec2f(float(pixel%m_width), float(pixel/m_width)) + (Vec2f(e.x,e.y)+0.5f)*(1.f/65536.f);
+		m_w    [idx] = e.w;
+		m_uv   [idx] = Vec2f(dequantizeSnorm16(e.u),dequantizeSnorm16(e.v));
+		m_t    [idx] = dequantizeUnorm16(e.t);
+		m_color[idx] = Vec4f(decodeHalf3(e.rgb),1);
+		m_mv   [idx] = decodeHalf3(e.pri_mv);
+		m_depth[idx] = 0;							// clear unused
+		m_wg   [idx] = Vec2f(0);					// clear unused
+	}
+
+	for(int c=0;c<numCids;c++)
+	{
+		if(cids[c] == -1)
+			continue;
+
+		Vec3f v;
+		switch(c)		// file order, see SCH_*
+		{
+		case 0:	v = decodeNormal30(e.pri_normal); break;
+		case 1:	v = decodeHalf3(e.albedo); break;
+		case 2:	v = decodePoint30(e.sec_origin,   tile.originMin,   tile.originScale); break;
+		case 3:	v = decodePoint30(e.sec_hitpoint, tile.hitpointMin, tile.hitpointScale); break;
+		case 4:	v = decodeHalf3(e.sec_mv); break;
+		case 5:	v = decodeNormal30(e.sec_normal); break;
+		case 6:	v = decodeHalf3(e.direct); break;
+		case 7:	v = decodeHalf3(e.sec_albedo); break;
+		case 8:	v = decodeHalf3(e.sec_direct); break;
+		default: FW_ASSERT(0);
+		}
+		getChannelData<Vec3f>(cids[c])[idx] = v;
+	}
+}
+
+struct UVTSampleBuffer::DecodeTask30
+{
+	UVTSampleBuffer*	sbuf;
+	const Entry30*		entries;
+	const Tile30*		tiles;
+	const int*			cids;
+	int					numCids;
+	bool				base;
+	int					firstEntry;
+	int					begin;			// within entries
+	int					end;
+
+	static void decode(MulticoreLauncher::Task& task)
+	{
+		DecodeTask30& d = *(DecodeTask30*)task.data;
+		for(int i=d.begin;i<d.end;i++)
+		{
+			const int idx = d.firstEntry+i;
+			d.sbuf->storeEntry(idx, d.entries[i], d.tiles[d.sbuf->getTileIndex30(idx,d.sbuf->m_fileTileSize)], d.cids,d.numCids, d.base);
+		}
+	}
+};
+
+void UVTSampleBuffer::readBinary30(int num, const int* cids, int numCids, bool base)
+{
+	FW_ASSERT(m_fileTileSize > 0);
+	const int numTiles = ((m_width+m_fileTileSize-1)/m_fileTileSize) * ((m_height+m_fileTileSize-1)/m_fileTileSize);
+	const int numTasks = MulticoreLauncher::getNumCores();
+
+	File file(m_fileName, File::Read);
+	file.seek(m_fileDataOffset);
+
+	Array<Tile30> tiles;
+	tiles.reset(numTiles);
+	if(file.read(tiles.getPtr(), numTiles*sizeof(Tile30)) != numTiles*(int)sizeof(Tile30))
+		fail("Fileformat 3.0: Tile table is truncated");
+
+	AsyncRecordReader<Entry30> reader(file, num, "3.0");
+	Array<DecodeTask30> tasks;
+	tasks.reset(numTasks);
+	MulticoreLauncher launcher;
+
+	int first, n;
+	while(const Entry30* entries = reader.next(first,n))
+	{
+		for(int i=0;i<numTasks;i++)
+		{
+			DecodeTask30& d = tasks[i];
+			d.sbuf       = this;
+			d.entries    = entries;
+			d.tiles      = tiles.getPtr();
+			d.cids       = cids;
+			d.numCids    = numCids;
+			d.base       = base;
+			d.firstEntry = first;
+			d.begin      = (int)((S64)n*i/numTasks);
+			d.end        = (int)((S64)n*(i+1)/numTasks);
+			launcher.push(DecodeTask30::decode, &d, i,1);
+		}
+		launcher.popAll();
+		ingestSamples(first, n);
+	}
+}
+
+//-------------------------------------------------------------------
+
+UVTSampleBuffer::UVTSampleBuffer(const char* filename, bool memoryMapped, U32 channelMask)
 {
 	m_irregular = false;
+	m_mapFile   = NULL;
+	m_mapping   = NULL;
+	m_mapView   = NULL;
+	m_fileName  = filename;
+	m_fileDataOffset = 0;
+	m_fileBinary     = false;
+	m_fileTileSize   = 0;
+	m_loadedChannels = 0;
+	m_ingesting      = false;
+	m_ingestT0       = false;
+	m_ingestStats    = false;
 
 	FILE* fp  = fopen(filename, "rb");
 	if(!fp)
@@ -273,77 +1015,25 @@ UVTSampleBuffer::UVTSampleBuffer(const char* filename)
 		char descriptor[1024];
 		fscanf(fph, "%s\n", descriptor);
 
+		m_fileBinary     = binary;
+		m_fileDataOffset = separateHeader ? 0 : _ftelli64(fp);
+
 		// Reserve buffers.
 
-		m_xy   .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_uv   .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_t    .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_color.reset(m_width*m_height*m_numSamplesPerPixel);
-		m_depth.reset(m_width*m_height*m_numSamplesPerPixel);
-		m_w    .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_mv   .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_wg   .reset(m_width*m_height*m_numSamplesPerPixel);
+		const int num = m_width*m_height*m_numSamplesPerPixel;
+		m_xy   .reset(num);
+		m_uv   .reset(num);
+		m_t    .reset(num);
+		m_color.reset(num);
+		m_depth.reset(num);
+		m_w    .reset(num);
+		m_mv   .reset(num);
+		m_wg   .reset(num);
 
 		// Parse samples.
 
-		Array<Entry13> entries;
-		const int num = m_width*m_height*m_numSamplesPerPixel;
-		entries.reset(num);
-
 		printf("\n");
-		if(binary)
-		{
-			fread(entries.getPtr(),sizeof(Entry13),num,fp);
-		}
-		else
-		{
-			char line[4096];
-			int sidx = 0;
-			for(int y=0;y<m_height;y++)
-			{
-				for(int x=0;x<m_width;x++)
-				for(int i=0;i<getNumSamples(x,y);i++)
-				{
-					fgets(line,4096,fp);
-					const char* linePtr = line;
-					const int NUM_ARGS = sizeof(Entry13)/sizeof(float);
-					Entry13& e = entries[sidx++];
-					float* vals = (float*)&e;
-					int numRead = 0;
-					for(int v=0;v<NUM_ARGS;v++)
-					{
-						parseSpace(linePtr);
-						parseChar (linePtr,',');
-						parseSpace(linePtr);
-						if(parseFloat(linePtr,vals[v]))
-							numRead++;
-					}
-
-					FW_ASSERT(numRead == NUM_ARGS);
-					FW_ASSERT(e.x>=0 && e.y>=0 && e.x<m_width && e.y<m_height);
-					FW_ASSERT(e.u>=-1 && e.v>=-1 && e.u<=1 && e.v<=1);
-					FW_ASSERT(e.t>=0 && e.t<=1);
-				}
-				printf("Parsing: %d%%\r", 100*y/m_height);
-			}
-			printf("                                               \r");
-		}
-		
-		int sidx = 0;
-		for(int y=0;y<m_height;y++)
-		for(int x=0;x<m_width;x++)
-		for(int i=0;i<getNumSamples(x,y);i++)
-		{
-			const Entry13& e = entries[sidx++];
-			setSampleXY				(x,y,i, Vec2f(e.x,e.y));
-			setSampleDepth			(x,y,i, e.z);
-			setSampleW				(x,y,i, e.w);
-			setSampleUV				(x,y,i, Vec2f(e.u,e.v));
-			setSampleT 				(x,y,i, e.t);
-			setSampleColor			(x,y,i, Vec4f(e.r,e.g,e.b,1));			// TODO: alpha
-			setSampleMV				(x,y,i, Vec3f(e.mv_x,e.mv_y,e.mv_w));
-			setSampleWG				(x,y,i, Vec2f(e.dwdx,e.dwdy));
-		}
+		readSamples(fp, num, NULL, true, channelMask);
 	}
 	else if(m_version == 2.0f)
 	{
@@ -369,96 +1059,28 @@ UVTSampleBuffer::UVTSampleBuffer(const char* filename)
 		char descriptor[1024];
 		fscanf(fph, "%s\n", descriptor);
 
-		// Reserve buffers.
+		m_fileBinary     = binary;
+		m_fileDataOffset = separateHeader ? 0 : _ftelli64(fp);
 
-		m_xy   .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_uv   .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_t    .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_color.reset(m_width*m_height*m_numSamplesPerPixel);
-		m_depth.reset(m_width*m_height*m_numSamplesPerPixel);		// not used
-		m_w    .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_mv   .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_wg   .reset(m_width*m_height*m_numSamplesPerPixel);		// not used
+		// Reserve buffers.
 
-		const int CID_PRI_NORMAL   = reserveChannel<Vec3f>(CID_PRI_NORMAL_NAME);
-		const int CID_ALBEDO       = reserveChannel<Vec3f>(CID_ALBEDO_NAME);
-		const int CID_SEC_ORIGIN   = reserveChannel<Vec3f>(CID_SEC_ORIGIN_NAME);
-		const int CID_SEC_HITPOINT = reserveChannel<Vec3f>(CID_SEC_HITPOINT_NAME);
-		const int CID_SEC_MV       = reserveChannel<Vec3f>(CID_SEC_MV_NAME);
-		const int CID_SEC_NORMAL   = reserveChannel<Vec3f>(CID_SEC_NORMAL_NAME);
-		const int CID_DIRECT       = reserveChannel<Vec3f>(CID_DIRECT_NAME);
+		const int num = m_width*m_height*m_numSamplesPerPixel;
+		m_xy   .reset(num);
+		m_uv   .reset(num);
+		m_t    .reset(num);
+		m_color.reset(num);
+		m_depth.reset(num);		// not used
+		m_w    .reset(num);
+		m_mv   .reset(num);
+		m_wg   .reset(num);		// not used
+
+		int cids[SCH_NUM];		// in file order, -1 = not loaded
+		reserveFileChannels(cids, channelMask);
 
 		// Parse samples.
 
-		Array<Entry20> entries;
-		const int num = m_width*m_height*m_numSamplesPerPixel;
-		entries.reset(num);
-
 		printf("\n");
-		if(binary)
-		{
-			fread(entries.getPtr(),sizeof(Entry20),num,fp);
-		}
-		else
-		{
-			int sidx = 0;
-			char line[4096];
-			for(int y=0;y<m_height;y++)
-			{
-				for(int x=0;x<m_width;x++)
-				for(int i=0;i<getNumSamples(x,y);i++)
-				{
-					if(!fgets(line,4096,fp))
-						fail("Fileformat 2.0: Buffer contains fewer samples than expected");
-
-					const char* linePtr = line;
-					const int NUM_ARGS = sizeof(Entry20)/sizeof(float);
-					Entry20& e = entries[sidx++];
-					float* vals = (float*)&e;
-					int numRead = 0;
-					for(int v=0;v<NUM_ARGS;v++)
-					{
-						parseSpace(linePtr);
-						parseChar (linePtr,',');
-						parseSpace(linePtr);
-						if(parseFloat(linePtr,vals[v]))
-							numRead++;
-					}
-
-					if(numRead != NUM_ARGS)
-						fail("Fileformat 2.0: Wrong number of arguments per line (expected %d, got %d)", NUM_ARGS,numRead);
-
-					FW_ASSERT(e.x>=0 && e.y>=0 && e.x<m_width && e.y<m_height);
-					FW_ASSERT(e.u>=-1 && e.v>=-1 && e.u<=1 && e.v<=1);
-					FW_ASSERT(e.t>=0 && e.t<=1);
-				}
-				printf("Parsing: %d%%\r", 100*y/m_height);
-			}
-			printf("                                               \r");
-		}
-
-		int sidx = 0;
-		for(int y=0;y<m_height;y++)
-		for(int x=0;x<m_width;x++)
-		for(int i=0;i<getNumSamples(x,y);i++)
-		{
-			const Entry20& e = entries[sidx++];
-			setSampleXY				(x,y,i, Vec2f(e.x,e.y));
-			setSampleW				(x,y,i, e.w);
-			setSampleUV				(x,y,i, Vec2f(e.u,e.v));
-			setSampleT 				(x,y,i, e.t);
-			setSampleColor			(x,y,i, Vec4f(e.r,e.g,e.b,1));
-			setSampleMV				(x,y,i, e.pri_mv);
-			setSampleExtra<Vec3f>	(CID_PRI_NORMAL  , x,y,i, e.pri_normal);
-			setSampleExtra<Vec3f>	(CID_ALBEDO      , x,y,i, e.albedo);
-			setSampleExtra<Vec3f>	(CID_SEC_ORIGIN  , x,y,i, e.sec_origin);
-			setSampleExtra<Vec3f>	(CID_SEC_HITPOINT, x,y,i, e.sec_hitpoint);
-			setSampleExtra<Vec3f>	(CID_SEC_MV      , x,y,i, e.sec_mv);
-			setSampleExtra<Vec3f>	(CID_SEC_NORMAL  , x,y,i, e.sec_normal);
-			setSampleExtra<Vec3f>	(CID_DIRECT      , x,y,i, e.direct);
-			setSampleDepth			(x,y,i, 0);					// clear unused
-			setSampleWG				(x,y,i, Vec2f(0));			// clear unused
-		}
+		readSamples(fp, num, cids, true, channelMask);
 	}
 	else if(m_version == 2.1f)
 	{
@@ -489,6 +1111,9 @@ UVTSampleBuffer::UVTSampleBuffer(const char* filename)
 		char descriptor[1024];
 		fscanf(fph, "%s\n", descriptor);
 
+		m_fileBinary     = binary;
+		m_fileDataOffset = separateHeader ? 0 : _ftelli64(fp);
+
 		// Reserve buffers.
 
 		m_xy   .reset(numSamples);
@@ -500,63 +1125,17 @@ UVTSampleBuffer::UVTSampleBuffer(const char* filename)
 		m_mv   .reset(numSamples);
 		m_wg   .reset(numSamples);		// not used
 
-		const int CID_PRI_NORMAL   = reserveChannel<Vec3f>(CID_PRI_NORMAL_NAME);
-		const int CID_ALBEDO       = reserveChannel<Vec3f>(CID_ALBEDO_NAME);
-		const int CID_SEC_ORIGIN   = reserveChannel<Vec3f>(CID_SEC_ORIGIN_NAME);
-		const int CID_SEC_HITPOINT = reserveChannel<Vec3f>(CID_SEC_HITPOINT_NAME);
-		const int CID_SEC_MV       = reserveChannel<Vec3f>(CID_SEC_MV_NAME);
-		const int CID_SEC_NORMAL   = reserveChannel<Vec3f>(CID_SEC_NORMAL_NAME);
-		const int CID_DIRECT       = reserveChannel<Vec3f>(CID_DIRECT_NAME);
+		int cids[SCH_NUM];		// in file order, -1 = not loaded
+		reserveFileChannels(cids, channelMask);
+		// TODO: add new fields
 
 		m_numSamples .reset(m_width*m_height);	// one per pixel
 		m_firstSample.reset(m_width*m_height);	// one per pixel
 
-		// Parse samples.
-
-		Array<Entry21> entries;
-		const int num = numSamples;
-		entries.reset(num);
+		// Parse samples. Samples are stored in file order, which getIndex() maps to once the pixel ranges are known.
 
 		printf("\n");
-		if(binary)
-		{
-			fread(entries.getPtr(),sizeof(Entry21),num,fp);
-		}
-		else
-		{
-			int sidx = 0;
-			char line[4096];
-			for(int i=0;i<numSamples;i++)
-			{
-				if(!fgets(line,4096,fp))
-					fail("Fileformat 2.1: Buffer contains fewer samples than expected");
-
-				const char* linePtr = line;
-				const int NUM_ARGS = sizeof(Entry21)/sizeof(float);
-				Entry21& e = entries[sidx++];
-				float* vals = (float*)&e;
-				int numRead = 0;
-				for(int v=0;v<NUM_ARGS;v++)
-				{
-					parseSpace(linePtr);
-					parseChar (linePtr,',');
-					parseSpace(linePtr);
-					if(parseFloat(linePtr,vals[v]))
-						numRead++;
-				}
-
-				if(numRead != NUM_ARGS)
-					fail("Fileformat 2.1: Wrong number of arguments per line (expected %d, got %d)", NUM_ARGS,numRead);
-
-				FW_ASSERT(e.x>=0 && e.y>=0 && e.x<m_width && e.y<m_height);
-				FW_ASSERT(e.u>=-1 && e.v>=-1 && e.u<=1 && e.v<=1);
-				FW_ASSERT(e.t>=0 && e.t<=1);
-
-				if(i%10000 == 0)
-					printf("Parsing: %d%%\r", 100*i/numSamples);
-			}
-			printf("                                               \r");
-		}
+		readSamples(fp, numSamples, cids, true, channelMask);
 
 		// Count samples in each pixel. We assume samples are provided in pixel-order.
 
@@ -569,47 +1148,113 @@ UVTSampleBuffer::UVTSampleBuffer(const char* filename)
 		Vec2i currentPixel(-1,-1);
 		for(int i=0;i<numSamples;i++)
 		{
-			const Entry21& e = entries[i];
-			const Vec2i pixel( int(floor(e.x)),int(floor(e.y)) );
-			if(pixel != currentPixel)
+			const Vec2f& xy = m_xy[i];
+			const Vec2i pixel( int(floor(xy.x)),int(floor(xy.y)) );
+			if(pixel != currentPixel)
+			{
+				if((pixel.x < currentPixel.x && pixel.y==currentPixel.y) || (pixel.y < currentPixel.y))	// moved left on the same scanline or moved to earlier scanline
+					fail("Samples provided in a wrong order (pixel-order required)");
+				currentPixel = pixel;
+				m_firstSample[pixel.y*m_width+pixel.x] = i;
+			}
+			m_numSamples[ pixel.y*m_width+pixel.x ]++;
+		}
+
+		// Empty pixels start where the next pixel does, so that getIndex(x,y,0) is monotonic and scanlines are contiguous ranges.
+
+		for(int i=m_width*m_height-1, next=numSamples; i>=0; i--)
+		{
+			if(!m_numSamples[i])
+				m_firstSample[i] = next;
+			next = m_firstSample[i];
+		}
+	}
+	else if(m_version == 2.2f)
+	{
+		// Parse the rest of the header.
+
+		m_affineMotion = false;
+		
+		if(fscanf(fph, "CoC coefficients (coc radius = C0/w+C1): %f,%f\n", &m_cocCoeff[0],&m_cocCoeff[1])!=2)
+			fail("CoC coefficients needs to specify 2 values");
+
+		float* m = (float*)&m_pixelToFocalPlane;
+		int n0 = fscanf(fph, "Pixel-to-camera matrix: %f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f\n", m+0,m+1,m+2,m+3,m+4,m+5,m+6,m+7,m+8,m+9,m+10,m+11,m+12,m+13,m+14,m+15);
+		if(n0!=16)
+			fail("Pixel-to-camera matrix needs to define 16 values (%d)", n0);
+
+		readStats(fph);
+
+		bool binary = false;
+		char encoding[1024];
+		if(fscanf(fph, "Encoding = %s\n", encoding)==1)
+			binary = String(encoding) == String("binary");
+
+		fscanf(fph, "\n");
+
+		char descriptor[1024];
+		fscanf(fph, "%s\n", descriptor);
+
+		m_fileBinary     = binary;
+		m_fileDataOffset = separateHeader ? 0 : _ftelli64(fp);
+
+		const int num = m_width*m_height*m_numSamplesPerPixel;
+
+		if(binary && memoryMapped)
+		{
+			// Map the records and point the channels straight at them. The view is copy-on-write, so setters
+			// still work but never touch the file. Only color (implicit alpha) and the unused fields are materialized.
+
+			const Entry22* entries = (const Entry22*)mapFile(filename, m_fileDataOffset, (S64)num*sizeof(Entry22));
+			const int stride = sizeof(Entry22);
+
+			m_xy.setView(&entries->x,      stride, num);
+			m_w .setView(&entries->w,      stride, num);
+			m_uv.setView(&entries->u,      stride, num);
+			m_t .setView(&entries->t,      stride, num);
+			m_mv.setView(&entries->pri_mv, stride, num);
+			mapFileChannels(channelMask);
+
+			m_color.reset(num);
+			m_depth.reset(num);		// not used
+			m_wg   .reset(num);		// not used
+			for(int i=0;i<num;i++)
 			{
-				if((pixel.x < currentPixel.x && pixel.y==currentPixel.y) || (pixel.y < currentPixel.y))	// moved left on the same scanline or moved to earlier scanline
-					fail("Samples provided in a wrong order (pixel-order required)");
-				currentPixel = pixel;
-				m_firstSample[pixel.y*m_width+pixel.x] = i;
+				const Entry22& e = entries[i];
+				m_color[i] = Vec4f(e.r,e.g,e.b,1);
+				m_depth[i] = 0;
+				m_wg[i]    = Vec2f(0);
 			}
-			m_numSamples[ pixel.y*m_width+pixel.x ]++;
+
+			fclose(fp);
+			if(separateHeader)
+				fclose(fph);
+			printf("done (memory-mapped)\n");
+			return;
 		}
 
-		// Set per-sample data
+		// Reserve buffers.
 
-		int sidx = 0;
-		for(int y=0;y<m_height;y++)
-		for(int x=0;x<m_width;x++)
-		for(int i=0;i<getNumSamples(x,y);i++)
-		{
-			const Entry21& e = entries[sidx++];
-			setSampleXY				(x,y,i, Vec2f(e.x,e.y));
-			setSampleW				(x,y,i, e.w);
-			setSampleUV				(x,y,i, Vec2f(e.u,e.v));
-			setSampleT 				(x,y,i, e.t);
-			setSampleColor			(x,y,i, Vec4f(e.r,e.g,e.b,1));
-			setSampleMV				(x,y,i, e.pri_mv);
-			setSampleExtra<Vec3f>	(CID_PRI_NORMAL  , x,y,i, e.pri_normal);
-			setSampleExtra<Vec3f>	(CID_ALBEDO      , x,y,i, e.albedo);
-			setSampleExtra<Vec3f>	(CID_SEC_ORIGIN  , x,y,i, e.sec_origin);
-			setSampleExtra<Vec3f>	(CID_SEC_HITPOINT, x,y,i, e.sec_hitpoint);
-			setSampleExtra<Vec3f>	(CID_SEC_MV      , x,y,i, e.sec_mv);
-			setSampleExtra<Vec3f>	(CID_SEC_NORMAL  , x,y,i, e.sec_normal);
-			setSampleExtra<Vec3f>	(CID_DIRECT      , x,y,i, e.direct);
-			setSampleDepth			(x,y,i, 0);					// clear unused
-			setSampleWG				(x,y,i, Vec2f(0));			// clear unused
-			// TODO: add new fields
-		}
+		m_xy   .reset(num);
+		m_uv   .reset(num);
+		m_t    .reset(num);
+		m_color.reset(num);
+		m_depth.reset(num);		// not used
+		m_w    .reset(num);
+		m_mv   .reset(num);
+		m_wg   .reset(num);		// not used
+
+		int cids[SCH_NUM];		// in file order, -1 = not loaded
+		reserveFileChannels(cids, channelMask);
+
+		// Parse samples.
+
+		printf("\n");
+		readSamples(fp, num, cids, true, channelMask);
 	}
-	else if(m_version == 2.2f)
+	else if(m_version == 3.0f)
 	{
-		// Parse the rest of the header.
+		// Parse the rest of the header. The records need decoding, so V3.0 is never memory-mapped.
 
 		m_affineMotion = false;
 		
@@ -621,6 +1266,11 @@ UVTSampleBuffer::UVTSampleBuffer(const char* filename)
 		if(n0!=16)
 			fail("Pixel-to-camera matrix needs to define 16 values (%d)", n0);
 
+		if(fscanf(fph, "Tile size %d\n", &m_fileTileSize)!=1 || m_fileTileSize<=0)
+			fail("Fileformat 3.0: Tile size not specified");
+
+		readStats(fph);
+
 		bool binary = false;
 		char encoding[1024];
 		if(fscanf(fph, "Encoding = %s\n", encoding)==1)
@@ -631,111 +1281,449 @@ UVTSampleBuffer::UVTSampleBuffer(const char* filename)
 		char descriptor[1024];
 		fscanf(fph, "%s\n", descriptor);
 
+		m_fileBinary     = binary;
+		m_fileDataOffset = separateHeader ? 0 : _ftelli64(fp);
+
 		// Reserve buffers.
 
-		m_xy   .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_uv   .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_t    .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_color.reset(m_width*m_height*m_numSamplesPerPixel);
-		m_depth.reset(m_width*m_height*m_numSamplesPerPixel);		// not used
-		m_w    .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_mv   .reset(m_width*m_height*m_numSamplesPerPixel);
-		m_wg   .reset(m_width*m_height*m_numSamplesPerPixel);		// not used
-
-		const int CID_PRI_NORMAL   = reserveChannel<Vec3f>(CID_PRI_NORMAL_NAME);
-		const int CID_ALBEDO       = reserveChannel<Vec3f>(CID_ALBEDO_NAME);
-		const int CID_SEC_ORIGIN   = reserveChannel<Vec3f>(CID_SEC_ORIGIN_NAME);
-		const int CID_SEC_HITPOINT = reserveChannel<Vec3f>(CID_SEC_HITPOINT_NAME);
-		const int CID_SEC_MV       = reserveChannel<Vec3f>(CID_SEC_MV_NAME);
-		const int CID_SEC_NORMAL   = reserveChannel<Vec3f>(CID_SEC_NORMAL_NAME);
-		const int CID_DIRECT       = reserveChannel<Vec3f>(CID_DIRECT_NAME);
-		const int CID_SEC_ALBEDO   = reserveChannel<Vec3f>(CID_SEC_ALBEDO_NAME);
-		const int CID_SEC_DIRECT   = reserveChannel<Vec3f>(CID_SEC_DIRECT_NAME);
+		const int num = m_width*m_height*m_numSamplesPerPixel;
+		m_xy   .reset(num);
+		m_uv   .reset(num);
+		m_t    .reset(num);
+		m_color.reset(num);
+		m_depth.reset(num);		// not used
+		m_w    .reset(num);
+		m_mv   .reset(num);
+		m_wg   .reset(num);		// not used
+
+		int cids[SCH_NUM];		// in file order, -1 = not loaded
+		reserveFileChannels(cids, channelMask);
 
 		// Parse samples.
 
-		Array<Entry22> entries;
-		const int num = m_width*m_height*m_numSamplesPerPixel;
-		entries.reset(num);
+		printf("\n");
+		readSamples(fp, num, cids, true, channelMask);
+	}
+	else
+		fail("Unsupported sample stream version (%.1f)", m_version);
+
+	fclose(fp);
+	if(separateHeader)
+		fclose(fph);
+	printf("done\n");
+}
+
+//-------------------------------------------------------------------
+// Export. Samples are written in blocks of bounded size; each block is
+// filled (and for text, formatted) in parallel and then written in order.
+//-------------------------------------------------------------------
+
+void UVTSampleBuffer::getFileChannelIDs(int* cids) const
+{
+	for(int c=0;c<getNumFileChannels();c++)
+		if((cids[c] = getChannelID(getFileChannelName(c))) == -1)
+			fail("Serialize: channel %s not defined", getFileChannelName(c));
+}
+
+void UVTSampleBuffer::loadEntry(int idx, Entry13& e, const int* cids, int numCids) const
+{
+	FW_UNREF(cids);
+	FW_UNREF(numCids);
+	e.x = m_xy[idx].x;						// x	(in window coordinates, NOT multiplied with w)
+	e.y = m_xy[idx].y;						// y	(in window coordinates, NOT multiplied with w)
+	e.z = m_depth[idx];						// z	(z/w as in OpenGL, not used by reconstruction)
+	e.w = m_w[idx];							// w	(camera-space z. Positive are visible, larger is farther).
+
+	e.u = m_uv[idx].x;						// u	[-1,1]
+	e.v = m_uv[idx].y;						// v	[-1,1]
+	e.t = m_t [idx];						// t	[0,1]
+
+	e.r = m_color[idx].x;					// r	[0,1]
+	e.g = m_color[idx].y;					// g	[0,1]
+	e.b = m_color[idx].z;					// b	[0,1]
+	e.a = m_color[idx].z;					// a	[0,1]				TODO
+
+	e.mv_x = m_mv[idx].x;					// homogeneous motion vector.x
+	e.mv_y = m_mv[idx].y;					// homogeneous motion vector.y
+	e.mv_w = m_mv[idx].z;					// homogeneous motion vector.w
+
+	e.dwdx = m_wg[idx].x;					// dw/dx
+	e.dwdy = m_wg[idx].y;					// dw/dy
+}
+
+template<class Entry> void UVTSampleBuffer::loadEntry(int idx, Entry& e, const int* cids, int numCids) const
+{
+	e.x = m_xy[idx].x;						// x	(in window coordinates, NOT multiplied with w)
+	e.y = m_xy[idx].y;						// y	(in window coordinates, NOT multiplied with w)
+	e.w = m_w[idx];							// w	(camera-space z. Positive are visible, larger is farther).
+
+	e.u = m_uv[idx].x;						// u	[-1,1]
+	e.v = m_uv[idx].y;						// v	[-1,1]
+	e.t = m_t [idx];						// t	[0,1]
+
+	e.r = m_color[idx].x;					// r	[0,1]
+	e.g = m_color[idx].y;					// g	[0,1]
+	e.b = m_color[idx].z;					// b	[0,1]
+
+	e.pri_mv = m_mv[idx];
+
+	UnalignedVec3f* extra = &e.pri_normal;	// extra channels are stored back-to-back in file order
+	for(int c=0;c<numCids;c++)
+		extra[c] = getChannelData<Vec3f>(cids[c])[idx];
+}
+
+template<class Entry> struct UVTSampleBuffer::WriteChunk
+{
+	enum { MAX_CHARS_PER_FLOAT = 48 };	// "%f," of +-FW_F32_MAX
+
+	const UVTSampleBuffer*	sbuf;
+	Entry*				entries;
+	const int*			cids;
+	int					numCids;
+	bool				binary;
+	int					firstEntry;
+	int					begin;			// within entries
+	int					end;
+	Array<char>			text;			// formatted lines of [begin,end), text encoding only
+
+	static void fill(MulticoreLauncher::Task& task)
+	{
+		WriteChunk& c = *(WriteChunk*)task.data;
+		const int numFloats = sizeof(Entry)/sizeof(float);
+		const int lineSize  = numFloats*MAX_CHARS_PER_FLOAT+1;
+
+		c.text.clear();
+		if(!c.binary)
+			c.text.setCapacity((c.end-c.begin)*lineSize);
+
+		for(int i=c.begin;i<c.end;i++)
+		{
+			Entry& e = c.entries[i];
+			memset(&e, 0, sizeof(Entry));		// fields that have no channel are written as zero
+			c.sbuf->loadEntry(c.firstEntry+i, e, c.cids,c.numCids);
+			if(c.binary)
+				continue;
+
+			const float* vals = (const float*)&e;
+			char* line = c.text.add(NULL, lineSize);
+			char* ptr  = line;
+			for(int j=0;j<numFloats;j++)
+				ptr += sprintf_s(ptr, lineSize-(ptr-line), "%f,", vals[j]);
+			*ptr++ = '\n';
+			c.text.resize(c.text.getSize() - lineSize + (int)(ptr-line));
+		}
+	}
+};
 
+template<class Entry> void UVTSampleBuffer::writeEntries(FILE* fp, bool binary, const int* cids, int numCids) const
+{
+	const int num           = m_xy.getSize();
+	const int lineSize      = (sizeof(Entry)/sizeof(float))*WriteChunk<Entry>::MAX_CHARS_PER_FLOAT+1;
+	const int BLOCK_ENTRIES = (16<<20) / (binary ? (int)sizeof(Entry) : lineSize);
+	const int numTasks      = MulticoreLauncher::getNumCores();
+
+	Array<Entry> entries;
+	entries.reset(min(num,BLOCK_ENTRIES));
+	Array<WriteChunk<Entry> > chunks;
+	chunks.reset(numTasks);
+	MulticoreLauncher launcher;
+
+	if(!binary)
 		printf("\n");
-		if(binary)
+	for(int first=0;first<num;first+=BLOCK_ENTRIES)
+	{
+		const int n = min(num-first, BLOCK_ENTRIES);
+		for(int i=0;i<numTasks;i++)
 		{
-			fread(entries.getPtr(),sizeof(Entry22),num,fp);
+			WriteChunk<Entry>& c = chunks[i];
+			c.sbuf       = this;
+			c.entries    = entries.getPtr();
+			c.cids       = cids;
+			c.numCids    = numCids;
+			c.binary     = binary;
+			c.firstEntry = first;
+			c.begin      = (int)((S64)n*i/numTasks);
+			c.end        = (int)((S64)n*(i+1)/numTasks);
+			launcher.push(WriteChunk<Entry>::fill, &c, i,1);
 		}
+		launcher.popAll();
+
+		if(binary)
+			fwrite(entries.getPtr(), sizeof(Entry), n, fp);
 		else
 		{
-			int sidx = 0;
-			char line[4096];
-			for(int y=0;y<m_height;y++)
+			for(int i=0;i<numTasks;i++)
+				fwrite(chunks[i].text.getPtr(), 1, chunks[i].text.getSize(), fp);
+			printf("Writing to file: %d%%\r", (int)(100*(S64)(first+n)/num));
+		}
+	}
+	if(!binary)
+		printf("                                               \rdone\n");
+}
+
+// Statistics. %.9g round-trips floats exactly, so the bounds stay conservative.
+
+void UVTSampleBuffer::writeStats(FILE* fph, const SampleBufferStats& s) const
+{
+	fprintf(fph, "Statistics samples %d, invalid %d\n", s.numMomentSamples, s.numInvalid);
+	fprintf(fph, "Statistics sec_hitpoint bounds t=0: %.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", s.hitpointMinT0.x,s.hitpointMinT0.y,s.hitpointMinT0.z, s.hitpointMaxT0.x,s.hitpointMaxT0.y,s.hitpointMaxT0.z);
+	fprintf(fph, "Statistics sec_hitpoint bounds t=1: %.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", s.hitpointMinT1.x,s.hitpointMinT1.y,s.hitpointMinT1.z, s.hitpointMaxT1.x,s.hitpointMaxT1.y,s.hitpointMaxT1.z);
+	fprintf(fph, "Statistics color mean,stddev,max: %.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", s.colorMean.x,s.colorMean.y,s.colorMean.z, s.colorStddev.x,s.colorStddev.y,s.colorStddev.z, s.colorMax.x,s.colorMax.y,s.colorMax.z);
+	for(int c=0;c<getNumFileChannels();c++)
+	{
+		const Vec3f& mean   = s.channelMean  [c];
+		const Vec3f& stddev = s.channelStddev[c];
+		fprintf(fph, "Statistics %s mean,stddev: %.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", getFileChannelName(c), mean.x,mean.y,mean.z, stddev.x,stddev.y,stddev.z);
+	}
+}
+
+struct UVTSampleBuffer::StatsTask
+{
+	const UVTSampleBuffer*	sbuf;
+	const int*			cids;			// all extra channels, in file order
+	int					begin;			// samples
+	int					end;
+	SampleBufferStats	stats;			// bounds, counts and colorMax
+	Vec3d				sum  [1+SCH_NUM];	// color, then the extra channels
+	Vec3d				sum2 [1+SCH_NUM];
+	int					count[1+SCH_NUM];
+
+	static void gather(MulticoreLauncher::Task& task)
+	{
+		StatsTask& d = *(StatsTask*)task.data;
+		const UVTSampleBuffer& sbuf = *d.sbuf;
+		const StridedArray<Vec3f>& origins   = sbuf.getChannel(CHANNEL_SEC_ORIGIN);
+		const StridedArray<Vec3f>& hitpoints = sbuf.getChannel(CHANNEL_SEC_HITPOINT);
+		const StridedArray<Vec3f>& mvs       = sbuf.getChannel(CHANNEL_SEC_MV);
+
+		for(int i=d.begin;i<d.end;i++)
+		{
+			const Vec3f p = hitpoints[i];
+			if(isValidPoint(p))
 			{
-				for(int x=0;x<m_width;x++)
-				for(int i=0;i<getNumSamples(x,y);i++)
-				{
-					if(!fgets(line,4096,fp))
-						fail("Fileformat 2.2: Buffer contains fewer samples than expected");
-
-					const char* linePtr = line;
-					const int NUM_ARGS = sizeof(Entry22)/sizeof(float);
-					Entry22& e = entries[sidx++];
-					float* vals = (float*)&e;
-					int numRead = 0;
-					for(int v=0;v<NUM_ARGS;v++)
-					{
-						parseSpace(linePtr);
-						parseChar (linePtr,',');
-						parseSpace(linePtr);
-						if(parseFloat(linePtr,vals[v]))
-							numRead++;
-					}
-
-					if(numRead != NUM_ARGS)
-						fail("Fileformat 2.2: Wrong number of arguments per line (expected %d, got %d)", NUM_ARGS,numRead);
-
-					FW_ASSERT(e.x>=0 && e.y>=0 && e.x<m_width && e.y<m_height);
-					FW_ASSERT(e.u>=-1 && e.v>=-1 && e.u<=1 && e.v<=1);
-					FW_ASSERT(e.t>=0 && e.t<=1);
-				}
-				printf("Parsing: %d%%\r", 100*y/m_height);
+				const Vec3f pt0 = p - sbuf.m_t[i]*mvs[i];		// as in ingestSamples()
+				const Vec3f pt1 = pt0 + mvs[i];
+				d.stats.hitpointMinT0 = min(d.stats.hitpointMinT0, pt0);
+				d.stats.hitpointMaxT0 = max(d.stats.hitpointMaxT0, pt0);
+				d.stats.hitpointMinT1 = min(d.stats.hitpointMinT1, pt1);
+				d.stats.hitpointMaxT1 = max(d.stats.hitpointMaxT1, pt1);
+			}
+			else
+				d.stats.numInvalid++;
+
+			if(!isValidPoint(origins[i]))
+				continue;
+
+			d.stats.numMomentSamples++;
+			const Vec3f color = sbuf.m_color[i].getXYZ();
+			d.stats.colorMax = max(d.stats.colorMax, color);
+			for(int c=0;c<1+SCH_NUM;c++)
+			{
+				const Vec3f v = c ? sbuf.getChannelData<Vec3f>(d.cids[c-1])[i] : color;
+				if(!isValidPoint(v))
+					continue;
+				d.sum  [c] += Vec3d(v);
+				d.sum2 [c] += Vec3d(v)*Vec3d(v);
+				d.count[c]++;
 			}
-			printf("                                               \r");
 		}
+	}
+};
 
-		int sidx = 0;
-		for(int y=0;y<m_height;y++)
-		for(int x=0;x<m_width;x++)
-		for(int i=0;i<getNumSamples(x,y);i++)
+void UVTSampleBuffer::computeStats(SampleBufferStats& stats) const
+{
+	int cids[SCH_NUM];
+	for(int c=0;c<SCH_NUM;c++)
+		if((cids[c] = getChannelID(getFileChannelName(c))) == -1)
+			fail("computeStats: channel %s not defined", getFileChannelName(c));
+
+	const int num      = m_xy.getSize();
+	const int numTasks = MulticoreLauncher::getNumCores();
+
+	Array<StatsTask> tasks;
+	tasks.reset(numTasks);
+	MulticoreLauncher launcher;
+	for(int i=0;i<numTasks;i++)
+	{
+		StatsTask& d = tasks[i];
+		d.sbuf  = this;
+		d.cids  = cids;
+		d.begin = (int)((S64)num*i/numTasks);
+		d.end   = (int)((S64)num*(i+1)/numTasks);
+		d.stats = SampleBufferStats();
+		for(int c=0;c<1+SCH_NUM;c++)
 		{
-			const Entry22& e = entries[sidx++];
-			setSampleXY				(x,y,i, Vec2f(e.x,e.y));
-			setSampleW				(x,y,i, e.w);
-			setSampleUV				(x,y,i, Vec2f(e.u,e.v));
-			setSampleT 				(x,y,i, e.t);
-			setSampleColor			(x,y,i, Vec4f(e.r,e.g,e.b,1));
-			setSampleMV				(x,y,i, e.pri_mv);
-			setSampleExtra<Vec3f>	(CID_PRI_NORMAL  , x,y,i, e.pri_normal);
-			setSampleExtra<Vec3f>	(CID_ALBEDO      , x,y,i, e.albedo);
-			setSampleExtra<Vec3f>	(CID_SEC_ORIGIN  , x,y,i, e.sec_origin);
-			setSampleExtra<Vec3f>	(CID_SEC_HITPOINT, x,y,i, e.sec_hitpoint);
-			setSampleExtra<Vec3f>	(CID_SEC_MV      , x,y,i, e.sec_mv);
-			setSampleExtra<Vec3f>	(CID_SEC_NORMAL  , x,y,i, e.sec_normal);
-			setSampleExtra<Vec3f>	(CID_DIRECT      , x,y,i, e.direct);
-			setSampleExtra<Vec3f>	(CID_SEC_ALBEDO  , x,y,i, e.sec_albedo);
-			setSampleExtra<Vec3f>	(CID_SEC_DIRECT  , x,y,i, e.sec_direct);
-			setSampleDepth			(x,y,i, 0);					// clear unused
-			setSampleWG				(x,y,i, Vec2f(0));			// clear unused
+			d.sum[c] = d.sum2[c] = Vec3d(0);
+			d.count[c] = 0;
 		}
+		launcher.push(StatsTask::gather, &d, i,1);
 	}
-	else
-		fail("Unsupported sample stream version (%.1f)", m_version);
+	launcher.popAll();
 
-	fclose(fp);
-	if(separateHeader)
-		fclose(fph);
-	printf("done\n");
+	// Merge.
+
+	Vec3d sum [1+SCH_NUM];
+	Vec3d sum2[1+SCH_NUM];
+	int   count[1+SCH_NUM] = {0};
+	stats = SampleBufferStats();
+	for(int i=0;i<numTasks;i++)
+	{
+		const StatsTask& d = tasks[i];
+		stats.hitpointMinT0     = min(stats.hitpointMinT0, d.stats.hitpointMinT0);
+		stats.hitpointMaxT0     = max(stats.hitpointMaxT0, d.stats.hitpointMaxT0);
+		stats.hitpointMinT1     = min(stats.hitpointMinT1, d.stats.hitpointMinT1);
+		stats.hitpointMaxT1     = max(stats.hitpointMaxT1, d.stats.hitpointMaxT1);
+		stats.numInvalid       += d.stats.numInvalid;
+		stats.numMomentSamples += d.stats.numMomentSamples;
+		stats.colorMax          = max(stats.colorMax, d.stats.colorMax);
+		for(int c=0;c<1+SCH_NUM;c++)
+		{
+			sum  [c] += d.sum [c];
+			sum2 [c] += d.sum2[c];
+			count[c] += d.count[c];
+		}
+	}
+
+	for(int c=0;c<1+SCH_NUM;c++)
+	{
+		const Vec3d mean   = sum [c] / (F64)max(count[c],1);
+		const Vec3d var    = sum2[c] / (F64)max(count[c],1) - mean*mean;
+		const Vec3f meanf  ((F32)mean.x, (F32)mean.y, (F32)mean.z);
+		const Vec3f stddev ((F32)sqrt(max(var.x,0.0)), (F32)sqrt(max(var.y,0.0)), (F32)sqrt(max(var.z,0.0)));
+		if(c == 0)	{ stats.colorMean        = meanf; stats.colorStddev        = stddev; }
+		else		{ stats.channelMean[c-1] = meanf; stats.channelStddev[c-1] = stddev; }
+	}
+
+	stats.valid      = true;
+	stats.hasMoments = true;
+}
+
+// V3.0
+
+void UVTSampleBuffer::encodeEntry30(int idx, Entry30& e, const Tile30& tile, float* errors) const
+{
+	const int pixel = idx / m_numSamplesPerPixel;
+	const Vec2f offset = m_xy[idx] - Vec2f(float(pixel%m_width), float(pixel/m_width));
+	if(offset.min() < 0 || offset.max() >= 1)
+		fail("Serialize: V3.0 requires each sample to lie inside its pixel");
+	e.x = (U16)min(int(offset.x*65536.f), 65535);
+	e.y = (U16)min(int(offset.y*65536.f), 65535);
+	e.w = m_w[idx];
+	e.u = quantizeSnorm16(m_uv[idx].x);
+	e.v = quantizeSnorm16(m_uv[idx].y);
+	e.t = quantizeUnorm16(m_t[idx]);
+
+	const Vec3f halves[] =
+	{
+		m_color[idx].getXYZ(),
+		m_mv[idx],
+		getChannel(CHANNEL_ALBEDO)    [idx],
+		getChannel(CHANNEL_SEC_MV)    [idx],
+		getChannel(CHANNEL_DIRECT)    [idx],
+		getChannel(CHANNEL_SEC_ALBEDO)[idx],
+		getChannel(CHANNEL_SEC_DIRECT)[idx],
+	};
+	U16* halfFields[] = { e.rgb, e.pri_mv, e.albedo, e.sec_mv, e.direct, e.sec_albedo, e.sec_direct };
+	for(int j=0;j<FW_ARRAY_SIZE(halves);j++)
+	{
+		encodeHalf3(halfFields[j], halves[j]);
+		const Vec3f decoded = decodeHalf3(halfFields[j]);
+		for(int k=0;k<3;k++)
+			errors[ERROR30_HALF] = max(errors[ERROR30_HALF], abs(decoded[k]-halves[j][k]) / max(abs(halves[j][k]), 6.1035e-5f));	// relative above the smallest normal half
+	}
+
+	const Vec3f normals[] = { getChannel(CHANNEL_PRI_NORMAL)[idx], getChannel(CHANNEL_SEC_NORMAL)[idx] };
+	S16* normalFields[]   = { e.pri_normal, e.sec_normal };
+	for(int j=0;j<2;j++)
+	{
+		encodeNormal30(normalFields[j], normals[j]);
+		if(normals[j].length() > 0)
+		{
+			const Vec3f n = normals[j].normalized();
+			const Vec3f d = decodeNormal30(normalFields[j]);
+			errors[ERROR30_NORMAL] = max(errors[ERROR30_NORMAL], atan2(cross(n,d).length(), dot(n,d)));
+		}
+	}
+
+	const Vec3f origin   = getChannel(CHANNEL_SEC_ORIGIN)  [idx];
+	const Vec3f hitpoint = getChannel(CHANNEL_SEC_HITPOINT)[idx];
+	encodePoint30(e.sec_origin,   origin,   tile.originMin,   tile.originScale);
+	encodePoint30(e.sec_hitpoint, hitpoint, tile.hitpointMin, tile.hitpointScale);
+	if(isValidPoint(origin))	errors[ERROR30_ORIGIN]   = max(errors[ERROR30_ORIGIN],   (decodePoint30(e.sec_origin,  tile.originMin,  tile.originScale)  -origin  ).abs().max());
+	if(isValidPoint(hitpoint))	errors[ERROR30_HITPOINT] = max(errors[ERROR30_HITPOINT], (decodePoint30(e.sec_hitpoint,tile.hitpointMin,tile.hitpointScale)-hitpoint).abs().max());
+
+	errors[ERROR30_XY] = max(errors[ERROR30_XY], ((Vec2f(e.x,e.y)+0.5f)*(1.f/65536.f) - offset).abs().max());
+	errors[ERROR30_UV] = max(errors[ERROR30_UV], (Vec2f(dequantizeSnorm16(e.u),dequantizeSnorm16(e.v)) - m_uv[idx]).abs().max());
+	errors[ERROR30_T]  = max(errors[ERROR30_T],  abs(dequantizeUnorm16(e.t) - m_t[idx]));
+}
+
+struct UVTSampleBuffer::EncodeTask30
+{
+	const UVTSampleBuffer*	sbuf;
+	Entry30*			entries;
+	const Tile30*		tiles;
+	int					tileSize;
+	int					firstEntry;
+	int					begin;			// within entries
+	int					end;
+	float				errors[NUM_ERRORS30];	// largest errors of this task so far
+
+	static void encode(MulticoreLauncher::Task& task)
+	{
+		EncodeTask30& d = *(EncodeTask30*)task.data;
+		for(int i=d.begin;i<d.end;i++)
+		{
+			const int idx = d.firstEntry+i;
+			d.sbuf->encodeEntry30(idx, d.entries[i], d.tiles[d.sbuf->getTileIndex30(idx,d.tileSize)], d.errors);
+		}
+	}
+};
+
+void UVTSampleBuffer::writeEntries30(FILE* fp, const Tile30* tiles, int tileSize, float* errors) const
+{
+	const int num           = m_xy.getSize();
+	const int BLOCK_ENTRIES = (16<<20) / sizeof(Entry30);
+	const int numTasks      = MulticoreLauncher::getNumCores();
+
+	Array<Entry30> entries;
+	entries.reset(min(num,BLOCK_ENTRIES));
+	Array<EncodeTask30> tasks;
+	tasks.reset(numTasks);
+	for(int i=0;i<numTasks;i++)
+		for(int j=0;j<NUM_ERRORS30;j++)
+			tasks[i].errors[j] = 0;
+	MulticoreLauncher launcher;
+
+	for(int first=0;first<num;first+=BLOCK_ENTRIES)
+	{
+		const int n = min(num-first, BLOCK_ENTRIES);
+		for(int i=0;i<numTasks;i++)
+		{
+			EncodeTask30& d = tasks[i];
+			d.sbuf       = this;
+			d.entries    = entries.getPtr();
+			d.tiles      = tiles;
+			d.tileSize   = tileSize;
+			d.firstEntry = first;
+			d.begin      = (int)((S64)n*i/numTasks);
+			d.end        = (int)((S64)n*(i+1)/numTasks);
+			launcher.push(EncodeTask30::encode, &d, i,1);
+		}
+		launcher.popAll();
+		fwrite(entries.getPtr(), sizeof(Entry30), n, fp);
+	}
+
+	for(int j=0;j<NUM_ERRORS30;j++)
+	{
+		errors[j] = 0;
+		for(int i=0;i<numTasks;i++)
+			errors[j] = max(errors[j], tasks[i].errors[j]);
+	}
 }
 
-void UVTSampleBuffer::serialize(const char* filename, bool separateHeader, bool binary) const
+//-------------------------------------------------------------------
+
+void UVTSampleBuffer::serialize(const char* filename, bool separateHeader, bool binary, bool withStats) const
 {
 	if(binary && !separateHeader)
 		fail("binary serialization supported only with a separate header");
@@ -808,80 +1796,13 @@ void UVTSampleBuffer::serialize(const char* filename, bool separateHeader, bool
 		// C1 = ApertureDiameter * f/(focusDist-f)
 		// C0 = -C1*focusDist
 
-		int num = 0;
-		for(int y=0;y<m_height;y++)
-		for(int x=0;x<m_width; x++)
-			num += getNumSamples(x,y);
-
-		Array<Entry13> entries;
-		entries.reset(num);
-
-		int sidx=0;
-		for(int y=0;y<m_height;y++)
-		for(int x=0;x<m_width;x++)
-		for(int i=0;i<getNumSamples(x,y);i++)
-		{
-			Entry13& e = entries[sidx++];
-			e.x = getSampleXY(x,y,i)[0];			// x	(in window coordinates, NOT multiplied with w)
-			e.y = getSampleXY(x,y,i)[1];			// y	(in window coordinates, NOT multiplied with w)
-			e.z = getSampleDepth(x,y,i);			// z	(z/w as in OpenGL, not used by reconstruction)
-			e.w = getSampleW(x,y,i);				// w	(camera-space z. Positive are visible, larger is farther).
-
-			e.u = getSampleUV(x,y,i)[0];			// u	[-1,1]
-			e.v = getSampleUV(x,y,i)[1];			// v	[-1,1]
-			e.t = getSampleT (x,y,i);				// t	[0,1]
-
-			e.r = getSampleColor(x,y,i)[0];			// r	[0,1]
-			e.g = getSampleColor(x,y,i)[1];			// g	[0,1]
-			e.b = getSampleColor(x,y,i)[2];			// b	[0,1]
-			e.a = getSampleColor(x,y,i)[2];			// a	[0,1]				TODO
-
-			e.mv_x = getSampleMV(x,y,i)[0];			// homogeneous motion vector.x
-			e.mv_y = getSampleMV(x,y,i)[1];			// homogeneous motion vector.y
-			e.mv_w = getSampleMV(x,y,i)[2];			// homogeneous motion vector.w
-
-			e.dwdx = getSampleWG(x,y,i)[0];			// dw/dx
-			e.dwdy = getSampleWG(x,y,i)[1];			// dw/dy
-		}
-
-		if(binary)
-		{
-			fwrite(entries.getPtr(), sizeof(Entry13), num, fp);
-		}
-		else
-		{
-			printf("\n");
-			for(int i=0;i<entries.getSize();i++)
-			{
-				Entry13& e = entries[i];
-				float* vals = (float*)&e;
-				for(int j=0;j<sizeof(Entry13)/sizeof(float);j++)
-					fprintf(fp, "%f,", vals[j]);
-				fprintf(fp, "\n"); 
-				if(i%10000 == 0)
-					printf("Writing to file: %d%%\r", 100*i/entries.getSize());
-			}
-			printf("                                               \rdone\n");
-		}
+		writeEntries<Entry13>(fp, binary, NULL,0);
 	} // 1.3
 	else if(m_version == 2.f)
 	{
 		// get IDs of extra channels
-		const int CID_PRI_NORMAL   = getChannelID(CID_PRI_NORMAL_NAME  );
-		const int CID_ALBEDO       = getChannelID(CID_ALBEDO_NAME      );
-		const int CID_SEC_ORIGIN   = getChannelID(CID_SEC_ORIGIN_NAME  );
-		const int CID_SEC_HITPOINT = getChannelID(CID_SEC_HITPOINT_NAME);
-		const int CID_SEC_MV       = getChannelID(CID_SEC_MV_NAME      );
-		const int CID_SEC_NORMAL   = getChannelID(CID_SEC_NORMAL_NAME  );
-		const int CID_DIRECT       = getChannelID(CID_DIRECT_NAME      );
-
-		if(CID_PRI_NORMAL  ==-1)	fail("Serialize: channel %s not defined", CID_PRI_NORMAL_NAME  );
-		if(CID_ALBEDO      ==-1)	fail("Serialize: channel %s not defined", CID_ALBEDO_NAME      );
-		if(CID_SEC_ORIGIN  ==-1)	fail("Serialize: channel %s not defined", CID_SEC_ORIGIN_NAME  );
-		if(CID_SEC_HITPOINT==-1)	fail("Serialize: channel %s not defined", CID_SEC_HITPOINT_NAME);
-		if(CID_SEC_MV      ==-1)	fail("Serialize: channel %s not defined", CID_SEC_MV_NAME      );
-		if(CID_SEC_NORMAL  ==-1)	fail("Serialize: channel %s not defined", CID_SEC_NORMAL_NAME  );
-		if(CID_DIRECT      ==-1)	fail("Serialize: channel %s not defined", CID_DIRECT_NAME      );
+		int cids[SCH_NUM];
+		getFileChannelIDs(cids);
 
 		// header
 		if(m_cocCoeff == Vec2f(FW_F32_MAX,FW_F32_MAX))
@@ -897,80 +1818,13 @@ void UVTSampleBuffer::serialize(const char* filename, bool separateHeader, bool
 		fprintf(fph, "Encoding = %s\n", binary ? "binary" : "text");
 		fprintf(fph, "x,y,w,u,v,t,r,g,b,%s(3d),%s(3d),%s,%s(3d),%s(3d),%s(3d),%s\n", CID_PRI_MV_NAME,CID_PRI_NORMAL_NAME,CID_ALBEDO_NAME,CID_SEC_ORIGIN_NAME,CID_SEC_HITPOINT_NAME,CID_SEC_MV_NAME,CID_SEC_NORMAL_NAME,CID_DIRECT_NAME);
 
-		int num = 0;
-		for(int y=0;y<m_height;y++)
-		for(int x=0;x<m_width; x++)
-			num += getNumSamples(x,y);
-
-		Array<Entry20> entries;
-		entries.reset(num);
-
-		int sidx=0;
-		for(int y=0;y<m_height;y++)
-		for(int x=0;x<m_width;x++)
-		for(int i=0;i<getNumSamples(x,y);i++)
-		{
-			Entry20& e = entries[sidx++];
-			e.x = getSampleXY(x,y,i)[0];			// x	(in window coordinates, NOT multiplied with w)
-			e.y = getSampleXY(x,y,i)[1];			// y	(in window coordinates, NOT multiplied with w)
-			e.w = getSampleW(x,y,i);				// w	(camera-space z. Positive are visible, larger is farther).
-
-			e.u = getSampleUV(x,y,i)[0];			// u	[-1,1]
-			e.v = getSampleUV(x,y,i)[1];			// v	[-1,1]
-			e.t = getSampleT (x,y,i);				// t	[0,1]
-
-			e.r = getSampleColor(x,y,i)[0];			// r	[0,1]
-			e.g = getSampleColor(x,y,i)[1];			// g	[0,1]
-			e.b = getSampleColor(x,y,i)[2];			// b	[0,1]
-
-			e.pri_mv	   = getSampleMV(x,y,i);
-			e.pri_normal   = getSampleExtra<Vec3f>(CID_PRI_NORMAL  ,x,y,i);		// primitive normal (3D)
-			e.albedo       = getSampleExtra<Vec3f>(CID_ALBEDO      ,x,y,i);		// primary hit albedo
-			e.sec_origin   = getSampleExtra<Vec3f>(CID_SEC_ORIGIN  ,x,y,i);		// secondary ray origin (3D)
-			e.sec_hitpoint = getSampleExtra<Vec3f>(CID_SEC_HITPOINT,x,y,i);		// secondary ray hit point (3D)
-			e.sec_mv       = getSampleExtra<Vec3f>(CID_SEC_MV      ,x,y,i);		// secondary ray hit point motion vector (3D)
-			e.sec_normal   = getSampleExtra<Vec3f>(CID_SEC_NORMAL  ,x,y,i);		// secondary ray hit normal (3D)
-			e.direct       = getSampleExtra<Vec3f>(CID_DIRECT      ,x,y,i);		// direct light (r,g,b)
-		}
-
-		if(binary)
-		{
-			fwrite(entries.getPtr(), sizeof(Entry20), num, fp);
-		}
-		else
-		{
-			printf("\n");
-			for(int i=0;i<entries.getSize();i++)
-			{
-				Entry20& e = entries[i];
-				float* vals = (float*)&e;
-				for(int j=0;j<sizeof(Entry20)/sizeof(float);j++)
-					fprintf(fp, "%f,", vals[j]);
-				fprintf(fp, "\n"); 
-				if(i%10000 == 0)
-					printf("Writing to file: %d%%\r", 100*i/entries.getSize());
-			}
-			printf("                                               \rdone\n");
-		}
+		writeEntries<Entry20>(fp, binary, cids,getNumFileChannels());
 	}
 	else if(m_version == 2.1f)
 	{
 		// get IDs of extra channels
-		const int CID_PRI_NORMAL   = getChannelID(CID_PRI_NORMAL_NAME  );
-		const int CID_ALBEDO       = getChannelID(CID_ALBEDO_NAME      );
-		const int CID_SEC_ORIGIN   = getChannelID(CID_SEC_ORIGIN_NAME  );
-		const int CID_SEC_HITPOINT = getChannelID(CID_SEC_HITPOINT_NAME);
-		const int CID_SEC_MV       = getChannelID(CID_SEC_MV_NAME      );
-		const int CID_SEC_NORMAL   = getChannelID(CID_SEC_NORMAL_NAME  );
-		const int CID_DIRECT       = getChannelID(CID_DIRECT_NAME      );
-
-		if(CID_PRI_NORMAL  ==-1)	fail("Serialize: channel %s not defined", CID_PRI_NORMAL_NAME  );
-		if(CID_ALBEDO      ==-1)	fail("Serialize: channel %s not defined", CID_ALBEDO_NAME      );
-		if(CID_SEC_ORIGIN  ==-1)	fail("Serialize: channel %s not defined", CID_SEC_ORIGIN_NAME  );
-		if(CID_SEC_HITPOINT==-1)	fail("Serialize: channel %s not defined", CID_SEC_HITPOINT_NAME);
-		if(CID_SEC_MV      ==-1)	fail("Serialize: channel %s not defined", CID_SEC_MV_NAME      );
-		if(CID_SEC_NORMAL  ==-1)	fail("Serialize: channel %s not defined", CID_SEC_NORMAL_NAME  );
-		if(CID_DIRECT      ==-1)	fail("Serialize: channel %s not defined", CID_DIRECT_NAME      );
+		int cids[SCH_NUM];
+		getFileChannelIDs(cids);
 		
 		// TODO: new fields
 
@@ -992,81 +1846,13 @@ void UVTSampleBuffer::serialize(const char* filename, bool separateHeader, bool
 		fprintf(fph, "x,y,w,u,v,t,r,g,b,%s(3d),%s(3d),%s,%s(3d),%s(3d),%s(3d),%s\n", CID_PRI_MV_NAME,CID_PRI_NORMAL_NAME,CID_ALBEDO_NAME,CID_SEC_ORIGIN_NAME,CID_SEC_HITPOINT_NAME,CID_SEC_MV_NAME,CID_SEC_NORMAL_NAME,CID_DIRECT_NAME);
 		// TODO: new fields
 
-		Array<Entry21> entries;
-		entries.reset(num);
-
-		int sidx=0;
-		for(int y=0;y<m_height;y++)
-		for(int x=0;x<m_width;x++)
-		for(int i=0;i<getNumSamples(x,y);i++)
-		{
-			Entry21& e = entries[sidx++];
-			e.x = getSampleXY(x,y,i)[0];			// x	(in window coordinates, NOT multiplied with w)
-			e.y = getSampleXY(x,y,i)[1];			// y	(in window coordinates, NOT multiplied with w)
-			e.w = getSampleW(x,y,i);				// w	(camera-space z. Positive are visible, larger is farther).
-
-			e.u = getSampleUV(x,y,i)[0];			// u	[-1,1]
-			e.v = getSampleUV(x,y,i)[1];			// v	[-1,1]
-			e.t = getSampleT (x,y,i);				// t	[0,1]
-
-			e.r = getSampleColor(x,y,i)[0];			// r	[0,1]
-			e.g = getSampleColor(x,y,i)[1];			// g	[0,1]
-			e.b = getSampleColor(x,y,i)[2];			// b	[0,1]
-
-			e.pri_mv	   = getSampleMV(x,y,i);
-			e.pri_normal   = getSampleExtra<Vec3f>(CID_PRI_NORMAL  ,x,y,i);		// primitive normal (3D)
-			e.albedo       = getSampleExtra<Vec3f>(CID_ALBEDO      ,x,y,i);		// primary hit albedo
-			e.sec_origin   = getSampleExtra<Vec3f>(CID_SEC_ORIGIN  ,x,y,i);		// secondary ray origin (3D)
-			e.sec_hitpoint = getSampleExtra<Vec3f>(CID_SEC_HITPOINT,x,y,i);		// secondary ray hit point (3D)
-			e.sec_mv       = getSampleExtra<Vec3f>(CID_SEC_MV      ,x,y,i);		// secondary ray hit point motion vector (3D)
-			e.sec_normal   = getSampleExtra<Vec3f>(CID_SEC_NORMAL  ,x,y,i);		// secondary ray hit normal (3D)
-			e.direct       = getSampleExtra<Vec3f>(CID_DIRECT      ,x,y,i);		// direct light (r,g,b)
-
-			// TODO: new fields
-		}
-
-		if(binary)
-		{
-			fwrite(entries.getPtr(), sizeof(Entry21), num, fp);
-		}
-		else
-		{
-			printf("\n");
-			for(int i=0;i<entries.getSize();i++)
-			{
-				Entry21& e = entries[i];
-				float* vals = (float*)&e;
-				for(int j=0;j<sizeof(Entry21)/sizeof(float);j++)
-					fprintf(fp, "%f,", vals[j]);
-				fprintf(fp, "\n"); 
-				if(i%10000 == 0)
-					printf("Writing to file: %d%%\r", 100*i/entries.getSize());
-			}
-			printf("                                               \rdone\n");
-		}
+		writeEntries<Entry21>(fp, binary, cids,getNumFileChannels());
 	}
 	else if(m_version == 2.2f)
 	{
 		// get IDs of extra channels
-		const int CID_PRI_NORMAL   = getChannelID(CID_PRI_NORMAL_NAME  );
-		const int CID_ALBEDO       = getChannelID(CID_ALBEDO_NAME      );
-		const int CID_SEC_ORIGIN   = getChannelID(CID_SEC_ORIGIN_NAME  );
-		const int CID_SEC_HITPOINT = getChannelID(CID_SEC_HITPOINT_NAME);
-		const int CID_SEC_MV       = getChannelID(CID_SEC_MV_NAME      );
-		const int CID_SEC_NORMAL   = getChannelID(CID_SEC_NORMAL_NAME  );
-		const int CID_DIRECT       = getChannelID(CID_DIRECT_NAME      );
-		const int CID_SEC_ALBEDO   = getChannelID(CID_SEC_ALBEDO_NAME  );
-		const int CID_SEC_DIRECT   = getChannelID(CID_SEC_DIRECT_NAME  );
-
-		if(CID_PRI_NORMAL  ==-1)	fail("Serialize: channel %s not defined", CID_PRI_NORMAL_NAME  );
-		if(CID_ALBEDO      ==-1)	fail("Serialize: channel %s not defined", CID_ALBEDO_NAME      );
-		if(CID_SEC_ORIGIN  ==-1)	fail("Serialize: channel %s not defined", CID_SEC_ORIGIN_NAME  );
-		if(CID_SEC_HITPOINT==-1)	fail("Serialize: channel %s not defined", CID_SEC_HITPOINT_NAME);
-		if(CID_SEC_MV      ==-1)	fail("Serialize: channel %s not defined", CID_SEC_MV_NAME      );
-		if(CID_SEC_NORMAL  ==-1)	fail("Serialize: channel %s not defined", CID_SEC_NORMAL_NAME  );
-		if(CID_DIRECT      ==-1)	fail("Serialize: channel %s not defined", CID_DIRECT_NAME      );
-		if(CID_SEC_ALBEDO  ==-1)	fail("Serialize: channel %s not defined", CID_SEC_ALBEDO_NAME  );
-		if(CID_SEC_DIRECT  ==-1)	fail("Serialize: channel %s not defined", CID_SEC_DIRECT_NAME  );
+		int cids[SCH_NUM];
+		getFileChannelIDs(cids);
 		
 		// TODO: new fields
 
@@ -1075,72 +1861,102 @@ void UVTSampleBuffer::serialize(const char* filename, bool separateHeader, bool
 			fail("coc coefficients not set");
 		float* m = (float*)&m_pixelToFocalPlane;
 
-		const int num = m_xy.getSize();
-
 		fprintf(fph, "Version 2.2\n");
 		fprintf(fph, "Width %d\n", m_width);
 		fprintf(fph, "Height %d\n", m_height);
 		fprintf(fph, "Samples per pixel %d\n", m_numSamplesPerPixel);
 		fprintf(fph, "CoC coefficients (coc radius = C0/w+C1): %f,%f\n", m_cocCoeff[0], m_cocCoeff[1]);
 		fprintf(fph, "Pixel-to-camera matrix: %f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f\n", *(m+0),*(m+1),*(m+2),*(m+3),*(m+4),*(m+5),*(m+6),*(m+7),*(m+8),*(m+9),*(m+10),*(m+11),*(m+12),*(m+13),*(m+14),*(m+15));
+		if(withStats)
+		{
+			SampleBufferStats stats;
+			computeStats(stats);
+			writeStats(fph, stats);
+		}
 		fprintf(fph, "Encoding = %s\n", binary ? "binary" : "text");
 		fprintf(fph, "x,y,w,u,v,t,r,g,b,%s(3d),%s(3d),%s(3d),%s(3d),%s(3d),%s(3d),%s(3d),%s(3d),%s(3d),%s(3d)\n", CID_PRI_MV_NAME,CID_PRI_NORMAL_NAME,CID_ALBEDO_NAME,CID_SEC_ORIGIN_NAME,CID_SEC_HITPOINT_NAME,CID_SEC_MV_NAME,CID_SEC_NORMAL_NAME,CID_DIRECT_NAME,CID_SEC_ALBEDO_NAME,CID_SEC_DIRECT_NAME);
 		// TODO: new fields
 
-		Array<Entry22> entries;
-		entries.reset(num);
+		writeEntries<Entry22>(fp, binary, cids,getNumFileChannels());
+	}
+	else if(m_version==3.0f)
+	{
+		if(!binary)
+			fail("Serialize: V3.0 supports only binary encoding");
+		if(isIrregular())
+			fail("Serialize: V3.0 does not support irregular buffers");
+
+		int cids[SCH_NUM];
+		getFileChannelIDs(cids);
 
-		int sidx=0;
-		for(int y=0;y<m_height;y++)
-		for(int x=0;x<m_width;x++)
-		for(int i=0;i<getNumSamples(x,y);i++)
+		// header
+		if(m_cocCoeff == Vec2f(FW_F32_MAX,FW_F32_MAX))
+			fail("coc coefficients not set");
+		float* m = (float*)&m_pixelToFocalPlane;
+
+		const int TILE_SIZE = 8;
+		const int tilesX    = (m_width +TILE_SIZE-1)/TILE_SIZE;
+		const int tilesY    = (m_height+TILE_SIZE-1)/TILE_SIZE;
+
+		fprintf(fph, "Version 3.0\n");
+		fprintf(fph, "Width %d\n", m_width);
+		fprintf(fph, "Height %d\n", m_height);
+		fprintf(fph, "Samples per pixel %d\n", m_numSamplesPerPixel);
+		fprintf(fph, "CoC coefficients (coc radius = C0/w+C1): %f,%f\n", m_cocCoeff[0], m_cocCoeff[1]);
+		fprintf(fph, "Pixel-to-camera matrix: %f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f\n", *(m+0),*(m+1),*(m+2),*(m+3),*(m+4),*(m+5),*(m+6),*(m+7),*(m+8),*(m+9),*(m+10),*(m+11),*(m+12),*(m+13),*(m+14),*(m+15));
+		fprintf(fph, "Tile size %d\n", TILE_SIZE);
+		if(withStats)
 		{
-			Entry22& e = entries[sidx++];
-			e.x = getSampleXY(x,y,i)[0];			// x	(in window coordinates, NOT multiplied with w)
-			e.y = getSampleXY(x,y,i)[1];			// y	(in window coordinates, NOT multiplied with w)
-			e.w = getSampleW(x,y,i);				// w	(camera-space z. Positive are visible, larger is farther).
-
-			e.u = getSampleUV(x,y,i)[0];			// u	[-1,1]
-			e.v = getSampleUV(x,y,i)[1];			// v	[-1,1]
-			e.t = getSampleT (x,y,i);				// t	[0,1]
-
-			e.r = getSampleColor(x,y,i)[0];			// r	[0,1]
-			e.g = getSampleColor(x,y,i)[1];			// g	[0,1]
-			e.b = getSampleColor(x,y,i)[2];			// b	[0,1]
-
-			e.pri_mv	   = getSampleMV(x,y,i);
-			e.pri_normal   = getSampleExtra<Vec3f>(CID_PRI_NORMAL  ,x,y,i);		// primitive normal (3D)
-			e.albedo       = getSampleExtra<Vec3f>(CID_ALBEDO      ,x,y,i);		// primary hit albedo
-			e.sec_origin   = getSampleExtra<Vec3f>(CID_SEC_ORIGIN  ,x,y,i);		// secondary ray origin (3D)
-			e.sec_hitpoint = getSampleExtra<Vec3f>(CID_SEC_HITPOINT,x,y,i);		// secondary ray hit point (3D)
-			e.sec_mv       = getSampleExtra<Vec3f>(CID_SEC_MV      ,x,y,i);		// secondary ray hit point motion vector (3D)
-			e.sec_normal   = getSampleExtra<Vec3f>(CID_SEC_NORMAL  ,x,y,i);		// secondary ray hit normal (3D)
-			e.direct       = getSampleExtra<Vec3f>(CID_DIRECT      ,x,y,i);		// direct light (r,g,b)
-			e.sec_albedo   = getSampleExtra<Vec3f>(CID_SEC_ALBEDO  ,x,y,i);		// direct light (r,g,b)
-			e.sec_direct   = getSampleExtra<Vec3f>(CID_SEC_DIRECT  ,x,y,i);		// direct light (r,g,b)
-
-			// TODO: new fields
+			SampleBufferStats stats;
+			computeStats(stats);
+			writeStats(fph, stats);
 		}
+		fprintf(fph, "Encoding = binary\n");
+		fprintf(fph, "w,x,y,u,v,t,r,g,b,%s(3d),%s(2d),%s(3d),%s(3d),%s(3d),%s(3d),%s(2d),%s(3d),%s(3d),%s(3d)\n", CID_PRI_MV_NAME,CID_PRI_NORMAL_NAME,CID_ALBEDO_NAME,CID_SEC_ORIGIN_NAME,CID_SEC_HITPOINT_NAME,CID_SEC_MV_NAME,CID_SEC_NORMAL_NAME,CID_DIRECT_NAME,CID_SEC_ALBEDO_NAME,CID_SEC_DIRECT_NAME);
 
-		if(binary)
+		// Boxes of the valid secondary origins and hit points in each tile.
+
+		Array<Vec3f> bounds;		// originMin, originMax, hitpointMin, hitpointMax per tile
+		bounds.reset(tilesX*tilesY*4);
+		for(int i=0;i<tilesX*tilesY;i++)
 		{
-			fwrite(entries.getPtr(), sizeof(Entry22), num, fp);
+			bounds[4*i+0] = bounds[4*i+2] = Vec3f(+FW_F32_MAX);
+			bounds[4*i+1] = bounds[4*i+3] = Vec3f(-FW_F32_MAX);
 		}
-		else
+
+		const StridedArray<Vec3f>& origins   = getChannel(CHANNEL_SEC_ORIGIN);
+		const StridedArray<Vec3f>& hitpoints = getChannel(CHANNEL_SEC_HITPOINT);
+		for(int y=0;y<m_height;y++)
+		for(int x=0;x<m_width;x++)
+		for(int i=getSampleIndex(x,y,0);i<getSampleIndex(x,y,0)+getNumSamples(x,y);i++)
 		{
-			printf("\n");
-			for(int i=0;i<entries.getSize();i++)
-			{
-				Entry22& e = entries[i];
-				float* vals = (float*)&e;
-				for(int j=0;j<sizeof(Entry21)/sizeof(float);j++)
-					fprintf(fp, "%f,", vals[j]);
-				fprintf(fp, "\n"); 
-				if(i%10000 == 0)
-					printf("Writing to file: %d%%\r", 100*i/entries.getSize());
-			}
-			printf("                                               \rdone\n");
+			Vec3f* b = &bounds[4*((y/TILE_SIZE)*tilesX + x/TILE_SIZE)];
+			const Vec3f origin   = origins[i];
+			const Vec3f hitpoint = hitpoints[i];
+			if(isValidPoint(origin))	{ b[0] = min(b[0],origin);   b[1] = max(b[1],origin); }
+			if(isValidPoint(hitpoint))	{ b[2] = min(b[2],hitpoint); b[3] = max(b[3],hitpoint); }
+		}
+
+		Array<Tile30> tiles;
+		tiles.reset(tilesX*tilesY);
+		for(int i=0;i<tiles.getSize();i++)
+		{
+			const Vec3f* b = &bounds[4*i];
+			Tile30& tile = tiles[i];
+			tile.originMin     = (b[0].x<=b[1].x) ? b[0] : Vec3f(0);		// empty tiles get an empty box
+			tile.originScale   = (b[0].x<=b[1].x) ? (b[1]-b[0])/(INVALID_POINT30-1) : Vec3f(0);
+			tile.hitpointMin   = (b[2].x<=b[3].x) ? b[2] : Vec3f(0);
+			tile.hitpointScale = (b[2].x<=b[3].x) ? (b[3]-b[2])/(INVALID_POINT30-1) : Vec3f(0);
 		}
+
+		// Encode. Track the largest errors so that the loss is visible when writing.
+
+		fwrite(tiles.getPtr(), sizeof(Tile30), tiles.getSize(), fp);
+		float errors[NUM_ERRORS30];
+		writeEntries30(fp, tiles.getPtr(), TILE_SIZE, errors);
+
+		printf("\nV3.0 max errors: xy %g px, uv %g, t %g, half %g (relative), normal %g rad, %s %g, %s %g\n",
+			errors[ERROR30_XY], errors[ERROR30_UV], errors[ERROR30_T], errors[ERROR30_HALF], errors[ERROR30_NORMAL], CID_SEC_ORIGIN_NAME,errors[ERROR30_ORIGIN], CID_SEC_HITPOINT_NAME,errors[ERROR30_HITPOINT]);
 	}
 	else
 		fail("serialize -- don't know how to export V%.1f", m_version);
@@ -1158,6 +1974,82 @@ void UVTSampleBuffer::serialize(const char* filename, bool separateHeader, bool
 
 //-------------------------------------------------------------------
 
+void UVTSampleBuffer::loadChannels(U32 channelMask)
+{
+	const U32 derived = channelMask & ~SCH_ALL;
+	channelMask &= ((1<<getNumFileChannels())-1) & ~m_loadedChannels;
+
+	if(channelMask && isMemoryMapped())
+		mapFileChannels(channelMask);
+	else if(channelMask && m_fileName.getLength())
+	{
+		FILE* fp = fopen(m_fileName.getPtr(), "rb");
+		if(!fp)
+			fail("File not found");
+		_fseeki64(fp, m_fileDataOffset, SEEK_SET);
+
+		printf("Loading channels... ");
+		int cids[SCH_NUM];
+		reserveFileChannels(cids, channelMask);
+		readSamples(fp, m_xy.getSize(), cids, false, derived);
+
+		fclose(fp);
+		printf("done\n");
+	}
+
+	// derived channels whose sources were already in memory (or mapped) are computed in one pass
+
+	if((derived & SCH_SEC_HITPOINT_T0) && !hasChannel(CHANNEL_SEC_HITPOINT_T0))
+	{
+		beginIngest(derived);
+		ingestSamples(0, m_xy.getSize());
+		endIngest();
+	}
+}
+
+//-------------------------------------------------------------------
+
+const void* UVTSampleBuffer::mapFile(const char* filename, S64 offset, S64 numBytes)
+{
+	FW_ASSERT(!m_mapView);
+
+	m_mapFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(m_mapFile == INVALID_HANDLE_VALUE)
+	{
+		m_mapFile = NULL;
+		fail("Cannot open '%s' for mapping", filename);
+	}
+
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(m_mapFile, &size))
+		failWin32Error("GetFileSizeEx");
+	if(size.QuadPart < offset+numBytes)
+		fail("Memory-mapped load: buffer contains fewer samples than expected");
+
+	// Copy-on-write: writes through the views go to private pages, never to the file.
+
+	m_mapping = CreateFileMapping(m_mapFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if(!m_mapping)
+		failWin32Error("CreateFileMapping");
+	m_mapView = MapViewOfFile(m_mapping, FILE_MAP_COPY, 0, 0, 0);
+	if(!m_mapView)
+		failWin32Error("MapViewOfFile");
+
+	return (const U8*)m_mapView + offset;
+}
+
+void UVTSampleBuffer::unmapFile(void)
+{
+	if(m_mapView)	UnmapViewOfFile(m_mapView);
+	if(m_mapping)	CloseHandle(m_mapping);
+	if(m_mapFile)	CloseHandle(m_mapFile);
+	m_mapView = NULL;
+	m_mapping = NULL;
+	m_mapFile = NULL;
+}
+
+//-------------------------------------------------------------------
+
 void UVTSampleBuffer::generateSobolCoop(Random& random)
 {
     Array<Vec4i> shuffle;
@@ -35,9 +35,12 @@
 #pragma once
 #include "base/Math.hpp"
 #include "base/Array.hpp"
+#include "base/String.hpp"
 #include "gui/Image.hpp"
 #include "base/Random.hpp"
+#include "base/DLLImports.hpp"
 #include "Util.hpp"
+#include <cstdio>
 
 namespace FW
 {
@@ -59,6 +62,121 @@ static const char* CID_DIRECT_NAME       = "direct";
 static const char* CID_SEC_ALBEDO_NAME   = "sec_albedo";
 static const char* CID_SEC_DIRECT_NAME   = "sec_direct";
 static const char* CID_PRI_NORMAL_SMOOTH_NAME   = "pri_smooth_normal";
+static const char* CID_SEC_HITPOINT_T0_NAME     = "sec_hitpoint_t0";	// sec_hitpoint moved back to t=0, gathered at load
+
+//-------------------------------------------------------------------
+// Typed channel handles. The well-known channels above have fixed
+// slots in the channel registry, so their handles are compile-time
+// constants and need no name lookup. Other channels get the next free
+// slot when reserved.
+//-------------------------------------------------------------------
+
+template<class T> struct ChannelHandle
+{
+	int				slot;
+};
+
+enum
+{
+	CHANNEL_SLOT_PRI_MV = 0,
+	CHANNEL_SLOT_PRI_NORMAL,
+	CHANNEL_SLOT_ALBEDO,
+	CHANNEL_SLOT_SEC_ORIGIN,
+	CHANNEL_SLOT_SEC_HITPOINT,
+	CHANNEL_SLOT_SEC_MV,
+	CHANNEL_SLOT_SEC_NORMAL,
+	CHANNEL_SLOT_DIRECT,
+	CHANNEL_SLOT_SEC_ALBEDO,
+	CHANNEL_SLOT_SEC_DIRECT,
+	CHANNEL_SLOT_PRI_NORMAL_SMOOTH,
+	CHANNEL_SLOT_SEC_HITPOINT_T0,
+
+	NUM_KNOWN_CHANNELS
+};
+
+static const ChannelHandle<Vec3f> CHANNEL_PRI_MV            = { CHANNEL_SLOT_PRI_MV };
+static const ChannelHandle<Vec3f> CHANNEL_PRI_NORMAL        = { CHANNEL_SLOT_PRI_NORMAL };
+static const ChannelHandle<Vec3f> CHANNEL_ALBEDO            = { CHANNEL_SLOT_ALBEDO };
+static const ChannelHandle<Vec3f> CHANNEL_SEC_ORIGIN        = { CHANNEL_SLOT_SEC_ORIGIN };
+static const ChannelHandle<Vec3f> CHANNEL_SEC_HITPOINT      = { CHANNEL_SLOT_SEC_HITPOINT };
+static const ChannelHandle<Vec3f> CHANNEL_SEC_MV            = { CHANNEL_SLOT_SEC_MV };
+static const ChannelHandle<Vec3f> CHANNEL_SEC_NORMAL        = { CHANNEL_SLOT_SEC_NORMAL };
+static const ChannelHandle<Vec3f> CHANNEL_DIRECT            = { CHANNEL_SLOT_DIRECT };
+static const ChannelHandle<Vec3f> CHANNEL_SEC_ALBEDO        = { CHANNEL_SLOT_SEC_ALBEDO };
+static const ChannelHandle<Vec3f> CHANNEL_SEC_DIRECT        = { CHANNEL_SLOT_SEC_DIRECT };
+static const ChannelHandle<Vec3f> CHANNEL_PRI_NORMAL_SMOOTH = { CHANNEL_SLOT_PRI_NORMAL_SMOOTH };
+static const ChannelHandle<Vec3f> CHANNEL_SEC_HITPOINT_T0   = { CHANNEL_SLOT_SEC_HITPOINT_T0 };
+
+// Extra channels of the V2.x file formats, one bit each, in file order.
+// Used for loading only the channels a reconstruction needs.
+enum
+{
+	SCH_PRI_NORMAL		= 1<<0,
+	SCH_ALBEDO			= 1<<1,
+	SCH_SEC_ORIGIN		= 1<<2,
+	SCH_SEC_HITPOINT	= 1<<3,
+	SCH_SEC_MV			= 1<<4,
+	SCH_SEC_NORMAL		= 1<<5,
+	SCH_DIRECT			= 1<<6,
+	SCH_SEC_ALBEDO		= 1<<7,		// V2.2 and V3.0 only
+	SCH_SEC_DIRECT		= 1<<8,		// V2.2 and V3.0 only
+
+	SCH_NUM				= 9,
+	SCH_ALL				= (1<<SCH_NUM)-1,
+
+	// Derived channels, computed while the file channels stream in. Not part of SCH_ALL.
+	SCH_SEC_HITPOINT_T0	= 1<<9,		// needs SCH_SEC_HITPOINT and SCH_SEC_MV
+};
+
+//-------------------------------------------------------------------
+// Per-sample storage. Either owns a tightly packed array, or is a
+// strided view into externally owned records (e.g. a mapped file).
+// StridedSpan is a non-owning window into a range of samples.
+//-------------------------------------------------------------------
+
+template<class T> class StridedSpan
+{
+public:
+					StridedSpan			(void)									: m_ptr(NULL), m_stride(sizeof(T)), m_size(0) {}
+					StridedSpan			(T* ptr, int stride, int size)			: m_ptr(ptr), m_stride(stride), m_size(size) {}
+
+	int				getSize				(void) const							{ return m_size; }
+	int				getStride			(void) const							{ return m_stride; }
+	T&				operator[]			(int idx) const							{ FW_ASSERT(idx>=0 && idx<m_size); return *(T*)((const U8*)m_ptr + (S64)idx*m_stride); }
+
+private:
+	T*				m_ptr;
+	int				m_stride;			// in bytes
+	int				m_size;
+};
+
+template<class T> class StridedArray
+{
+public:
+					StridedArray		(void)									: m_ptr(NULL), m_stride(sizeof(T)), m_size(0) {}
+
+	void			reset				(int size)								{ m_data.reset(size); m_ptr = (U8*)m_data.getPtr(); m_stride = sizeof(T); m_size = size; }
+	void			setView				(const void* ptr, int stride, int size)	{ m_data.reset(); m_ptr = (U8*)ptr; m_stride = stride; m_size = size; }
+
+	int				getSize				(void) const							{ return m_size; }
+	int				getStride			(void) const							{ return m_stride; }
+	bool			isView				(void) const							{ return m_size && !m_data.getSize(); }
+
+	StridedSpan<const T> getSpan		(int first, int num) const				{ FW_ASSERT(first>=0 && num>=0 && first+num<=m_size); return StridedSpan<const T>((const T*)(m_ptr + (S64)first*m_stride), m_stride, num); }
+	StridedSpan<T>	getSpan				(int first, int num)					{ FW_ASSERT(first>=0 && num>=0 && first+num<=m_size); return StridedSpan<T>((T*)(m_ptr + (S64)first*m_stride), m_stride, num); }
+
+	const T&		operator[]			(int idx) const							{ FW_ASSERT(idx>=0 && idx<m_size); return *(const T*)(m_ptr + (S64)idx*m_stride); }
+	T&				operator[]			(int idx)								{ FW_ASSERT(idx>=0 && idx<m_size); return *(T*)(m_ptr + (S64)idx*m_stride); }
+
+private:
+					StridedArray		(const StridedArray&);	// forbidden
+	StridedArray&	operator=			(const StridedArray&);	// forbidden
+
+	Array<T>		m_data;				// empty for views
+	U8*				m_ptr;
+	int				m_stride;			// in bytes
+	int				m_size;
+};
 
 class SampleBuffer
 {
@@ -80,7 +198,7 @@ public:
 	};
 
 					SampleBuffer		(int w,int h, int numSamplesPerPixel);
-	virtual			~SampleBuffer		(void)                                  { for(int i=0;i<m_channels.getSize();i++) { delete (Array<int>*)(m_channels[i]); } }
+	virtual			~SampleBuffer		(void)                                  { for(int i=0;i<m_channels.getSize();i++) { delete m_channels[i]; } }
 
 	bool			needRealloc			(int w,int h, int numSamplesPerPixel) const;
 
@@ -118,10 +236,33 @@ public:
 	void			setSampleFloat		(int id, int x,int y,int i, float val)	{ setSampleExtra<float>(id,x,y,i, val); }
 	void			setSampleInt		(int id, int x,int y,int i, int val)	{ setSampleExtra<int>(id,x,y,i, val); }
 
-	template<class T> T    getSampleExtra	(int cid, int x,int y,int i) const		{ if(cid==-1) return T(0); const Array<T>& ec = *(const Array<T>*)(m_channels[cid]); return ec[getIndex(x,y,i)]; }
-	template<class T> void setSampleExtra	(int cid, int x,int y,int i, T val)		{ Array<T>& ec = *(Array<T>*)(m_channels[cid]); ec[getIndex(x,y,i)] = val; }
-	template<class T> int  reserveChannel	(const String& name)					{ int i = getChannelID(name); if(i==-1){ i = m_channelNames.getSize(); Array<T>*c = new Array<T>; c->reset(m_xy.getSize()); m_channels.add(c); m_channelNames.add(name); } return i; }
-	int					   getChannelID		(const String& name) const				{ for(int i=0;i<m_channelNames.getSize();i++) { if(m_channelNames[i]==name) return i; } return -1; }
+	template<class T> T    getSampleExtra	(int cid, int x,int y,int i) const		{ if(cid==-1) return T(0); return getChannelData<T>(cid)[getIndex(x,y,i)]; }
+	template<class T> void setSampleExtra	(int cid, int x,int y,int i, T val)		{ getChannelData<T>(cid)[getIndex(x,y,i)] = val; }
+	template<class T> int  reserveChannel	(const String& name)					{ int i = getChannelID(name); if(i==-1){ StridedArray<T>& c = addChannel<T>(name,i); c.reset(m_xy.getSize()); } return i; }
+	int					   getChannelID		(const String& name) const;				// -1 if the channel is not present
+
+	// Typed, index-addressed channel access. Samples are stored in pixel order, so a scanline is a
+	// contiguous range of sample indices (also in irregular buffers); spans stream through it without
+	// per-sample getIndex(). Index a row span with getSampleIndex(x,y,i)-getRowBegin(y), pixels of
+	// irregular buffers have varying sample counts.
+
+	template<class T> bool					hasChannel		(ChannelHandle<T> h) const				{ return h.slot>=0 && h.slot<m_channels.getSize() && m_channels[h.slot]; }
+	template<class T> const StridedArray<T>& getChannel		(ChannelHandle<T> h) const				{ FW_ASSERT(hasChannel(h)); return getChannelData<T>(h.slot); }
+	template<class T> StridedArray<T>&		getChannel		(ChannelHandle<T> h)					{ FW_ASSERT(hasChannel(h)); return getChannelData<T>(h.slot); }
+	template<class T> T						getSampleExtra	(ChannelHandle<T> h, int x,int y,int i) const	{ return hasChannel(h) ? getChannelData<T>(h.slot)[getIndex(x,y,i)] : T(0); }
+	template<class T> StridedSpan<const T>	getChannelRow	(ChannelHandle<T> h, int y) const		{ return getChannel(h).getSpan(getRowBegin(y), getRowEnd(y)-getRowBegin(y)); }
+
+	int				getSampleIndex		(int x,int y,int i) const				{ return getIndex(x,y,i); }
+	int				getRowBegin			(int y) const							{ return isIrregular() ? m_firstSample[y*m_width] : y*m_width*m_numSamplesPerPixel; }
+	int				getRowEnd			(int y) const							{ return (y+1<m_height) ? getRowBegin(y+1) : m_xy.getSize(); }
+
+	StridedSpan<const Vec2f> getRowXY	(int y) const							{ return m_xy.getSpan(getRowBegin(y), getRowEnd(y)-getRowBegin(y)); }
+	StridedSpan<const Vec4f> getRowColor(int y) const							{ return StridedSpan<const Vec4f>(m_color.getPtr(getRowBegin(y)), sizeof(Vec4f), getRowEnd(y)-getRowBegin(y)); }
+	StridedSpan<const float> getRowW	(int y) const							{ return m_w.getSpan(getRowBegin(y), getRowEnd(y)-getRowBegin(y)); }
+
+	const Vec2f&	getSampleXY			(int idx) const							{ return m_xy[idx]; }		// idx from getSampleIndex()
+	const Vec4f&	getSampleColor		(int idx) const							{ return m_color[idx]; }
+	const float&	getSampleW			(int idx) const							{ return m_w[idx]; }
 
 	// V2.0 functionality
 
@@ -137,19 +278,51 @@ public:
 protected:
 	SampleBuffer()	{}
 	inline int		getIndex			(int x,int y,int i) const				{ return isIrregular() ? (m_firstSample[y*m_width+x]+i) : ((y*m_width+x)*m_numSamplesPerPixel+i); }
+	template<class T> int  mapChannel		(const String& name, const void* ptr, int stride, int size)	{ FW_ASSERT(getChannelID(name)==-1); int i; addChannel<T>(name,i).setView(ptr,stride,size); return i; }
+
+	// Channel registry. Slots of the well-known channels are fixed; a NULL entry is an absent channel.
+
+	struct ChannelStorage
+	{
+		virtual			~ChannelStorage		(void)								{}
+		String			name;
+		int				elementSize;
+	};
+
+	template<class T> struct TypedChannelStorage : public ChannelStorage
+	{
+		StridedArray<T>	data;
+	};
+
+	static int		getKnownChannelSlot	(const String& name);
+	template<class T> StridedArray<T>&		getChannelData	(int slot) const	{ FW_ASSERT(m_channels[slot] && m_channels[slot]->elementSize==sizeof(T)); return ((TypedChannelStorage<T>*)m_channels[slot])->data; }
+	template<class T> StridedArray<T>&		addChannel		(const String& name, int& slot)
+	{
+		slot = getKnownChannelSlot(name);
+		if(slot==-1)
+			slot = max(m_channels.getSize(), (int)NUM_KNOWN_CHANNELS);
+		while(m_channels.getSize() <= slot)
+			m_channels.add(NULL);
+		FW_ASSERT(!m_channels[slot]);
+
+		TypedChannelStorage<T>* c = new TypedChannelStorage<T>;
+		c->name			= name;
+		c->elementSize	= sizeof(T);
+		m_channels[slot] = c;
+		return c->data;
+	}
 
 	int				m_width;
 	int				m_height;
 	int				m_numSamplesPerPixel;
 
-	Array<Vec2f>	m_xy;				// for each sample
+	StridedArray<Vec2f>	m_xy;			// for each sample
 	Array<Vec4f>	m_color;			// for each sample
 	Array<float>	m_depth;			// for each sample
-	Array<float>	m_w;				// for each sample
+	StridedArray<float>	m_w;			// for each sample
     Array<float>    m_weight;           // scanout weight, for each sample
 
-	Array<void*>	m_channels;
-	Array<String>	m_channelNames;
+	Array<ChannelStorage*>	m_channels;	// indexed by slot
 
 	bool			m_irregular;
 	Array<int>		m_numSamples;		// for each pixel (allocated only for irregular buffers)
@@ -159,6 +332,48 @@ protected:
 	float			m_version;
 };
 
+//-------------------------------------------------------------------
+// Summary of a UVTSampleBuffer. Read from the file header when the
+// file has a statistics block, otherwise the bounds and the invalid
+// count are gathered while the samples are loaded.
+//-------------------------------------------------------------------
+
+struct SampleBufferStats
+{
+	bool			valid;			// bounds and numInvalid
+	bool			hasMoments;		// also everything below (statistics block only)
+
+	Vec3f			hitpointMinT0;	// bounds of the valid secondary hit points at t=0
+	Vec3f			hitpointMaxT0;
+	Vec3f			hitpointMinT1;	// ... and at t=1
+	Vec3f			hitpointMaxT1;
+	int				numInvalid;		// samples without a secondary hit
+
+	// Per-component moments over the samples with a valid secondary origin.
+	// Values above 1e10 (invalid points) are skipped.
+	int				numMomentSamples;
+	Vec3f			colorMean;
+	Vec3f			colorStddev;
+	Vec3f			colorMax;
+	Vec3f			channelMean  [SCH_NUM];	// extra channels in file order (SCH_*)
+	Vec3f			channelStddev[SCH_NUM];
+
+	const Vec3f&	getChannelMean	(U32 sch) const		{ return channelMean  [getChannelIndex(sch)]; }	// sch: one SCH_* bit
+	const Vec3f&	getChannelStddev(U32 sch) const		{ return channelStddev[getChannelIndex(sch)]; }
+	static int		getChannelIndex	(U32 sch)			{ FW_ASSERT(sch && !(sch&(sch-1))); int c=0; while(sch>>=1) c++; return c; }
+
+	SampleBufferStats()
+	{
+		valid = hasMoments = false;
+		hitpointMinT0 = hitpointMinT1 = Vec3f( FW_F32_MAX);
+		hitpointMaxT0 = hitpointMaxT1 = Vec3f(-FW_F32_MAX);
+		numInvalid = numMomentSamples = 0;
+		colorMean = colorStddev = colorMax = Vec3f(0);
+		for(int c=0;c<SCH_NUM;c++)
+			channelMean[c] = channelStddev[c] = Vec3f(0);
+	}
+};
+
 //-------------------------------------------------------------------
 // Adds lens position (uv) and time (t) for each sample
 //-------------------------------------------------------------------
@@ -167,12 +382,13 @@ class UVTSampleBuffer : public SampleBuffer
 {
 public:
 					UVTSampleBuffer		(int w,int h, int numSamplesPerPixel);
-    virtual         ~UVTSampleBuffer    (void)                                  {}
+    virtual         ~UVTSampleBuffer    (void)                                  { unmapFile(); }
 
 	void			clear				(const Vec4f& color,float depth,float w);
 	void			setSample			(const Sample& s)						{ SampleBuffer::setSample(s); setSampleMV(s.x,s.y,s.i,s.mv); setSampleWG(s.x,s.y,s.i,s.wg); }
 
 	float			getSampleT			(int x,int y, int i) const				{ return m_t [getIndex(x,y,i)]; }
+	float			getSampleT			(int idx) const							{ return m_t [idx]; }
 	void			setSampleT			(int x,int y,int i, float t)			{ m_t [getIndex(x,y,i)] = t; }
 
 	const Vec2f&	getSampleUV			(int x,int y, int i) const				{ return m_uv[getIndex(x,y,i)]; }
@@ -184,6 +400,10 @@ public:
 	const Vec2f&	getSampleWG			(int x,int y, int i) const				{ return m_wg[getIndex(x,y,i)]; }
 	void			setSampleWG			(int x,int y, int i, const Vec2f& wg)	{ m_wg[getIndex(x,y,i)] = wg; }
 
+	StridedSpan<const Vec2f> getRowUV	(int y) const							{ return m_uv.getSpan(getRowBegin(y), getRowEnd(y)-getRowBegin(y)); }
+	StridedSpan<const float> getRowT	(int y) const							{ return m_t .getSpan(getRowBegin(y), getRowEnd(y)-getRowBegin(y)); }
+	StridedSpan<const Vec3f> getRowMV	(int y) const							{ return m_mv.getSpan(getRowBegin(y), getRowEnd(y)-getRowBegin(y)); }
+
 	bool			isAffineMotion		(void) const							{ return m_affineMotion; }
 	void			setMotionModel		(bool affine)							{ m_affineMotion=affine; }
 
@@ -192,22 +412,50 @@ public:
 
 	// serialization.
 
-					UVTSampleBuffer			(const char* filename);
-	void			serialize				(const char* filename, bool separateHeader=false, bool binary=false) const;
+					UVTSampleBuffer			(const char* filename, bool memoryMapped=false, U32 channelMask=SCH_ALL);	// memoryMapped: binary V2.2 channels are views into the file
+	bool			isMemoryMapped			(void) const						{ return m_mapView != NULL; }
+	void			loadChannels			(U32 channelMask);					// reads the SCH_* channels that are not loaded yet from the file, and computes the derived ones
+	U32				getLoadedChannels		(void) const						{ return m_loadedChannels; }
+	const SampleBufferStats& getStats		(void) const						{ return m_stats; }
+	void			computeStats			(SampleBufferStats& stats) const;	// full pass, requires all V2.2 channels
+	void			serialize				(const char* filename, bool separateHeader=false, bool binary=false, bool withStats=false) const;	// withStats: V2.2 and V3.0 only
 
 protected:
-	UVTSampleBuffer()	{ m_affineMotion=true; }
+	UVTSampleBuffer()	{ m_affineMotion=true; m_mapFile=NULL; m_mapping=NULL; m_mapView=NULL; m_fileDataOffset=0; m_fileBinary=false; m_fileTileSize=0; m_loadedChannels=0; m_ingesting=false; m_ingestT0=false; m_ingestStats=false; }
 
     void            generateSobolCoop   (Random& random);
+	const void*		mapFile				(const char* filename, S64 offset, S64 numBytes);
+	void			unmapFile			(void);
+	void			beginIngest			(U32 channelMask);						// derived SCH_* channels to compute
+	void			ingestSamples		(int first, int num);					// called as soon as a block of samples has been stored
+	void			endIngest			(void);
+	struct IngestTask;
+	struct StatsTask;
+	bool			readStats			(FILE* fph);							// optional statistics block
+	void			writeStats			(FILE* fph, const SampleBufferStats& stats) const;
 
 	bool			m_affineMotion;
 	Vec2f			m_cocCoeff;
 
-	Array<Vec2f>	m_uv;			// for each sample
-	Array<float>	m_t;			// for each sample
-	Array<Vec3f>	m_mv;			// for each sample
+	StridedArray<Vec2f>	m_uv;		// for each sample
+	StridedArray<float>	m_t;		// for each sample
+	StridedArray<Vec3f>	m_mv;		// for each sample
 	Array<Vec2f>	m_wg;			// for each sample
 
+	HANDLE			m_mapFile;		// memory-mapped load only
+	HANDLE			m_mapping;
+	void*			m_mapView;
+
+	String			m_fileName;		// source of loadChannels()
+	S64				m_fileDataOffset;
+	bool			m_fileBinary;
+	int				m_fileTileSize;	// V3.0
+	U32				m_loadedChannels;
+	SampleBufferStats m_stats;
+	bool			m_ingesting;
+	bool			m_ingestT0;		// SCH_SEC_HITPOINT_T0 was requested
+	bool			m_ingestStats;	// the header had no statistics block
+
 	// for fileformat
 	struct Entry13
 	{
@@ -232,6 +480,68 @@ protected:
 		float x,y,w,u,v,t,r,g,b;
 		UnalignedVec3f pri_mv,pri_normal,albedo,sec_origin,sec_hitpoint,sec_mv,sec_normal,direct,sec_albedo,sec_direct;
 	};
+
+	struct Entry30	// quantized Entry22, 76 bytes. Error bounds are listed in README.txt.
+	{
+		float	w;
+		U16		x,y;					// offset within the pixel, 1/65536 units
+		S16		u,v;					// snorm
+		U16		t;						// unorm
+		U16		rgb[3];					// half
+		U16		pri_mv[3];				// half
+		S16		pri_normal[2];			// octahedral, snorm
+		U16		albedo[3];				// half
+		U16		sec_origin[3];			// unorm in the tile's sec_origin box, 0xFFFF = invalid
+		U16		sec_hitpoint[3];		// unorm in the tile's sec_hitpoint box, 0xFFFF = invalid
+		U16		sec_mv[3];				// half
+		S16		sec_normal[2];			// octahedral, snorm
+		U16		direct[3];				// half
+		U16		sec_albedo[3];			// half
+		U16		sec_direct[3];			// half
+	};
+
+	struct Tile30	// V3.0 per-tile boxes of the valid secondary origins and hit points; value = min + code*scale
+	{
+		UnalignedVec3f originMin, originScale, hitpointMin, hitpointScale;
+	};
+
+	// import. cids lists the extra channels in file order, -1 for channels that are skipped.
+	// base=false leaves everything but the extra channels untouched (loadChannels).
+	template<class Entry> struct TextChunk;
+	int				getNumFileChannels	(void) const;
+	void			reserveFileChannels	(int* cids, U32 channelMask);
+	void			mapFileChannels		(U32 channelMask);
+	void			readSamples			(FILE* fp, int num, const int* cids, bool base, U32 channelMask);	// channelMask: derived channels to compute
+	void			storeEntry			(int idx, const Entry13& e, const int* cids, int numCids, bool base);
+	template<class Entry> void storeEntry	(int idx, const Entry& e, const int* cids, int numCids, bool base);
+	template<class Entry> void readBinary	(int num, const int* cids, int numCids, bool base, const char* version);
+	template<class Entry> void parseText	(FILE* fp, int num, const int* cids, int numCids, bool base, const char* version);
+	struct DecodeTask30;
+	void			storeEntry			(int idx, const Entry30& e, const Tile30& tile, const int* cids, int numCids, bool base);
+	void			readBinary30		(int num, const int* cids, int numCids, bool base);
+	int				getTileIndex30		(int idx, int tileSize) const;
+
+	// export. Writes all samples after the header, in blocks of bounded size.
+	enum
+	{
+		ERROR30_XY = 0,
+		ERROR30_UV,
+		ERROR30_T,
+		ERROR30_HALF,
+		ERROR30_NORMAL,
+		ERROR30_ORIGIN,
+		ERROR30_HITPOINT,
+
+		NUM_ERRORS30
+	};
+	template<class Entry> struct WriteChunk;
+	void			getFileChannelIDs	(int* cids) const;						// fails if a channel of the file format is missing
+	void			loadEntry			(int idx, Entry13& e, const int* cids, int numCids) const;
+	template<class Entry> void loadEntry	(int idx, Entry& e, const int* cids, int numCids) const;
+	template<class Entry> void writeEntries	(FILE* fp, bool binary, const int* cids, int numCids) const;
+	struct EncodeTask30;
+	void			encodeEntry30		(int idx, Entry30& e, const Tile30& tile, float* errors) const;	// errors: NUM_ERRORS30 running maxima
+	void			writeEntries30		(FILE* fp, const Tile30* tiles, int tileSize, float* errors) const;
 };
 
 } //
@@ -334,4 +334,68 @@ U64 morton(U32 x,U32 y,U32 z)
 	return (xx) | (yy<<1) | (zz<<2);
 }
 
+U16 floatToHalf(float f)
+{
+	const U32 x    = floatToBits(f);
+	const U32 sign = (x>>16) & 0x8000;
+	const U32 absx = x & 0x7FFFFFFF;
+
+	if(absx >= 0x7F800000)		return (U16)(sign | ((absx>0x7F800000) ? 0x7E00 : 0x7C00));	// NaN, Inf
+	if(absx >= 0x477FF000)		return (U16)(sign | 0x7BFF);								// would round to Inf, clamp to 65504
+
+	if(absx < 0x38800000)		// denormal half
+	{
+		const int shift = 126 - (int)(absx>>23);
+		if(shift > 24)
+			return (U16)sign;
+		const U32 m    = (absx & 0x7FFFFF) | 0x800000;
+		const U32 rem  = m & ((1u<<shift)-1);
+		const U32 half = 1u<<(shift-1);
+		U32 h = m >> shift;
+		if(rem > half || (rem == half && (h&1)))
+			h++;
+		return (U16)(sign | h);
+	}
+
+	U32 h = (absx - 0x38000000) >> 13;	// rebias exponent 127 -> 15
+	const U32 rem = absx & 0x1FFF;
+	if(rem > 0x1000 || (rem == 0x1000 && (h&1)))
+		h++;
+	return (U16)(sign | h);
+}
+
+float halfToFloat(U16 h)
+{
+	const U32 sign = (U32)(h & 0x8000) << 16;
+	const U32 e    = (h>>10) & 0x1F;
+	const U32 m    = h & 0x3FF;
+
+	if(e == 0)	return (sign ? -1.f : 1.f) * m * (1.f/16777216.f);	// denormal
+	if(e == 31)	return bitsToFloat(sign | 0x7F800000 | (m<<13));		// NaN, Inf
+	return bitsToFloat(sign | ((e+112)<<23) | (m<<13));
+}
+
+Vec2f octEncode(const Vec3f& n)
+{
+	const float l1 = abs(n.x) + abs(n.y) + abs(n.z);
+	if(l1 == 0)
+		return Vec2f(0);
+
+	Vec2f e(n.x/l1, n.y/l1);
+	if(n.z < 0)		// fold the lower hemisphere over the diagonals
+		e = Vec2f( (1-abs(e.y)) * (e.x>=0 ? 1.f : -1.f), (1-abs(e.x)) * (e.y>=0 ? 1.f : -1.f) );
+	return e;
+}
+
+Vec3f octDecode(const Vec2f& e)
+{
+	Vec3f n(e.x, e.y, 1-abs(e.x)-abs(e.y));
+	if(n.z < 0)
+	{
+		n.x = (1-abs(e.y)) * (e.x>=0 ? 1.f : -1.f);
+		n.y = (1-abs(e.x)) * (e.y>=0 ? 1.f : -1.f);
+	}
+	return n.normalized();
+}
+
 } //
\ No newline at end of file
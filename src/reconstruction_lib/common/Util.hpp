@@ -58,6 +58,17 @@ float larcherPillichshammer		(int i,U32 randomScramble=0);
 U64   morton					(U32 x,U32 y);
 U64   morton					(U32 x,U32 y,U32 z);
 
+// Compact encodings (sample buffer V3.0). Half floats round to nearest even; values beyond the half range clamp to +-65504.
+// Normals are octahedral-mapped to [-1,1]^2 and decoded to unit length.
+U16   floatToHalf				(float f);
+float halfToFloat				(U16 h);
+Vec2f octEncode					(const Vec3f& n);
+Vec3f octDecode					(const Vec2f& e);
+inline U16   quantizeUnorm16	(float v)							{ return (U16)(clamp(v,0.f,1.f)*65535.f+0.5f); }
+inline float dequantizeUnorm16	(U16 q)								{ return q*(1.f/65535.f); }
+inline S16   quantizeSnorm16	(float v)							{ v = clamp(v,-1.f,1.f)*32767.f; return (S16)(v<0 ? v-0.5f : v+0.5f); }
+inline float dequantizeSnorm16	(S16 q)								{ return max(q*(1.f/32767.f), -1.f); }
+
 // given UNIT vector v, fills m with matrix whose 3rd column is v, and columns 0,1 are orthogonal to v and each other
 // (i.e., returns matrix that maps from the local coordinates oriented with v into the ambient coordinates in which v is defined.
 //  to go the other direction, i.e., ambient coordinates to the v-oriented local coordinate system, invert the resulting matrix).
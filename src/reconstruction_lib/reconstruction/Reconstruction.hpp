@@ -40,6 +40,36 @@ namespace FW
 class Reconstruction
 {
 public:
+	// SCH_* channels each reconstruction reads; load these before calling it (UVTSampleBuffer::loadChannels).
+	enum
+	{
+		CHANNELS_INDIRECT		= SCH_PRI_NORMAL | SCH_ALBEDO | SCH_SEC_ORIGIN | SCH_SEC_HITPOINT | SCH_SEC_MV | SCH_SEC_NORMAL | SCH_SEC_HITPOINT_T0,
+		CHANNELS_INDIRECT_CUDA	= CHANNELS_INDIRECT | SCH_SEC_ALBEDO | SCH_SEC_DIRECT,		// secondary albedo/direct are used when present
+		CHANNELS_AO				= CHANNELS_INDIRECT & ~SCH_ALBEDO,
+		CHANNELS_AO_CUDA		= CHANNELS_AO,
+		CHANNELS_GLOSSY			= CHANNELS_INDIRECT,
+		CHANNELS_GLOSSY_CUDA	= CHANNELS_INDIRECT_CUDA,
+		CHANNELS_DOF_MOTION		= CHANNELS_INDIRECT,
+		CHANNELS_RPF			= SCH_PRI_NORMAL | SCH_ALBEDO | SCH_SEC_ORIGIN | SCH_SEC_HITPOINT | SCH_SEC_NORMAL,	// smooth normals are derived from SCH_PRI_NORMAL
+		CHANNELS_ATROUS			= CHANNELS_RPF,
+	};
+
+	// Hierarchy builders of the Lehtinen et al. reconstructions. The SAH cost of the result is printed,
+	// the better choice depends on the scene.
+	enum Builder
+	{
+		BUILDER_MORTON = 0,		// Kontkanen-style octree of Morton codes
+		BUILDER_SAH,			// the same, then tree rotations that reduce the SAH cost of the bloated hierarchy
+	};
+
+	// Density estimation of the Lehtinen et al. reconstructions, i.e., how the splat radii are found.
+	enum DensityEngine
+	{
+		DENSITY_EXACT = 0,		// K nearest neighbours from the hierarchy
+		DENSITY_GRID,			// K nearest neighbours from a hashed uniform grid, prints the difference to the hierarchy search
+	};
+
+			Reconstruction				(Builder builder=BUILDER_MORTON, bool spatialSplits=false, bool motionPartition=false, DensityEngine density=DENSITY_EXACT) : m_builder(builder), m_spatialSplits(spatialSplits), m_motionPartition(motionPartition), m_density(density) {}
 
 	// Lehtinen et al. Siggraph 2012
 	void	reconstructIndirect			(const UVTSampleBuffer& sbuf, int numReconstructionRays, Image& image, Image* debugImage=NULL, Vec4i scissor=Vec4i(0));	// scissor x0,y0,x1,y1; 0=inc, 1=exc
@@ -58,6 +88,12 @@ public:
 
 	// A-trous
 	void	reconstructATrous			(const UVTSampleBuffer& sbuf, Image& image, Image* debugImage=NULL, float aoLength=0.f);
+
+private:
+	Builder	m_builder;
+	bool	m_spatialSplits;	// split oversized splats into several references (CPU, static scenes)
+	bool	m_motionPartition;	// separate subtrees for static and moving samples (motion)
+	DensityEngine m_density;
 };
 
 
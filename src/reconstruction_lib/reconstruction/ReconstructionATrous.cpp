@@ -86,10 +86,33 @@ void Reconstruction::reconstructATrous(const UVTSampleBuffer& sbuf, Image& resul
 // Init
 //-----------------------------------------------------------------------
 
+static inline void accumulate(Vec3f& E, Vec3f& E2, Vec3f& mx, const Vec3f& v)
+{
+	E  += v;
+	E2 += v*v;
+	mx  = max(mx,v);
+}
+
+// Moments of the values below 1e10, over the same samples and with the same formula as the statistics block
+// (UVTSampleBuffer::computeStats), so that the block is only a cache.
+struct ValidMoments
+{
+	Vec3d	sum;
+	Vec3d	sum2;
+	int		count;
+
+			ValidMoments()				: sum(0), sum2(0), count(0) {}
+	void	add(const Vec3f& v)			{ if(v.max() >= 1e10f) return; sum += Vec3d(v); sum2 += Vec3d(v)*Vec3d(v); count++; }
+	Vec3f	getStddev() const
+	{
+		const Vec3d mean = sum  / (F64)max(count,1);
+		const Vec3d var  = sum2 / (F64)max(count,1) - mean*mean;
+		return Vec3f((F32)sqrt(max(var.x,0.0)), (F32)sqrt(max(var.y,0.0)), (F32)sqrt(max(var.z,0.0)));
+	}
+};
+
 ATrous::ATrous(Image* resultImage, Image* debugImage, const UVTSampleBuffer& sbuf, float aoLength)
 {
-	if(sbuf.isIrregular())
-		fail("ATrous implementation does not support irregular sample buffers");
 	if(sbuf.getVersion()<2.f)
 		fail("ATrous works only with sample buffer >= V2.0");
 
@@ -112,6 +135,21 @@ ATrous::ATrous(Image* resultImage, Image* debugImage, const UVTSampleBuffer& sbu
 	m_numSamples .reset(w*h);
 	m_firstSample.reset(w*h);
 
+	// The initial stddevs of the channels covered by the file's statistics block are taken from there.
+	// The rest (smoothed normal, and color unless it is used as is) are accumulated while fetching.
+
+	const SampleBufferStats& stats = sbuf.getStats();
+	const bool geometryStats = stats.hasMoments;
+	bool colorStats = stats.hasMoments && aoLength<=0;
+#ifdef PRE_MULTIPLY_ALBEDO
+	colorStats = false;
+#endif
+
+	SampleVector E;
+	SampleVector E2;
+	SampleVector mx;
+	ValidMoments mp, mn2, mp2, ma, mc;
+
 	for(int i=0;i<w*h;i++)
 	{
 		m_numSamples [i] = 0; 
@@ -139,7 +177,7 @@ ATrous::ATrous(Image* resultImage, Image* debugImage, const UVTSampleBuffer& sbu
 		if(aoLength>0)
 			s.c  = (s.p2-s.p).length()<=aoLength ? 0.f : 1.f;
 
-		if(s.p.max() > 1e10f)										// invalid sample (this is due to technical reasons inside PBRT)
+		if(s.p.max() >= 1e10f)										// invalid sample (this is due to technical reasons inside PBRT)
 			continue;
 
 		const int numSamples = m_samples.getSize();
@@ -151,23 +189,24 @@ ATrous::ATrous(Image* resultImage, Image* debugImage, const UVTSampleBuffer& sbu
 		m_samples.add( s );
 		m_inputColors .add( s.c );
 		m_outputColors.add( s.c );
-	}
-
-	// compute initial stddevs
 
-	SampleVector E;
-	SampleVector E2;
-	SampleVector mx;
-	for(int i=0;i<m_samples.getSize();i++)
-	{
-		const SampleVector& s = m_samples[i];
-		for(int k=0;k<SampleVector::getSize();k++)
+		accumulate(E.n,E2.n,mx.n, s.n);
+		if(!geometryStats)
 		{
-			E [k] += s[k];
-			E2[k] += s[k]*s[k];
-			mx[k]  = max(mx[k],s[k]);
+			mp .add(s.p);
+			mn2.add(s.n2);
+			mp2.add(s.p2);									// skips the rays that escaped
+			ma .add(s.a);
+		}
+		if(!colorStats)
+		{
+			mc.add(s.c);
+			mx.c = max(mx.c, s.c);
 		}
 	}
+
+	// compute initial stddevs
+
 	E. divide( m_samples.getSize() );
 	E2.divide( m_samples.getSize() );
 
@@ -175,6 +214,28 @@ ATrous::ATrous(Image* resultImage, Image* debugImage, const UVTSampleBuffer& sbu
 	for(int k=0;k<SampleVector::getSize();k++)
 		stddev[k] = max(0.f, sqrt(E2[k] - E[k]*E[k]));
 
+	if(geometryStats)
+	{
+		stddev.p  = stats.getChannelStddev(SCH_SEC_ORIGIN);
+		stddev.n2 = stats.getChannelStddev(SCH_SEC_NORMAL);
+		stddev.p2 = stats.getChannelStddev(SCH_SEC_HITPOINT);
+		stddev.a  = stats.getChannelStddev(SCH_ALBEDO);
+	}
+	else
+	{
+		stddev.p  = mp .getStddev();
+		stddev.n2 = mn2.getStddev();
+		stddev.p2 = mp2.getStddev();
+		stddev.a  = ma .getStddev();
+	}
+	if(colorStats)
+	{
+		stddev.c = stats.colorStddev;
+		mx.c     = stats.colorMax;
+	}
+	else
+		stddev.c = mc.getStddev();
+
 	// set scene-dependent fudge factors... (obtained via manual search)
 
 	float p_scale  = 1;
@@ -29,7 +29,7 @@
 README:
 	* GPU reconstruction recommended for indirect/AO, Glossy. Much faster. CPU perhaps preferred for understanding the code. The two are mostly identical.
 	* CPU reconstruction supports an optional scissor rectangle. This can be very useful for trying things out in a finite time.
-	* CPU path supports motion-BVH by default. This cost +10% compared to the runs in the paper (used to be a #define).
+	* CPU path supports motion-BVH. The hot loops are templates on a motion policy, so static scenes do not pay for it.
 	* Glossy:
 		* CUDA supports large ray dumps with a streaming algorith.
 		* CPU supports only smaller in-memory buffers.
@@ -42,11 +42,15 @@ README:
 
 #pragma warning(disable:4127)		// conditional expression is constant
 #include "ReconstructionIndirect.hpp"
-#include "base/BinaryHeap.hpp"
+#include "base/Timer.hpp"
 
 namespace FW
 {
 
+const float ReconstructIndirect::VMF_THRESHOLD_MAX   = 0.5f;
+const float ReconstructIndirect::VMF_THRESHOLD_SCALE = 0.75f;
+const float ReconstructIndirect::KNN_TIME            = 0.5f;
+
 //-----------------------------------------------------------------------
 // Entry points
 //-----------------------------------------------------------------------
@@ -54,7 +58,7 @@ namespace FW
 void Reconstruction::reconstructIndirect(const UVTSampleBuffer& sbuf, int numReconstructionRays, Image& image, Image* debugImage, Vec4i scissor)
 {
 	profileStart();
-	ReconstructIndirect ri(sbuf,numReconstructionRays,"",0,true,false,false,scissor);
+	ReconstructIndirect ri(sbuf,numReconstructionRays,"",0,true,false,false,scissor,m_builder,m_spatialSplits,m_motionPartition,m_density);
 	ri.filterImage(image,debugImage);
 	profileEnd();
 }
@@ -62,7 +66,7 @@ void Reconstruction::reconstructIndirect(const UVTSampleBuffer& sbuf, int numRec
 void Reconstruction::reconstructIndirectCuda(const UVTSampleBuffer& sbuf, int numReconstructionRays, Image& image)
 {
 	profileStart();
-	ReconstructIndirect ri(sbuf,numReconstructionRays,"",0,true,true,false);
+	ReconstructIndirect ri(sbuf,numReconstructionRays,"",0,true,true,false,Vec4i(0),m_builder,m_spatialSplits,m_motionPartition,m_density);
 	printf("Filtering on GPU...\n");
 	ri.filterImageCuda(image);
 	profileEnd();
@@ -71,7 +75,7 @@ void Reconstruction::reconstructIndirectCuda(const UVTSampleBuffer& sbuf, int nu
 void Reconstruction::reconstructAO(const UVTSampleBuffer& sbuf, int numReconstructionRays, float aoLength, Image& image, Image* debugImage, Vec4i scissor)
 {
 	profileStart();
-	ReconstructIndirect ri(sbuf,numReconstructionRays,"",aoLength,true,false,false,scissor);
+	ReconstructIndirect ri(sbuf,numReconstructionRays,"",aoLength,true,false,false,scissor,m_builder,m_spatialSplits,m_motionPartition,m_density);
 	ri.filterImage(image,debugImage);
 	profileEnd();
 }
@@ -79,7 +83,7 @@ void Reconstruction::reconstructAO(const UVTSampleBuffer& sbuf, int numReconstru
 void Reconstruction::reconstructAOCuda(const UVTSampleBuffer& sbuf, int numReconstructionRays, float aoLength, Image& image)
 {
 	profileStart();
-	ReconstructIndirect ri(sbuf,numReconstructionRays,"",aoLength,true,true,false);
+	ReconstructIndirect ri(sbuf,numReconstructionRays,"",aoLength,true,true,false,Vec4i(0),m_builder,m_spatialSplits,m_motionPartition,m_density);
 	printf("Filtering on GPU...\n");
 	ri.filterImageCuda(image);
 	profileEnd();
@@ -88,7 +92,7 @@ void Reconstruction::reconstructAOCuda(const UVTSampleBuffer& sbuf, int numRecon
 void Reconstruction::reconstructGlossy(const UVTSampleBuffer& sbuf, String rayDumpFileName, Image& image, Image* debugImage, Vec4i scissor)
 {
 	profileStart();
-	ReconstructIndirect ri(sbuf,0,rayDumpFileName,0,true,false,false,scissor);
+	ReconstructIndirect ri(sbuf,0,rayDumpFileName,0,true,false,false,scissor,m_builder,m_spatialSplits,m_motionPartition,m_density);
 	ri.filterImage(image,debugImage);
 	profileEnd();
 }
@@ -96,7 +100,7 @@ void Reconstruction::reconstructGlossy(const UVTSampleBuffer& sbuf, String rayDu
 void Reconstruction::reconstructGlossyCuda(const UVTSampleBuffer& sbuf, String rayDumpFileName, Image& image)
 {
 	profileStart();
-	ReconstructIndirect ri(sbuf,0,rayDumpFileName,0,true,true,false);
+	ReconstructIndirect ri(sbuf,0,rayDumpFileName,0,true,true,false,Vec4i(0),m_builder,m_spatialSplits,m_motionPartition,m_density);
 	printf("Filtering on GPU...\n");
 	ri.filterImageCuda(image);
 	profileEnd();
@@ -105,42 +109,29 @@ void Reconstruction::reconstructGlossyCuda(const UVTSampleBuffer& sbuf, String r
 void Reconstruction::reconstructDofMotion(const UVTSampleBuffer& sbuf, int numReconstructionRays, Image& image, Image* debugImage, Vec4i scissor)
 {
 	profileStart();
-	ReconstructIndirect ri(sbuf,numReconstructionRays,"",0,true,false,true,scissor);
+	ReconstructIndirect ri(sbuf,numReconstructionRays,"",0,true,false,true,scissor,m_builder,m_spatialSplits,m_motionPartition,m_density);
 	ri.filterImage(image,debugImage);
 	profileEnd();
 }
 
 //-----------------------------------------------------------------------
 
-inline bool isSecondaryHitpointValid(const UVTSampleBuffer& sbuf,int x,int y,int i)	{ Vec3f sec_hitpoint=sbuf.getSampleExtra<Vec3f>(CID_SEC_HITPOINT, x,y,i); return sec_hitpoint.max() < 1e10f; }
-inline bool isSecondaryOriginValid  (const UVTSampleBuffer& sbuf,int x,int y,int i)	{ Vec3f sec_hitpoint=sbuf.getSampleExtra<Vec3f>(CID_SEC_ORIGIN, x,y,i);   return sec_hitpoint.max() < 1e10f; }
+inline bool isSecondaryOriginValid(const UVTSampleBuffer& sbuf,int cid,int x,int y,int i)	{ Vec3f sec_origin=sbuf.getSampleExtra<Vec3f>(cid, x,y,i); return sec_origin.max() < 1e10f; }
 
-bool ReconstructIndirect::Sample::s_motionEnabled;
-bool ReconstructIndirect::Node::s_motionEnabled;
 
-ReconstructIndirect::ReconstructIndirect(const UVTSampleBuffer& sbuf, int numReconstructionRays, String rayDumpFileName, float aoLength, bool print, bool enableCUDA, bool enableMotion, Vec4i scissor)
+ReconstructIndirect::ReconstructIndirect(const UVTSampleBuffer& sbuf, int numReconstructionRays, String rayDumpFileName, float aoLength, bool print, bool enableCUDA, bool enableMotion, Vec4i scissor, Reconstruction::Builder builder, bool spatialSplits, bool motionPartition, Reconstruction::DensityEngine density)
 {
-	ReconstructIndirect::Sample::s_motionEnabled = enableMotion;
-	ReconstructIndirect::Node::s_motionEnabled = enableMotion;
+	m_motionEnabled = enableMotion;
 
-	CID_PRI_MV       = sbuf.getChannelID(CID_PRI_MV_NAME      );
-	CID_PRI_NORMAL   = sbuf.getChannelID(CID_PRI_NORMAL_NAME  );
-	CID_ALBEDO       = sbuf.getChannelID(CID_ALBEDO_NAME      );
-	CID_SEC_ORIGIN   = sbuf.getChannelID(CID_SEC_ORIGIN_NAME  );
-	CID_SEC_HITPOINT = sbuf.getChannelID(CID_SEC_HITPOINT_NAME);
-	CID_SEC_MV       = sbuf.getChannelID(CID_SEC_MV_NAME      );
-	CID_SEC_NORMAL   = sbuf.getChannelID(CID_SEC_NORMAL_NAME  );
-	CID_DIRECT       = sbuf.getChannelID(CID_DIRECT_NAME      );
-	CID_SEC_ALBEDO   = sbuf.getChannelID(CID_SEC_ALBEDO_NAME  );
-	CID_SEC_DIRECT   = sbuf.getChannelID(CID_SEC_DIRECT_NAME  );
+	m_cidPriNormal = sbuf.getChannelID(CID_PRI_NORMAL_NAME);
+	m_cidAlbedo    = sbuf.getChannelID(CID_ALBEDO_NAME    );
+	m_cidSecOrigin = sbuf.getChannelID(CID_SEC_ORIGIN_NAME);
 
 	const int w = sbuf.getWidth ();
 	const int h = sbuf.getHeight();
-	const int n = sbuf.getNumSamples()/SUBSAMPLE_SBUF;
 
 	m_sbuf = &sbuf;
-	m_numReconstructionRays = numReconstructionRays;
-	m_samples.reset( w*h*n );		// allocate sample array (filled by buildRecursive)
+	m_numReconstructionRays = numReconstructionRays;		// sample array is filled by ingestSamples()
 	m_aoLength = aoLength;
 	m_rayDumpFileName = rayDumpFileName;
 	m_selectNearestSample = rayDumpFileName.getLength()>0;
@@ -178,7 +169,7 @@ ReconstructIndirect::ReconstructIndirect(const UVTSampleBuffer& sbuf, int numRec
 
 		printf("Sorting PBRT rays\n");
 
-		FW_SORT_ARRAY_MULTICORE(m_PBRTReconstructionRays,ReconstructIndirect::PBRTReconstructionRay, ((int)floor(a.xy[1])*4096+(int)floor(a.xy[0]) < ((int)floor(b.xy[1])*4096+(int)floor(b.xy[0]))));
+		sortByScanline(m_PBRTReconstructionRays.getPtr(), numPBRTRays);
 
 		printf("Pre-processing PBRT rays\n");
 
@@ -211,84 +202,23 @@ ReconstructIndirect::ReconstructIndirect(const UVTSampleBuffer& sbuf, int numRec
 	}
 
 	//----------------------------------------------------------------------
-	// Scan bounding box
-	//----------------------------------------------------------------------
-
-	profilePush("Scan bbox");
-	int numInvalid = 0;
-	Vec3f bbmin( FW_F32_MAX);
-	Vec3f bbmax(-FW_F32_MAX);
-	for(int y=0;y<h;y++)
-	for(int x=0;x<w;x++)
-	for(int i=0;i<n;i++)
-	{
-		if(isSecondaryHitpointValid(sbuf,x,y,i))
-		{
-			const Vec3f p   = sbuf.getSampleExtra<Vec3f>(CID_SEC_HITPOINT, x,y,i);
-			const Vec3f mv  = sbuf.getSampleExtra<Vec3f>(CID_SEC_MV, x,y,i);
-			const float t   = sbuf.getSampleT(x,y,i);
-			const Vec3f pt0 = p - t*mv; // @ t=0
-			bbmin = min(bbmin,pt0);
-			bbmax = max(bbmax,pt0);
-		}
-		else
-			numInvalid++;
-	}
-	if(numInvalid && print)
-		printf("%d samples were invalid\n", numInvalid);
-	
-	//if(print) printf("bbmin (%f,%f,%f) bbmax (%f,%f,%f)\n", bbmin.x,bbmin.y,bbmin.z, bbmax.x,bbmax.y,bbmax.z);
-	profilePop();
-
-	//----------------------------------------------------------------------
-	// Generate morton codes
+	// Ingest samples (bounding box, morton codes, sort, fetch)
 	//----------------------------------------------------------------------
 
-	profilePush("Morton");
 	Array<SortEntry> codes;
-	codes.setCapacity(w*h*n);
-
-	const int SCALE = (1<<NBITS)-1;	// [0,2^NBITS-1] per dimension
-	for(int y=0;y<h;y++)
-	for(int x=0;x<w;x++)
-	for(int i=0;i<n;i++)
-	{
-		if(isSecondaryHitpointValid(sbuf,x,y,i))
-		{
-			const Vec3f p   = sbuf.getSampleExtra<Vec3f>(CID_SEC_HITPOINT, x,y,i);
-			const Vec3f mv  = sbuf.getSampleExtra<Vec3f>(CID_SEC_MV, x,y,i);
-			const float t   = sbuf.getSampleT(x,y,i);
-			      Vec3f pt0 = p - t*mv; // @ t=0
-			pt0 = (pt0-bbmin) / (bbmax-bbmin) * SCALE;	// [0,SCALE]
-			SortEntry& se = codes.add();
-			se.code = morton( U32(pt0.x),U32(pt0.y),U32(pt0.z) );
-			se.idx  = Vec3i(x,y,i);
-		}
-	}
-	profilePop();
-
-	//----------------------------------------------------------------------
-	// Sort
-	//----------------------------------------------------------------------
-
-	profilePush("Sort");
-	FW_SORT_ARRAY_MULTICORE(codes, SortEntry, a.code < b.code);	// increasing
-	profilePop();
+	const int firstMoving = ingestSamples(codes, enableMotion && motionPartition, print);
 
 	//----------------------------------------------------------------------
 	// Build a tree (resembles Kontkanen's streaming octree builder)
 	//----------------------------------------------------------------------
 
 	profilePush("Build");
-	int sampleIdx = 0;
-	m_totalNumSamples   = 0;
-	m_totalNumLeafNodes = 0;
-	m_totalNumMixedLeaf = 0;
-	m_hierarchy.add();			// reserve space for root node!
-	const Node* rootNode = buildRecursive(codes, sampleIdx, MAX_LEAF_SIZE, 0,3*NBITS);
-	m_hierarchy[0] = *rootNode;
+	buildHierarchy(codes, firstMoving);
 	profilePop();
 
+	if(print && firstMoving >= 0)
+		printf("%d static and %d moving samples in separate subtrees\n", firstMoving, codes.getSize()-firstMoving);
+
 	if(m_totalNumMixedLeaf)
 		printf("%d (%.2f%%) leaf had mixed content\n", m_totalNumMixedLeaf, 100.f*m_totalNumMixedLeaf/m_totalNumLeafNodes);
 
@@ -300,13 +230,31 @@ ReconstructIndirect::ReconstructIndirect(const UVTSampleBuffer& sbuf, int numRec
 
 	profilePush("KNN");
 	MulticoreLauncher launcher1;
+	const int numWorkers = MulticoreLauncher::getNumCores();
 	Array<DensityTask> tasks;
-	tasks.reset(NUM_DENSITY_TASKS);
-	for(int i=0;i<NUM_DENSITY_TASKS;i++)
+	tasks.reset(numWorkers);
+	m_knnPoints.reset(m_samples.getSize());
+	m_knnDirs  .reset(m_samples.getSize());
+	m_knnBandwidths.reset(m_useBandwidthInformation ? m_samples.getSize() : 0);
+	m_chunks.init(m_samples.getSize(), numWorkers, 1);
+	for(int i=0;i<numWorkers;i++)
 	{
 		DensityTask& task = tasks[i];
 		task.init(this);
-		launcher1.push(DensityTask::compute, &task, i,1);
+		launcher1.push(DensityTask::prepare, &task, i,1);
+	}
+	launcher1.popAll();
+	if(density == Reconstruction::DENSITY_GRID)
+	{
+		buildDensityGrid();
+		if(print) printf("  Grid cell size %g, %d buckets\n", m_gridCellSize, m_gridMask+1);
+	}
+	m_chunks.init(m_samples.getSize(), numWorkers, KNN_BATCH_SIZE);
+	for(int i=0;i<numWorkers;i++)
+	{
+		tasks[i].init(this);
+		if(density == Reconstruction::DENSITY_GRID)	launcher1.push(DensityTask::computeGrid, &tasks[i], i,1);
+		else										launcher1.push(DensityTask::compute, &tasks[i], i,1);
 	}
 	if(print)	launcher1.popAll("Computing densities");
 	else		launcher1.popAll();
@@ -315,19 +263,51 @@ ReconstructIndirect::ReconstructIndirect(const UVTSampleBuffer& sbuf, int numRec
 	U64 numSteps = 0;
 	U64 numLeaf  = 0;
 	U64 numIter  = 0;
+	U64 numFallbacks = 0;
+	U64 numIsolated  = 0;
 	double averageVMF = 0;
-	for(int i=0;i<NUM_DENSITY_TASKS;i++)
+	for(int i=0;i<tasks.getSize();i++)
 	{
 		DensityTask& task = tasks[i];
 		numSteps += task.m_numSteps;
 		numLeaf  += task.m_numLeaf;
 		numIter  += task.m_numIter;
+		numFallbacks += task.m_numFallbacks;
+		numIsolated  += task.m_numIsolated;
 		averageVMF += task.m_averageVMF;
 	}
-	if(print) printf("  KNN %.1f steps/sample, %.1f leaf/sample\n", double(numSteps)/numIter, double(numLeaf)/numIter);
+	if(numIsolated)
+	{
+		const float radius = assignIsolatedRadii();
+		if(print) printf("  %d samples had no neighbours, radius set to the average %g\n", (int)numIsolated, radius);
+	}
+	if(density == Reconstruction::DENSITY_GRID)
+	{
+		if(print) printf("  Grid KNN %.1f cells/sample, %.2f%% fell back to exact\n", double(numSteps)/numIter, 100.0*numFallbacks/numIter);
+		if(print) reportGridError();
+	}
+	else
+	{
+		if(print) printf("  KNN %.1f steps/sample, %.1f leaf/sample\n", double(numSteps)/numIter, double(numLeaf)/numIter);
+	}
 	if(print) printf("  Average vMF threshold %.2f\n", averageVMF/m_samples.getSize());
+	if(print) printBusyTimes(tasks);
+	m_knnPoints.reset();
+	m_knnDirs  .reset();
+	m_knnBandwidths.reset();
+	m_gridStart.reset();
+	m_gridSamples.reset();
 
-	validateNodeBounds(ROOT, CIRCLE);		// NOTE: this really needs to be done
+	validateNodeBounds(CIRCLE);		// NOTE: this really needs to be done
+
+	if(builder == Reconstruction::BUILDER_SAH)
+	{
+		profilePush("Restructure");
+		const float mortonCost = getSAHCost();
+		restructureHierarchy();
+		if(print) printf("  SAH cost %.1f -> %.1f with tree rotations\n", mortonCost, getSAHCost());
+		profilePop();
+	}
 
 	if (enableCUDA)
 	{
@@ -335,9 +315,14 @@ ReconstructIndirect::ReconstructIndirect(const UVTSampleBuffer& sbuf, int numRec
 	} else
 	{
 		profilePush("Shrinking");
+		buildCompactHierarchy();
+		if(print) printf("  Compact hierarchy %.1f MB (%.1f MB)\n", (m_compactHierarchy.getNumBytes()+m_compactHierarchyT1.getNumBytes())/1024.f/1024.f, m_hierarchy.getNumBytes()/1024.f/1024.f);
+		buildShrinkPackets();
+		if(print) printf("  %d shrink packets, %.2f rays/packet\n", m_shrinkPackets.getSize()-1, float(m_samples.getSize())/max(m_shrinkPackets.getSize()-1,1));
 		Array<DensityTask> tasks2;
-		tasks2.reset(NUM_DENSITY_TASKS);
-		for(int i=0;i<NUM_DENSITY_TASKS;i++)
+		tasks2.reset(numWorkers);
+		m_chunks.init(m_shrinkPackets.getSize()-1, numWorkers, 1);
+		for(int i=0;i<numWorkers;i++)
 		{
 			DensityTask& task = tasks2[i];
 			task.init(this);
@@ -345,23 +330,303 @@ ReconstructIndirect::ReconstructIndirect(const UVTSampleBuffer& sbuf, int numRec
 		}
 		if(print)	launcher1.popAll("Shrinking hit splats");
 		else		launcher1.popAll();
+		m_compactHierarchy.reset();								// the bounds are refit below
+		m_compactHierarchyT1.reset();
+		m_shrinkOrder.reset();
+		m_shrinkPackets.reset();
+		const int numShrank = applyShrinkHits(tasks2);
 		profilePop();
 
-		U64 numShrank   = 0;
 		U64 numSelfHits = 0;
-		for(int i=0;i<NUM_DENSITY_TASKS;i++)
-		{
-			numShrank   += tasks2[i].m_numShrank;
+		for(int i=0;i<tasks2.getSize();i++)
 			numSelfHits += tasks2[i].m_numSelfHits;
-		}
 		if(print)					printf("  %d splats shrank\n", numShrank);
 		if(print && numSelfHits)	printf("  WARNING: shrinking hit the sample itself %d times\n", (int)numSelfHits);
+		if(print)					printBusyTimes(tasks2);
 	}
 
-	validateNodeBounds(ROOT, CIRCLE);
+	validateNodeBounds(CIRCLE);
 
 	if(print) printf("Tree grew %.1f%%\n", 100.f*(getHierarchyArea(ROOT)/origTreeArea-1));
 
+	//----------------------------------------------------------------------
+	// Split oversized splats (CPU filtering of static scenes only)
+	//----------------------------------------------------------------------
+
+	if(spatialSplits)
+	{
+		if(enableCUDA || enableMotion)
+			printf("WARNING: splitting oversized splats is not supported with %s, ignored\n", enableCUDA ? "CUDA" : "motion");
+		else
+		{
+			profilePush("Split");
+			splitOversizedSplats(print);
+			if(builder == Reconstruction::BUILDER_SAH)
+				restructureHierarchy();
+			profilePop();
+		}
+	}
+
+	if(print) printf("SAH cost %.1f (%s)\n", getSAHCost(), builder==Reconstruction::BUILDER_SAH ? "Morton + SAH rotations" : "Morton");
+
+	//----------------------------------------------------------------------
+	// Collapse into a 4-wide hierarchy for the CPU filter
+	//----------------------------------------------------------------------
+
+	if(!enableCUDA)
+	{
+		profilePush("Collapse");
+		buildWideHierarchy();
+		profilePop();
+		if(print) printf("Wide hierarchy: %d nodes, %d in the binary one\n", m_wideHierarchy.getSize(), m_hierarchy.getSize());
+	}
+}
+
+//----------------------------------------------------------------------
+// Ingest
+//----------------------------------------------------------------------
+
+void ReconstructIndirect::sortByScanline(PBRTReconstructionRay* rays, int num)
+{
+	Array<RadixSortEntry> order(NULL, num);
+	for(int i=0;i<num;i++)
+	{
+		const int key = (int)floor(rays[i].xy[1])*4096+(int)floor(rays[i].xy[0]);
+		order[i].key   = U32(key) ^ 0x80000000u;		// signed -> unsigned order
+		order[i].value = i;
+	}
+	radixSort(order, true);
+
+	// Permute in place by following the cycles, ray k comes from order[k].value. Slots are marked done by
+	// pointing them to themselves, so only one ray is held aside at a time.
+	for(int k=0;k<num;k++)
+	{
+		if(order[k].value == U32(k))
+			continue;
+
+		const PBRTReconstructionRay first = rays[k];
+		int j = k;
+		while(order[j].value != U32(k))
+		{
+			const int src = order[j].value;
+			rays[j] = rays[src];
+			order[j].value = j;
+			j = src;
+		}
+		rays[j] = first;
+		order[j].value = j;
+	}
+}
+
+static inline const StridedArray<Vec3f>* getChannelPtr(const UVTSampleBuffer& sbuf, ChannelHandle<Vec3f> h)	{ return sbuf.hasChannel(h) ? &sbuf.getChannel(h) : NULL; }
+static inline Vec3f fetchVec3f(const StridedArray<Vec3f>* channel, int idx)										{ return channel ? (*channel)[idx] : Vec3f(0); }
+
+int ReconstructIndirect::ingestSamples(Array<SortEntry>& codes, bool partitionMotion, bool print)
+{
+	const UVTSampleBuffer& sbuf = *m_sbuf;
+	const int h = sbuf.getHeight();
+
+	if(!sbuf.hasChannel(CHANNEL_SEC_HITPOINT) || !sbuf.hasChannel(CHANNEL_SEC_MV))
+		fail("ReconstructIndirect: sample buffer has no %s/%s channels", CID_SEC_HITPOINT_NAME, CID_SEC_MV_NAME);
+
+	// The buffer may already know the bounds, from the file header or gathered while its samples were
+	// streamed in. The t=0 hit points are precomputed in the latter case only.
+
+	const SampleBufferStats& stats = sbuf.getStats();
+	const bool knownBounds = stats.valid && SUBSAMPLE_SBUF==1;
+	const bool ingested    = sbuf.hasChannel(CHANNEL_SEC_HITPOINT_T0) && SUBSAMPLE_SBUF==1;
+
+	IngestTask task;
+	task.init(this, knownBounds, ingested);
+	task.m_codes = &codes;
+	task.m_partitionMotion = partitionMotion;
+	MulticoreLauncher launcher;
+
+	// valid samples and bounds of each scanline, reduced serially
+
+	profilePush("Scan bbox");
+	launcher.push(IngestTask::scan, &task, 0, h);
+	launcher.popAll();
+
+	int numValid   = 0;
+	int numInvalid = 0;
+	Vec3f bbmin = knownBounds ? stats.hitpointMinT0 : Vec3f( FW_F32_MAX);
+	Vec3f bbmax = knownBounds ? stats.hitpointMaxT0 : Vec3f(-FW_F32_MAX);
+	for(int y=0;y<h;y++)
+	{
+		task.m_rowFirst[y] = numValid;
+		numValid   += task.m_rowValid[y];
+		numInvalid += task.m_rowInvalid[y];
+		bbmin = min(bbmin, task.m_rowMin[y]);
+		bbmax = max(bbmax, task.m_rowMax[y]);
+	}
+	if(numInvalid && print)
+		printf("%d samples were invalid\n", numInvalid);
+	profilePop();
+
+	// morton codes, each scanline writes its own range
+
+	profilePush("Morton");
+	task.m_bbmin = bbmin;
+	task.m_bbmax = bbmax;
+	codes.reset(numValid);
+	launcher.push(IngestTask::encode, &task, 0, h);
+	launcher.popAll();
+	profilePop();
+
+	profilePush("Sort");
+	radixSort(codes, true);	// increasing
+	profilePop();
+
+	// moving samples sorted after the static ones, gather() removes the bit
+
+	int firstMoving = -1;
+	if(partitionMotion)
+	{
+		int lo = 0;
+		int hi = codes.getSize();
+		while(lo < hi)
+		{
+			const int mid = lo + (hi-lo)/2;
+			if(codes[mid].key & MOVING_BIT)	hi = mid;
+			else							lo = mid+1;
+		}
+		firstMoving = lo;
+	}
+
+	// valid samples in sorted order
+
+	profilePush("Fetch");
+	m_samples.reset(numValid);
+	task.m_numChunks = max(1, min(numValid, 16*MulticoreLauncher::getNumCores()));
+	launcher.push(IngestTask::gather, &task, 0, task.m_numChunks);
+	launcher.popAll();
+	profilePop();
+
+	return firstMoving;
+}
+
+void ReconstructIndirect::IngestTask::init(ReconstructIndirect* scope, bool knownBounds, bool ingested)
+{
+	const int h = scope->m_sbuf->getHeight();
+
+	m_scope       = scope;
+	m_knownBounds = knownBounds;
+	m_ingested    = ingested;
+	m_partitionMotion = false;
+	m_bbmin       = Vec3f( FW_F32_MAX);
+	m_bbmax       = Vec3f(-FW_F32_MAX);
+	m_numChunks   = 0;
+	m_codes       = NULL;
+
+	m_rowFirst  .reset(h);
+	m_rowValid  .reset(h);
+	m_rowInvalid.reset(h);
+	m_rowMin    .reset(h);
+	m_rowMax    .reset(h);
+}
+
+void ReconstructIndirect::IngestTask::scan(int y)
+{
+	const UVTSampleBuffer& sbuf = *m_scope->m_sbuf;
+	const StridedSpan<const Vec3f> hitpoints = sbuf.getChannelRow(m_ingested ? CHANNEL_SEC_HITPOINT_T0 : CHANNEL_SEC_HITPOINT, y);
+	const StridedSpan<const Vec3f> mvs       = sbuf.getChannelRow(CHANNEL_SEC_MV, y);
+	const StridedSpan<const float> ts        = sbuf.getRowT(y);
+	const int rowBegin = sbuf.getRowBegin(y);
+
+	int   numValid   = 0;
+	int   numInvalid = 0;
+	Vec3f bbmin( FW_F32_MAX);
+	Vec3f bbmax(-FW_F32_MAX);
+	for(int x=0;x<sbuf.getWidth();x++)
+	for(int i=0;i<sbuf.getNumSamples(x,y)/SUBSAMPLE_SBUF;i++)
+	{
+		const int   j = sbuf.getSampleIndex(x,y,i) - rowBegin;
+		const Vec3f p = hitpoints[j];
+		if(p.max() >= 1e10f)				// secondary hitpoint invalid?
+		{
+			numInvalid++;
+			continue;
+		}
+
+		numValid++;
+		if(!m_knownBounds)
+		{
+			const Vec3f pt0 = m_ingested ? p : p - ts[j]*mvs[j]; // @ t=0
+			bbmin = min(bbmin,pt0);
+			bbmax = max(bbmax,pt0);
+		}
+	}
+
+	m_rowValid  [y] = numValid;
+	m_rowInvalid[y] = numInvalid;
+	m_rowMin    [y] = bbmin;
+	m_rowMax    [y] = bbmax;
+}
+
+void ReconstructIndirect::IngestTask::encode(int y)
+{
+	const UVTSampleBuffer& sbuf = *m_scope->m_sbuf;
+	const StridedSpan<const Vec3f> hitpoints = sbuf.getChannelRow(m_ingested ? CHANNEL_SEC_HITPOINT_T0 : CHANNEL_SEC_HITPOINT, y);
+	const StridedSpan<const Vec3f> mvs       = sbuf.getChannelRow(CHANNEL_SEC_MV, y);
+	const StridedSpan<const float> ts        = sbuf.getRowT(y);
+	const int rowBegin = sbuf.getRowBegin(y);
+
+	const int SCALE = (1<<NBITS)-1;	// [0,2^NBITS-1] per dimension
+	SortEntry* se = m_codes->getPtr(m_rowFirst[y]);
+	for(int x=0;x<sbuf.getWidth();x++)
+	for(int i=0;i<sbuf.getNumSamples(x,y)/SUBSAMPLE_SBUF;i++)
+	{
+		const int   j = sbuf.getSampleIndex(x,y,i) - rowBegin;
+		const Vec3f p = hitpoints[j];
+		if(p.max() >= 1e10f)				// secondary hitpoint invalid?
+			continue;
+
+		Vec3f pt0 = m_ingested ? p : p - ts[j]*mvs[j]; // @ t=0
+		pt0 = clamp((pt0-m_bbmin) / (m_bbmax-m_bbmin) * SCALE, Vec3f(0), Vec3f((F32)SCALE));	// [0,SCALE], header bounds of V3.0 files describe the unquantized points
+		se->key   = morton( U32(pt0.x),U32(pt0.y),U32(pt0.z) );
+		se->value = rowBegin + j;
+		if(m_partitionMotion && mvs[j] != Vec3f(0))
+			se->key |= MOVING_BIT;
+		se++;
+	}
+	FW_ASSERT(se == m_codes->getPtr(m_rowFirst[y]) + m_rowValid[y]);
+}
+
+void ReconstructIndirect::IngestTask::gather(int chunk)
+{
+	const UVTSampleBuffer&  sbuf  = *m_scope->m_sbuf;
+	      Array<SortEntry>& codes = *m_codes;
+	const int first = int(S64(codes.getSize())* chunk   /m_numChunks);
+	const int last  = int(S64(codes.getSize())*(chunk+1)/m_numChunks);
+
+	const StridedArray<Vec3f>* pri_normal   = getChannelPtr(sbuf, CHANNEL_PRI_NORMAL);
+	const StridedArray<Vec3f>* pri_albedo   = getChannelPtr(sbuf, CHANNEL_ALBEDO);
+	const StridedArray<Vec3f>* sec_origin   = getChannelPtr(sbuf, CHANNEL_SEC_ORIGIN);
+	const StridedArray<Vec3f>* sec_hitpoint = getChannelPtr(sbuf, CHANNEL_SEC_HITPOINT);
+	const StridedArray<Vec3f>* sec_mv       = getChannelPtr(sbuf, CHANNEL_SEC_MV);
+	const StridedArray<Vec3f>* sec_normal   = getChannelPtr(sbuf, CHANNEL_SEC_NORMAL);
+	const StridedArray<Vec3f>* sec_albedo   = getChannelPtr(sbuf, CHANNEL_SEC_ALBEDO);
+	const StridedArray<Vec3f>* sec_direct   = getChannelPtr(sbuf, CHANNEL_SEC_DIRECT);
+
+	for(int k=first;k<last;k++)
+	{
+		codes[k].key &= ~MOVING_BIT;
+		const int idx = codes[k].value;
+		Sample&   s   = m_scope->m_samples[k];
+		s.xy			= sbuf.getSampleXY   (idx);
+		s.t				= sbuf.getSampleT    (idx);
+		s.color			= sbuf.getSampleColor(idx).getXYZ();
+		s.pri_normal	= fetchVec3f(pri_normal,   idx);
+		s.pri_albedo	= fetchVec3f(pri_albedo,   idx);
+		s.sec_origin	= fetchVec3f(sec_origin,   idx);
+		s.sec_hitpoint	= fetchVec3f(sec_hitpoint, idx);
+		s.sec_mv		= fetchVec3f(sec_mv,       idx);
+		s.sec_normal	= fetchVec3f(sec_normal,   idx);
+		s.sec_albedo	= fetchVec3f(sec_albedo,   idx);
+		s.sec_direct	= fetchVec3f(sec_direct,   idx);
+		s.origIndex		= idx;
+	}
 }
 
 //----------------------------------------------------------------------
@@ -417,36 +682,145 @@ void ReconstructIndirect::filterImage(Image& image, Image* debugImage)
 // Build a hierarchy using Kontkanen et al. [2011]
 //-----------------------------------------------------------------------
 
-ReconstructIndirect::Node* ReconstructIndirect::buildRecursive(const Array<SortEntry>& codes, int& sampleIdx, const int N, const U64 octreeCode,const int octreeBitPos)
+void ReconstructIndirect::buildHierarchy(const Array<SortEntry>& codes, int firstMoving)
+{
+	// With motion partitioning, the static and the moving samples are two sorted ranges of the codes
+	// and get their own subtrees under the root, so that the static boxes do not sweep with time.
+
+	m_hierarchy.reset();
+	m_hierarchy.add();			// reserve space for root node!
+	m_totalNumSamples   = 0;
+	m_totalNumLeafNodes = 0;
+	m_totalNumMixedLeaf = 0;
+
+	Node root;
+	if(firstMoving > 0 && firstMoving < codes.getSize())
+	{
+		Node parts[2];
+		const bool valid0 = buildSubtree(parts[0], codes, 0, firstMoving);
+		const bool valid1 = buildSubtree(parts[1], codes, firstMoving, codes.getSize());
+		FW_ASSERT(valid0 && valid1);
+		FW_UNREF(valid0);
+		FW_UNREF(valid1);
+
+		root = Node(parts[0],parts[1]);
+		root.child0 = m_hierarchy.getSize();	m_hierarchy.add(parts[0]);
+		root.child1 = m_hierarchy.getSize();	m_hierarchy.add(parts[1]);
+		m_hierarchy[ROOT] = root;
+	}
+	else if(buildSubtree(root, codes, 0, codes.getSize()))
+		m_hierarchy[ROOT] = root;
+
+	relayoutHierarchy();
+}
+
+bool ReconstructIndirect::buildSubtree(Node& root, const Array<SortEntry>& codes, int begin, int end)
 {
-	if(sampleIdx >= codes.getSize())									// nothing left
-		return NULL;
+	// Subtrees of the octree cells at BUILD_SPLIT_LEVELS, one task each. A cell is a contiguous
+	// range of the sorted codes. Cells that end up inside a larger leaf are built in vain, but
+	// they have at most MAX_LEAF_SIZE samples.
+
+	const int splitBitPos = 3*NBITS - 3*BUILD_SPLIT_LEVELS;
+	const int numCells    = 1 << (3*BUILD_SPLIT_LEVELS);
+
+	Array<BuildTask> subtrees;
+	subtrees.reset(numCells);
+	MulticoreLauncher launcher;
+	int first = begin;
+	for(int c=0;c<numCells;c++)
+	{
+		int lo = first;										// binary search for the end of the cell
+		int hi = end;
+		while(lo < hi)
+		{
+			const int mid = lo + (hi-lo)/2;
+			if(int(codes[mid].key >> splitBitPos) <= c)	lo = mid+1;
+			else										hi = mid;
+		}
+
+		BuildTask& task = subtrees[c];
+		task.init(this, &codes, &task.m_arena, NULL, first, end, U64(c) << splitBitPos, splitBitPos);
+		if(lo > first)
+			launcher.push(BuildTask::build, &task, c,1);
+		else
+			task.build();									// empty
+		first = lo;
+	}
+	launcher.popAll();
+
+	// Top levels, splicing in the subtrees
+
+	BuildTask top;
+	top.init(this, &codes, &m_hierarchy, &subtrees, begin, end, 0, 3*NBITS);
+	top.build();
+	if(top.m_valid)
+		root = top.m_root;
+
+	m_totalNumSamples   += top.m_numSamples;
+	m_totalNumLeafNodes += top.m_numLeafNodes;
+	m_totalNumMixedLeaf += top.m_numMixedLeaf;
+	return top.m_valid;
+}
+
+void ReconstructIndirect::BuildTask::init(ReconstructIndirect* scope, const Array<SortEntry>* codes, Array<Node>* nodes, const Array<BuildTask>* subtrees, int first, int end, U64 octreeCode, int octreeBitPos)
+{
+	m_scope        = scope;
+	m_codes        = codes;
+	m_nodes        = nodes;
+	m_subtrees     = subtrees;
+	m_first        = first;
+	m_last         = first;
+	m_end          = end;
+	m_octreeCode   = octreeCode;
+	m_octreeBitPos = octreeBitPos;
+	m_valid        = false;
+	m_numSamples   = 0;
+	m_numLeafNodes = 0;
+	m_numMixedLeaf = 0;
+}
+
+void ReconstructIndirect::BuildTask::build(void)
+{
+	int sampleIdx = m_first;
+	m_valid = buildRecursive(m_root, sampleIdx, m_octreeCode, m_octreeBitPos);
+	m_last  = sampleIdx;
+}
+
+bool ReconstructIndirect::BuildTask::buildRecursive(Node& node, int& sampleIdx, const U64 octreeCode,const int octreeBitPos)
+{
+	const Array<SortEntry>& codes = *m_codes;
+	const int N = MAX_LEAF_SIZE;
+
+	if(m_subtrees && octreeBitPos == 3*NBITS - 3*BUILD_SPLIT_LEVELS)	// built by another task
+		return splice(node, sampleIdx, (*m_subtrees)[int(octreeCode >> octreeBitPos)]);
+
+	if(sampleIdx >= m_end)												// nothing left
+		return false;
 
 	const U64 mask = U64(-1) << octreeBitPos;							// relevant morton code so far
 	const U64 octreeMask = octreeCode & mask;							// relevant part of octree
 
 	bool shouldRefine = (octreeBitPos >= 3) &&							// not at max morton depth
-						(codes.getSize() > sampleIdx+N) &&				// more than N samples left
-						(octreeMask == (codes[sampleIdx+N].code&mask));	// N+1:th sample is inside this node
+						(m_end > sampleIdx+N) &&						// more than N samples left
+						(octreeMask == (codes[sampleIdx+N].key&mask));	// N+1:th sample is inside this node
 
 	if(!shouldRefine)
 	{
-		if((codes[sampleIdx].code&mask) != octreeMask)					// nothing in this octree branch
-			return NULL;
+		if((codes[sampleIdx].key&mask) != octreeMask)					// nothing in this octree branch
+			return false;
 
 		// construct a leaf node
 		bool staticPoints = false;	// STATS
 		bool movingPoints = false;	// STATS
 
-		Node* node = new Node();
-		Node& leaf = *node;
+		Node& leaf = node;
+		leaf = Node();
 		leaf.s0 = sampleIdx;
-		while(sampleIdx<codes.getSize() && (codes[sampleIdx].code&mask) == octreeMask)
+		while(sampleIdx<m_end && (codes[sampleIdx].key&mask) == octreeMask)
 		{
-			fetchSample( m_samples[sampleIdx], codes[sampleIdx].idx );	// from sample buffer -> local struct (SLOW)
-			const Sample& s = m_samples[sampleIdx++];
-			const Vec3f pt0 = s.getHitPoint(0.f);
-			const Vec3f pt1 = s.getHitPoint(1.f);
+			const Sample& s = m_scope->m_samples[sampleIdx++];
+			const Vec3f pt0 = m_scope->getHitPoint(s,0.f);
+			const Vec3f pt1 = m_scope->getHitPoint(s,1.f);
 			leaf.bbmin   = min(leaf.bbmin,  pt0);
 			leaf.bbmax   = max(leaf.bbmax,  pt0);
 			leaf.bbminT1 = min(leaf.bbminT1,pt1);
@@ -458,7 +832,7 @@ ReconstructIndirect::Node* ReconstructIndirect::buildRecursive(const Array<SortE
 		leaf.ns = (leaf.s1-leaf.s0);
 		leaf.bbmin   -= 1e-3f;	// needed to avoid precision issues in fast traversal code
 		leaf.bbmax   += 1e-3f;
-		leaf.bbminT1 += 1e-3f;
+		leaf.bbminT1 -= 1e-3f;
 		leaf.bbmaxT1 += 1e-3f;
 
 		if(leaf.ns>N)
@@ -469,59 +843,632 @@ ReconstructIndirect::Node* ReconstructIndirect::buildRecursive(const Array<SortE
 		}
 
 		// STATS
-		m_totalNumMixedLeaf += (staticPoints && movingPoints) ? 1 : 0;
-		m_totalNumLeafNodes++;
-		m_totalNumSamples += leaf.ns;
+		m_numMixedLeaf += (staticPoints && movingPoints) ? 1 : 0;
+		m_numLeafNodes++;
+		m_numSamples += leaf.ns;
 
-		return node;
+		return true;
 	}
 	else
 	{
-		Array<Node*> nodes;
+		Node children[8];
+		int  numChildren = 0;
 		for(int i=0;i<8;i++)
 		{
 			int childOctreeBitPos = octreeBitPos-3;
 			U64 childOctreeCode   = octreeCode | (U64(i)<<childOctreeBitPos);
-			Node* node = buildRecursive(codes, sampleIdx, N, childOctreeCode,childOctreeBitPos);
-			if(node)
-				nodes.add (node);
+			if(buildRecursive(children[numChildren], sampleIdx, childOctreeCode,childOctreeBitPos))
+				numChildren++;
 		}
 
 		// create a balanced BVH out of this octree level (straghtforward application of Kontkanen's octree builder to BVHs).
-		while(nodes.getSize() > 1)
+		Array<Node>& nodes = *m_nodes;
+		while(numChildren > 1)
 		{
-			Array<Node*> nodes2;
-
 			int k=0;
-			for(;k+1<nodes.getSize();k+=2)
+			int numMerged=0;
+			for(;k+1<numChildren;k+=2)
 			{
 				// Perform merge and emit node
-				Node* n0 = nodes[k];
-				Node* n1 = nodes[k+1];
-				Node* n = new Node(*n0,*n1);
-				n->child0 = m_hierarchy.getSize();	m_hierarchy.add(*n0);
-				n->child1 = m_hierarchy.getSize();	m_hierarchy.add(*n1);
-				nodes2.add(n);
+				Node n(children[k],children[k+1]);
+				n.child0 = nodes.getSize();	nodes.add(children[k]);
+				n.child1 = nodes.getSize();	nodes.add(children[k+1]);
+				children[numMerged++] = n;
+			}
+			if(k<numChildren)
+				children[numMerged++] = children[k];
+
+			numChildren = numMerged;
+		}
+
+		if(numChildren)
+			node = children[0];
+		return numChildren>0;
+	}
+}
+
+bool ReconstructIndirect::BuildTask::splice(Node& node, int& sampleIdx, const BuildTask& subtree)
+{
+	FW_ASSERT(sampleIdx == subtree.m_first);
+	sampleIdx       = subtree.m_last;
+	m_numSamples   += subtree.m_numSamples;
+	m_numLeafNodes += subtree.m_numLeafNodes;
+	m_numMixedLeaf += subtree.m_numMixedLeaf;
+	if(!subtree.m_valid)
+		return false;
+
+	// child indices of the subtree are relative to its own node array
+	Array<Node>& nodes = *m_nodes;
+	const int offset = nodes.getSize();
+	nodes.add(subtree.m_arena);
+	for(int i=offset;i<nodes.getSize();i++)
+	if(!nodes[i].isLeaf())
+	{
+		nodes[i].child0 += offset;
+		nodes[i].child1 += offset;
+	}
+
+	node = subtree.m_root;
+	if(!node.isLeaf())
+	{
+		node.child0 += offset;
+		node.child1 += offset;
+	}
+	return true;
+}
+
+float ReconstructIndirect::getHierarchyArea(int nodeIdx, bool leafOnly) const
+{
+	float time = 0.f;	// @ t=0
+	const Node& node = m_hierarchy[nodeIdx];
+	if(node.isLeaf())	return node.getSurfaceArea(time);
+	else				return (leafOnly ? 0 : node.getSurfaceArea(time)) + getHierarchyArea(node.child0) + getHierarchyArea(node.child1);
+}
+
+void ReconstructIndirect::relayoutHierarchy(void)
+{
+	// Depth-first order, the first child right after its parent. The samples follow the leaves in the
+	// same order, so a descent into the tree and its samples mostly walks forward in memory.
+
+	const int numNodes = m_hierarchy.getSize();
+	if(!numNodes)
+		return;
+
+	Array<int> order(NULL, numNodes);						// new -> old
+	Array<int> remap(NULL, numNodes);						// old -> new
+	Array<int> stack;
+	int num = 0;
+	stack.add(ROOT);
+	while(stack.getSize())
+	{
+		const int   idx  = stack.removeLast();
+		const Node& node = m_hierarchy[idx];
+		remap[idx]   = num;
+		order[num++] = idx;
+		if(!node.isLeaf())
+		{
+			stack.add(node.child1);
+			stack.add(node.child0);
+		}
+	}
+	FW_ASSERT(num == numNodes);
+
+	const bool clipped = m_clipBoxes.getSize() > 0;
+	Array<Node>    nodes    (NULL, numNodes);
+	Array<Sample>  samples  (NULL, m_samples.getSize());
+	Array<ClipBox> clipBoxes(NULL, m_clipBoxes.getSize());
+	int numSamples = 0;
+	for(int i=0;i<numNodes;i++)
+	{
+		Node node = m_hierarchy[order[i]];
+		if(node.isLeaf())
+		{
+			for(int j=node.s0;j<node.s1;j++)
+			{
+				if(clipped)
+					clipBoxes[numSamples] = m_clipBoxes[j];
+				samples[numSamples++] = m_samples[j];
 			}
-			if(k<nodes.getSize())
-				nodes2.add(nodes.getLast());
+			node.s0 = numSamples - node.ns;
+			node.s1 = numSamples;
+		}
+		else
+		{
+			node.child0 = remap[node.child0];
+			node.child1 = remap[node.child1];
+		}
+		nodes[i] = node;
+	}
+	FW_ASSERT(numSamples == m_samples.getSize());
+
+	m_hierarchy = nodes;
+	m_samples   = samples;
+	m_clipBoxes = clipBoxes;
+	buildRefitLevels();
+}
+
+void ReconstructIndirect::buildRefitLevels(void)
+{
+	// breadth-first order, so the children of each level form the next one
+
+	m_refitOrder.reset(m_hierarchy.getSize());
+	m_refitLevels.reset();
+	if(!m_hierarchy.getSize())
+		return;
+
+	int num = 0;
+	m_refitOrder[num++] = ROOT;
+	for(int first=0;first<num;)
+	{
+		m_refitLevels.add(first);
+		const int last = num;
+		for(int i=first;i<last;i++)
+		{
+			const Node& node = m_hierarchy[m_refitOrder[i]];
+			if(!node.isLeaf())
+			{
+				m_refitOrder[num++] = node.child0;
+				m_refitOrder[num++] = node.child1;
+			}
+		}
+		first = last;
+	}
+	m_refitLevels.add(num);
+	FW_ASSERT(num == m_hierarchy.getSize());
+}
+
+void ReconstructIndirect::validateNodeBounds(BloatMode mode)
+{
+	if(m_refitLevels.getSize() < 2)
+		return;
+
+	// deepest level first, the nodes of a level in parallel
+
+	MulticoreLauncher launcher;
+	for(int level=m_refitLevels.getSize()-2;level>=0;level--)
+	{
+		RefitTask task;
+		task.init(this, mode, m_refitLevels[level], m_refitLevels[level+1]);
+		if(task.m_numChunks > 1)
+		{
+			launcher.push(RefitTask::refit, &task, 0, task.m_numChunks);
+			launcher.popAll();
+		}
+		else
+			task.refit(0);
+	}
+}
+
+void ReconstructIndirect::RefitTask::init(ReconstructIndirect* scope, BloatMode mode, int first, int last, bool rotate)
+{
+	m_scope     = scope;
+	m_mode      = mode;
+	m_rotate    = rotate;
+	m_first     = first;
+	m_last      = last;
+	m_numChunks = (last-first+REFIT_CHUNK_SIZE-1) / REFIT_CHUNK_SIZE;
+}
+
+void ReconstructIndirect::RefitTask::refit(int chunk)
+{
+	const int first = m_first + chunk*REFIT_CHUNK_SIZE;
+	const int last  = min(first+REFIT_CHUNK_SIZE, m_last);
+	for(int i=first;i<last;i++)
+	{
+		if(m_rotate)	m_scope->rotateNode(m_scope->m_refitOrder[i]);
+		else			m_scope->refitNode (m_scope->m_refitOrder[i], m_mode);
+	}
+}
+
+float ReconstructIndirect::getSAHCost(void) const
+{
+	// unit costs for traversal steps and sample tests, relative to the root
+	double cost = 0;
+	for(int i=0;i<m_hierarchy.getSize();i++)
+	{
+		const Node& node = m_hierarchy[i];
+		cost += node.getAverageSurfaceArea() * (node.isLeaf() ? node.ns : 1);
+	}
+	return m_hierarchy.getSize() ? float(cost / m_hierarchy[ROOT].getAverageSurfaceArea()) : 0.f;
+}
+
+void ReconstructIndirect::restructureHierarchy(void)
+{
+	// Bottom-up passes of tree rotations [Kensler 2008]. A rotation at a node only changes the node's
+	// subtree, so the nodes of a level are independent.
+
+	float cost = getSAHCost();
+	for(int pass=0;pass<RESTRUCTURE_PASSES;pass++)
+	{
+		MulticoreLauncher launcher;
+		for(int level=m_refitLevels.getSize()-2;level>=0;level--)
+		{
+			RefitTask task;
+			task.init(this, CIRCLE, m_refitLevels[level], m_refitLevels[level+1], true);
+			if(task.m_numChunks > 1)
+			{
+				launcher.push(RefitTask::refit, &task, 0, task.m_numChunks);
+				launcher.popAll();
+			}
+			else
+				task.refit(0);
+		}
+		buildRefitLevels();									// rotations moved nodes between levels
+
+		const float newCost = getSAHCost();
+		if(newCost > 0.99f*cost)
+			break;
+		cost = newCost;
+	}
+
+	relayoutHierarchy();
+}
+
+void ReconstructIndirect::rotateNode(int nodeIdx)
+{
+	// Swap one child with a grandchild under the other child, if that shrinks the other child.
+	// The node's own bounds do not change, and neither do the leaves.
+
+	Node& node = m_hierarchy[nodeIdx];
+	if(node.isLeaf())
+		return;
+
+	float bestGain  = 0.f;
+	int   bestSide  = -1;
+	int   bestGrand = -1;
+	for(int side=0;side<2;side++)
+	{
+		const int   child = side ? node.child1 : node.child0;		// moves down
+		const Node& other = m_hierarchy[side ? node.child0 : node.child1];
+		if(other.isLeaf())
+			continue;
+
+		const float area = other.getAverageSurfaceArea();
+		for(int grand=0;grand<2;grand++)							// moves up
+		{
+			const int  stays  = grand ? other.child0 : other.child1;
+			const Node merged(m_hierarchy[child], m_hierarchy[stays]);
+			const float gain = area - merged.getAverageSurfaceArea();
+			if(gain > bestGain)
+			{
+				bestGain  = gain;
+				bestSide  = side;
+				bestGrand = grand;
+			}
+		}
+	}
+	if(bestSide == -1)
+		return;
+
+	const int child    = bestSide ? node.child1 : node.child0;
+	const int otherIdx = bestSide ? node.child0 : node.child1;
+	const int up       = bestGrand ? m_hierarchy[otherIdx].child1 : m_hierarchy[otherIdx].child0;
+	const int stays    = bestGrand ? m_hierarchy[otherIdx].child0 : m_hierarchy[otherIdx].child1;
+
+	Node merged(m_hierarchy[child], m_hierarchy[stays]);
+	merged.child0 = child;
+	merged.child1 = stays;
+	m_hierarchy[otherIdx] = merged;
+
+	if(bestSide)	node.child1 = up;
+	else			node.child0 = up;
+}
+
+void ReconstructIndirect::splitOversizedSplats(bool print)
+{
+	// Splats much larger than the average bloat their leaves and every ancestor. Each of them is replaced
+	// by references that own the cells of a grid over the splat's bounds, and are bounded by their cells.
+	// The outermost cells extend to infinity, so the half-open cells partition space and a ray-splat hit
+	// point is accepted by exactly one reference. Clipping in space assumes static splats.
+
+	FW_ASSERT(!m_motionEnabled);
+
+	Array<Vec3f> probes;									// (origin,direction) of a subset of the secondary rays
+	const int numProbes = min(m_samples.getSize(), (int)NUM_PROBE_RAYS);
+	for(int i=0;i<numProbes;i++)
+	{
+		const Sample& s = m_samples[int(S64(m_samples.getSize())*i/numProbes)];
+		probes.add(s.sec_origin);
+		probes.add((s.getHitPoint<StaticScene>(0.f)-s.sec_origin).normalized());
+	}
+	const float oldSteps = getTraversalSteps(probes);
+	const int   oldSize  = m_samples.getSize();
+
+	double sumRadius = 0;
+	for(int i=0;i<m_samples.getSize();i++)
+		sumRadius += m_samples[i].radius;
+	const float splitRadius = SPLIT_RADIUS_SCALE * float(sumRadius / max(1,m_samples.getSize()));
+
+	// references and their morton codes, relative to the bloated root
+
+	const Vec3f bbmin = m_hierarchy[ROOT].bbmin;
+	const Vec3f bbmax = m_hierarchy[ROOT].bbmax;
+	const int   SCALE = (1<<NBITS)-1;
+
+	Array<Sample>    samples;
+	Array<ClipBox>   clipBoxes;
+	Array<SortEntry> codes;
+	int numSplit = 0;
+	for(int i=0;i<m_samples.getSize();i++)
+	{
+		const Sample& s   = m_samples[i];
+		const Vec3f   p   = s.getHitPoint<StaticScene>(0.f);
+		const Vec3f   ext = getSplatExtent(s, CIRCLE);
+		const Vec3f   lo  = p-ext;
+		const Vec3f   hi  = p+ext;
+
+		Vec3i num(1);
+		if(s.radius > splitRadius)
+			for(int a=0;a<3;a++)
+				num[a] = clamp((int)ceil(ext[a]/splitRadius), 1, (int)MAX_SPLITS_PER_AXIS);
+		numSplit += (num != Vec3i(1)) ? 1 : 0;
+
+		for(int z=0;z<num.z;z++)
+		for(int y=0;y<num.y;y++)
+		for(int x=0;x<num.x;x++)
+		{
+			const Vec3i cell(x,y,z);
+			ClipBox c;
+			for(int a=0;a<3;a++)							// neighbouring cells compute identical planes
+			{
+				c.lo[a] = (cell[a]         ) ? lo[a] + (hi[a]-lo[a]) * (float(cell[a]  )/num[a]) : -FW_F32_MAX;
+				c.hi[a] = (cell[a]+1<num[a]) ? lo[a] + (hi[a]-lo[a]) * (float(cell[a]+1)/num[a]) :  FW_F32_MAX;
+			}
+
+			// does the splat's plane pass through the cell? (conservative)
+			const Vec3f cellMin = max(c.lo, lo);
+			const Vec3f cellMax = min(c.hi, hi);
+			const Vec3f center  = (cellMin+cellMax)*0.5f;
+			const Vec3f half    = (cellMax-cellMin)*0.5f;
+			if(fabs(dot(s.sec_normal, center-p)) > 1.01f*dot(abs(s.sec_normal), half) + 1e-6f)
+				continue;
+
+			const Vec3f pt = clamp((center-bbmin) / (bbmax-bbmin) * SCALE, Vec3f(0), Vec3f((F32)SCALE));
+			SortEntry& se = codes.add();
+			se.key   = morton( U32(pt.x),U32(pt.y),U32(pt.z) );
+			se.value = samples.getSize();
+			samples  .add(s);
+			clipBoxes.add(c);
+		}
+	}
+
+	// rebuild the hierarchy over the references
+
+	radixSort(codes, true);	// increasing
+	m_samples  .reset(codes.getSize());
+	m_clipBoxes.reset(codes.getSize());
+	for(int i=0;i<codes.getSize();i++)
+	{
+		m_samples  [i] = samples  [codes[i].value];
+		m_clipBoxes[i] = clipBoxes[codes[i].value];
+	}
+
+	buildHierarchy(codes);
+	validateNodeBounds(CIRCLE);
+
+	if(print) printf("  Split %d oversized splats into %d references (%d -> %d), %.2f -> %.2f traversal steps/ray\n", numSplit, m_samples.getSize()-oldSize+numSplit, oldSize, m_samples.getSize(), oldSteps, getTraversalSteps(probes));
+}
+
+float ReconstructIndirect::getTraversalSteps(const Array<Vec3f>& probes) const
+{
+	// all-hits traversal like in FilterTask::collectSamples()
+
+	const float ooeps = 1e-20f;
+	Array<int> stack;
+	U64 numSteps = 0;
+	for(int i=0;i+1<probes.getSize();i+=2)
+	{
+		const Vec3f& orig = probes[i];
+		const Vec3f& dir  = probes[i+1];
+		Vec3f idir;
+		idir.x = 1.0f / (fabs(dir.x)>ooeps ? dir.x : (dir.x<0 ? -ooeps : ooeps));
+		idir.y = 1.0f / (fabs(dir.y)>ooeps ? dir.y : (dir.y<0 ? -ooeps : ooeps));
+		idir.z = 1.0f / (fabs(dir.z)>ooeps ? dir.z : (dir.z<0 ? -ooeps : ooeps));
+		const Vec3f ood = orig * idir;
+
+		stack.clear();
+		stack.add(ROOT);
+		while(stack.getSize())
+		{
+			numSteps++;
+			const Node& node = m_hierarchy[stack.removeLast()];
+			if(node.isLeaf())
+				continue;
+			if(m_hierarchy[node.child0].intersect<StaticScene>(idir,ood,0.f))	stack.add(node.child0);
+			if(m_hierarchy[node.child1].intersect<StaticScene>(idir,ood,0.f))	stack.add(node.child1);
+		}
+	}
+	return probes.getSize() ? float(double(numSteps) / (probes.getSize()/2)) : 0.f;
+}
+
+void ReconstructIndirect::buildWideHierarchy(void)
+{
+	// Each wide node adopts up to 4 descendants of a binary node, opening the largest inner one first.
+	// Leaves stay in m_hierarchy and are referenced as ~index.
+
+	m_wideHierarchy.reset();
+	m_wideHierarchyT1.reset();
+	if(!m_hierarchy.getSize() || m_hierarchy[ROOT].isLeaf())
+		return;
+
+	Array<Vec2i> todo;										// (binary node, wide node)
+	m_wideHierarchy.add();
+	if(m_motionEnabled)
+		m_wideHierarchyT1.add();
+	todo.add(Vec2i(ROOT,0));
+	while(todo.getSize())
+	{
+		const Vec2i item = todo.removeLast();
+		int children[WideNode::WIDTH];
+		int numChildren = 0;
+		children[numChildren++] = m_hierarchy[item.x].child0;
+		children[numChildren++] = m_hierarchy[item.x].child1;
+
+		while(numChildren < WideNode::WIDTH)
+		{
+			int   best     = -1;
+			float bestArea = -1.f;
+			for(int k=0;k<numChildren;k++)
+			{
+				const Node& c = m_hierarchy[children[k]];
+				if(!c.isLeaf() && c.getAverageSurfaceArea() > bestArea)
+				{
+					best     = k;
+					bestArea = c.getAverageSurfaceArea();
+				}
+			}
+			if(best == -1)
+				break;
+
+			const Node& c = m_hierarchy[children[best]];
+			children[best]          = c.child0;
+			children[numChildren++] = c.child1;
+		}
+
+		for(int k=0;k<numChildren;k++)
+		{
+			const Node& c = m_hierarchy[children[k]];
+			int ref = ~children[k];
+			if(!c.isLeaf())
+			{
+				ref = m_wideHierarchy.getSize();
+				m_wideHierarchy.add();
+				if(m_motionEnabled)
+					m_wideHierarchyT1.add();
+				todo.add(Vec2i(children[k],ref));
+			}
+			m_wideHierarchy[item.y].setChild(k, c, ref);
+			if(m_motionEnabled)
+				m_wideHierarchyT1[item.y].set(k, c.bbminT1, c.bbmaxT1);
+		}
+		m_wideHierarchy[item.y].numChildren = numChildren;
+	}
+}
+
+static inline float dequantize(float lo, float scale, U16 q)	{ return lo + float(q)*scale; }	// the only decoding, so encoding can verify it
+
+static inline U16 quantizeLo(float v, float lo, float scale)		// largest q that decodes to <= v
+{
+	int q = (scale > 0.f) ? clamp((int)floor((v-lo)/scale), 0, 0xffff) : 0;
+	while(q > 0 && dequantize(lo,scale,U16(q)) > v)
+		q--;
+	return U16(q);
+}
+
+static inline U16 quantizeHi(float v, float lo, float scale)		// smallest q that decodes to >= v
+{
+	int q = (scale > 0.f) ? clamp((int)ceil((v-lo)/scale), 0, 0xffff) : 0xffff;
+	while(q < 0xffff && dequantize(lo,scale,U16(q)) < v)
+		q++;
+	return U16(q);
+}
+
+void ReconstructIndirect::QuantizedBox::encode(const Vec3f& bbmin, const Vec3f& bbmax, const Vec3f& parentMin, const Vec3f& parentMax)
+{
+	for(int a=0;a<3;a++)
+	{
+		const float scale = (parentMax[a]-parentMin[a]) * (1.f/0xffff);
+		lo[a] = quantizeLo(bbmin[a], parentMin[a], scale);
+		hi[a] = quantizeHi(bbmax[a], parentMin[a], scale);
+	}
+}
+
+void ReconstructIndirect::QuantizedBox::decode(Vec3f& bbmin, Vec3f& bbmax, const Vec3f& parentMin, const Vec3f& parentMax) const
+{
+	for(int a=0;a<3;a++)
+	{
+		const float scale = (parentMax[a]-parentMin[a]) * (1.f/0xffff);
+		bbmin[a] = dequantize(parentMin[a], scale, lo[a]);
+		bbmax[a] = dequantize(parentMin[a], scale, hi[a]);
+	}
+}
+
+void ReconstructIndirect::encodeCompactNode(int index, const Node& node, Node& decoded, const Node& parent)
+{
+	m_compactHierarchy[index].box.encode(node.bbmin, node.bbmax, parent.bbmin, parent.bbmax);
+	m_compactHierarchy[index].box.decode(decoded.bbmin, decoded.bbmax, parent.bbmin, parent.bbmax);
+	if(m_motionEnabled)
+	{
+		m_compactHierarchyT1[index].encode(node.bbminT1, node.bbmaxT1, parent.bbminT1, parent.bbmaxT1);
+		m_compactHierarchyT1[index].decode(decoded.bbminT1, decoded.bbmaxT1, parent.bbminT1, parent.bbmaxT1);
+	}
+}
+
+void ReconstructIndirect::buildCompactHierarchy(void)
+{
+	// Breadth-first, so that the children of each node can be allocated next to each other.
+	// The root is quantized relative to its own full precision bounds.
+
+	m_compactBounds = m_hierarchy[ROOT];
+	m_compactHierarchy.reset(m_hierarchy.getSize());
+	m_compactHierarchyT1.reset(m_motionEnabled ? m_hierarchy.getSize() : 0);
 
-			nodes = nodes2;
+	Array<int>  order  (NULL, m_hierarchy.getSize());		// binary node of each compact node
+	Array<Node> decoded(NULL, m_hierarchy.getSize());		// as seen by the traversal
+	order[0] = ROOT;
+	encodeCompactNode(0, m_hierarchy[ROOT], decoded[0], m_compactBounds);
+
+	int numNodes = 1;
+	for(int i=0;i<numNodes;i++)
+	{
+		const Node&  node    = m_hierarchy[order[i]];
+		CompactNode& compact = m_compactHierarchy[i];
+		if(node.isLeaf())
+		{
+			compact.index      = node.s0;
+			compact.numSamples = node.ns;
+			continue;
 		}
 
-		return nodes.getSize() ? nodes[0] : NULL;
+		compact.index      = numNodes;
+		compact.numSamples = 0;
+		order[numNodes  ]  = node.child0;
+		order[numNodes+1]  = node.child1;
+		for(int c=numNodes;c<numNodes+2;c++)
+			encodeCompactNode(c, m_hierarchy[order[c]], decoded[c], decoded[i]);
+		numNodes += 2;
 	}
+	m_compactHierarchy.resize(numNodes);						// in case of unreferenced nodes
+	if(m_motionEnabled)
+		m_compactHierarchyT1.resize(numNodes);
 }
 
-float ReconstructIndirect::getHierarchyArea(int nodeIdx, bool leafOnly) const
+Vec3f ReconstructIndirect::getSplatExtent(const Sample& s, BloatMode mode)
 {
-	float time = 0.f;	// @ t=0
-	const Node& node = m_hierarchy[nodeIdx];
-	if(node.isLeaf())	return node.getSurfaceArea(time);
-	else				return (leafOnly ? 0 : node.getSurfaceArea(time)) + getHierarchyArea(node.child0) + getHierarchyArea(node.child1);
+	const Vec3f& n = s.sec_normal;
+	const float& R = s.radius;
+	Vec3f ext(1e-3f);									// needed to avoid precision issues in fast traversal code
+
+	switch(mode)
+	{
+	case CIRCLE:
+		{
+			const float cosx = dot(Vec3f(1,0,0), n);
+			const float cosy = dot(Vec3f(0,1,0), n);
+			const float cosz = dot(Vec3f(0,0,1), n);
+			const float sinx = sqrt(1-cosx*cosx);		// sin^2 + cos^2 = 1
+			const float siny = sqrt(1-cosy*cosy);
+			const float sinz = sqrt(1-cosz*cosz);
+			ext += R * Vec3f(sinx,siny,sinz);
+			break;
+		}
+	case SPHERE:
+		{
+			ext += R;
+			break;
+		}
+	case POINT:
+		{
+			break;
+		}
+	default:
+		fail("getSplatExtent");
+	} // switch
+
+	return ext;
 }
 
-void ReconstructIndirect::validateNodeBounds(int nodeIdx, BloatMode mode)
+void ReconstructIndirect::refitNode(int nodeIdx, BloatMode mode)
 {
 	Node& node = m_hierarchy[nodeIdx];
 
@@ -534,39 +1481,23 @@ void ReconstructIndirect::validateNodeBounds(int nodeIdx, BloatMode mode)
 
 		for(int i=node.s0;i<node.s1;i++)
 		{
-			const Sample& s = m_samples[i];
-			const Vec3f& n = s.sec_normal;
-			const float& R = s.radius;
-			Vec3f ext(1e-3f);									// needed to avoid precision issues in fast traversal code
+			const Sample& s   = m_samples[i];
+			const Vec3f   ext = getSplatExtent(s, mode);
+			const Vec3f   pt0 = getHitPoint(s,0.f);				// @ t=0
+			const Vec3f   pt1 = getHitPoint(s,1.f);				// @ t=1
 
-			switch(mode)
+			if(m_clipBoxes.getSize())							// a reference of a split splat (static), bounded by its cell
 			{
-			case CIRCLE:
-				{
-					const float cosx = dot(Vec3f(1,0,0), n);
-					const float cosy = dot(Vec3f(0,1,0), n);
-					const float cosz = dot(Vec3f(0,0,1), n);
-					const float sinx = sqrt(1-cosx*cosx);		// sin^2 + cos^2 = 1
-					const float siny = sqrt(1-cosy*cosy);
-					const float sinz = sqrt(1-cosz*cosz);
-					ext += R * Vec3f(sinx,siny,sinz);
-					break;
-				}
-			case SPHERE:
-				{
-					ext += R;
-					break;
-				}
-			case POINT:
-				{
-					break;
-				}
-			default:
-				fail("validateNodeBounds");
-			} // switch
+				const ClipBox& c = m_clipBoxes[i];
+				const Vec3f lo = max(pt0-ext, c.lo-1e-3f);
+				const Vec3f hi = min(pt0+ext, c.hi+1e-3f);
+				node.bbmin   = min(node.bbmin,   lo);
+				node.bbmax   = max(node.bbmax,   hi);
+				node.bbminT1 = min(node.bbminT1, lo);
+				node.bbmaxT1 = max(node.bbmaxT1, hi);
+				continue;
+			}
 
-			const Vec3f  pt0 = s.getHitPoint(0.f);				// @ t=0
-			const Vec3f  pt1 = s.getHitPoint(1.f);				// @ t=1
 			node.bbmin   = min(node.bbmin, pt0-ext);
 			node.bbmax   = max(node.bbmax, pt0+ext);
 			node.bbminT1 = min(node.bbminT1, pt1-ext);
@@ -575,10 +1506,8 @@ void ReconstructIndirect::validateNodeBounds(int nodeIdx, BloatMode mode)
 	}
 	else
 	{
-		const Node& c0 = m_hierarchy[node.child0];
+		const Node& c0 = m_hierarchy[node.child0];		// refit already
 		const Node& c1 = m_hierarchy[node.child1];
-		validateNodeBounds(node.child0, mode);
-		validateNodeBounds(node.child1, mode);
 		node.bbmin   = min(c0.bbmin,c1.bbmin);
 		node.bbmax   = max(c0.bbmax,c1.bbmax);
 		node.bbminT1 = min(c0.bbminT1,c1.bbminT1);
@@ -590,223 +1519,617 @@ void ReconstructIndirect::validateNodeBounds(int nodeIdx, BloatMode mode)
 // Verify that all of the hitpoints can be found by traversing the tree
 //-----------------------------------------------------------------------
 
-void ReconstructIndirect::DensityTask::compute(int taskIdx)
+void ReconstructIndirect::ChunkQueue::init(int numItems, int numWorkers, int granularity)
 {
-	const int EMERGENCY_BREAK_LIM = 1000;		// Stop searching if not found the requested kind of samples within this amount of work
-	const float VMF_THRESHOLD_MAX = 0.5f;		// We're really happy if we get this, but if not, we'll lower it until things work out
-	const float VMF_THRESHOLD_SCALE = 0.75f;
-
-	const bool useBandwithInformation = this->m_scope->m_useBandwidthInformation;
+	// Enough chunks to even out the workers, each a whole number of granules
+	const int numChunks = max(numWorkers*CHUNKS_PER_WORKER, 1);
+	const int numGranules = (numItems+granularity-1) / granularity;
+	m_numItems  = numItems;
+	m_chunkSize = max((numGranules+numChunks-1) / numChunks, 1) * granularity;
+	m_next      = 0;
+}
 
-	if(taskIdx<0 || taskIdx>=NUM_DENSITY_TASKS)
-		fail("ReconstructIndirect::DensityTask::compute");
+bool ReconstructIndirect::ChunkQueue::next(int& lo, int& hi)
+{
+	m_lock.enter();
+	lo = m_next;
+	hi = min(lo+m_chunkSize, m_numItems);
+	m_next = hi;
+	m_lock.leave();
+	return lo<hi;
+}
 
-	struct PQEntry
+void ReconstructIndirect::printBusyTimes(const Array<DensityTask>& tasks) const
+{
+	F32 minTime = FW_F32_MAX;
+	F32 maxTime = 0;
+	F32 sumTime = 0;
+	for(int i=0;i<tasks.getSize();i++)
 	{
-		float	key;		// distance
-		int		index;		// in m_samples
-		bool	operator<(const PQEntry& s)	{ return key>s.key; }
-	};
+		minTime  = min(minTime, tasks[i].m_busyTime);
+		maxTime  = max(maxTime, tasks[i].m_busyTime);
+		sumTime += tasks[i].m_busyTime;
+	}
+	printf("  Busy time per thread %.3f..%.3f s (average %.3f s, %d threads)\n", minTime, maxTime, sumTime/max(tasks.getSize(),1), tasks.getSize());
+}
 
-	struct StackEntry
+void ReconstructIndirect::DensityTask::compute(int taskIdx)
+{
+	if(m_scope->m_motionEnabled)	computeImpl<MovingScene>(taskIdx);
+	else							computeImpl<StaticScene>(taskIdx);
+}
+
+void ReconstructIndirect::DensityTask::prepare(int taskIdx)
+{
+	const Array<Sample>& samples = m_scope->m_samples;
+	const bool useBandwidthInformation = m_scope->m_useBandwidthInformation;
+	FW_UNREF(taskIdx);
+
+	int lo,hi;
+	while(m_scope->m_chunks.next(lo,hi))
+	for(int i=lo;i<hi;i++)
 	{
-		StackEntry()							{ }
-		StackEntry(int i,float d)				{ index=i; dist=d; }
-		bool	operator<(const StackEntry& s)	{ return dist<s.dist; }
-		int		index;		// m_hierarchy
-		float	dist;		// distance to node
-	};
+		const Sample& s = samples[i];
+		m_scope->m_knnPoints[i] = m_scope->getHitPoint(s, KNN_TIME);
+		m_scope->m_knnDirs  [i] = (s.sec_origin-s.sec_hitpoint).normalized();
+		if(useBandwidthInformation)
+			m_scope->m_knnBandwidths[i] = FilterTask::vMFfromBandwidth( m_scope->m_sbuf->getSampleW( s.origIndex ) );
+	}
+}
 
-		  Array<Sample>& samples = m_scope->m_samples;
-	const Array<Node>& hierarchy = m_scope->m_hierarchy;
+template<class M>
+void ReconstructIndirect::DensityTask::computeImpl(int taskIdx)
+{
+	FW_UNREF(taskIdx);
 
 	m_numSteps = 0;
 	m_numLeaf  = 0;
 	m_numIter  = 0;
 	m_averageVMF = 0;
 
-	Array<StackEntry> stack;
-	BinaryHeap<StackEntry> stack2;		// prioritized traversal stack
-	BinaryHeap<PQEntry>	pq;				// for K nearest points
+	BinaryHeap<StackEntry> heap;		// prioritized traversal stack
 	Array<float> distances;
 
-	const float t = 0.5f;				// compute @ t=0.5
-	const int TASK_SIZE = (samples.getSize()+NUM_DENSITY_TASKS-1) / NUM_DENSITY_TASKS;	// #samples in each task, rounded up
-	const int lo = taskIdx*TASK_SIZE;													// inc
-	const int hi = min(lo+TASK_SIZE, samples.getSize());								// exc
-	for(int i=lo;i<hi;i++)
+	Timer timer(true);
+	int lo,hi;
+	while(m_scope->m_chunks.next(lo,hi))
+	for(int first=lo;first<hi;first+=KNN_BATCH_SIZE)
+		computeBatch<M>(first, min(first+KNN_BATCH_SIZE,hi), heap, distances);
+	m_busyTime = timer.getElapsed();
+}
+
+template<class M>
+void ReconstructIndirect::DensityTask::computeBatch(int first, int last, BinaryHeap<StackEntry>& heap, Array<float>& distances)
+{
+	// Consecutive samples are neighbours in the tree, and so are their neighbourhoods. The batch
+	// traverses the tree once, best-first by the distance to the bounds of the batch, which bounds
+	// the distance to each of its samples from below. Every sample keeps its own K1 nearest, so
+	// without bandwidth information the result is that of a search per sample. With it, the
+	// emergency break counts the candidates in the order the batch visits the leaves, which is not
+	// the order of a search per sample, so a sample may break (or not) where its own search would
+	// not. Samples that break at the first vMF threshold are searched again on their own, with
+	// lower thresholds.
+
+	const Array<Sample>& samples   = m_scope->m_samples;
+	const Array<Node>&   hierarchy = m_scope->m_hierarchy;
+	const Array<Vec3f>&  points    = m_scope->m_knnPoints;
+	const Array<Vec3f>&  dirs      = m_scope->m_knnDirs;
+	const Array<float>&  bws       = m_scope->m_knnBandwidths;
+	const bool  useBandwidthInformation = m_scope->m_useBandwidthInformation;
+	const float logThreshold = logf(VMF_THRESHOLD_MAX);		// vMF < threshold <=> bw*(cos-1) < log(threshold)
+	const float t = KNN_TIME;
+
+	const int num = last-first;
+	Neighbors nb       [KNN_BATCH_SIZE];
+	Mat3f     toTangent[KNN_BATCH_SIZE];
+	int       numTested[KNN_BATCH_SIZE];
+	bool      active   [KNN_BATCH_SIZE];
+	Vec3f bbmin( FW_F32_MAX);
+	Vec3f bbmax(-FW_F32_MAX);
+	for(int b=0;b<num;b++)
 	{
-		m_numIter++;
-		const Sample& s = samples[i];
-		const Vec3f   o = s.getHitPoint(t);
-		const Vec3f&  n = s.sec_normal;
+		bbmin = min(bbmin, points[first+b]);
+		bbmax = max(bbmax, points[first+b]);
+		nb[b].clear();
+		toTangent[b] = orthogonalBasis(samples[first+b].sec_normal).transposed();			// inverse (symmetric matrix)
+		numTested[b] = 0;
+		active   [b] = true;
+	}
+	m_numIter += num;
 
-		const Mat3f cameraToTangentplane = orthogonalBasis(n).transposed();				// inverse (symmetric matrix)
+	// Step 1: Collect K nearest samples from the tree
 
-		// Step 1: Collect K nearest samples from the tree
+	heap.clear();
+	heap.add( StackEntry(ROOT,0.f) );
+	float thresholdDist = FW_F32_MAX;						// largest of the active samples
+	while(heap.numItems())
+	{
+		m_numSteps++;
+		const StackEntry se = heap.removeMin();
+		if(se.dist >= thresholdDist)
+			break;
 
-		for(float vMFThreshold=VMF_THRESHOLD_MAX; vMFThreshold>=0.01f; vMFThreshold*=VMF_THRESHOLD_SCALE)
+		const Node& node = hierarchy[se.index];
+		if(!node.isLeaf())
 		{
-			float thresholdDist = FW_F32_MAX;
-			pq.clear();
-			stack2.clear();
-			stack2.add( StackEntry(ROOT,0.f) );
-
-			// Try with a specific vMF threshold
-			int numSamplesTested = 0;
-			while(stack2.numItems() && numSamplesTested<EMERGENCY_BREAK_LIM)
+			for(int c=0;c<2;c++)
 			{
-				m_numSteps++;
-				StackEntry se = stack2.removeMin();
-				if(se.dist >= thresholdDist)
-					break;
+				const int   child = c ? node.child1 : node.child0;
+				const Vec3f d     = max(hierarchy[child].getBBMin<M>(t)-bbmax, bbmin-hierarchy[child].getBBMax<M>(t), Vec3f(0));
+				heap.add( StackEntry(child, d.length()) );
+			}
+			continue;
+		}
 
-				const Node& node = hierarchy[se.index];
-				if(node.isLeaf())
+		m_numLeaf++;
+		thresholdDist = 0.f;
+		for(int b=0;b<num;b++)
+		{
+			if(!active[b])
+				continue;
+
+			const int    i = first+b;
+			const Vec3f& o = points[i];
+			if(node.getDistance<M>(o,t) < nb[b].getThreshold())
+			for(int j=node.s0;j<node.s1;j++)
+			{
+				if(useBandwidthInformation)
 				{
-					m_numLeaf++;
-					for(int j=node.s0;j<node.s1;j++)
-					{
-						const Vec3f  p   = samples[j].getHitPoint(t);
-						const Vec3f td   = cameraToTangentplane * (o-p);					// p->o in tangent plane's coordinate system (z aligned to normal)
-						float dist = (td*Vec3f(1,1,1+ANISOTROPIC_SCALE)).length();	// anisotropic scale
+					numTested[b]++;
+					if(bws[i]*(dot(dirs[i],dirs[j])-1.f) < logThreshold)
+						continue;
+				}
 
-						if(useBandwithInformation)
-						{
-							numSamplesTested++;
-							double anglecos = dot( (s.sec_origin-s.sec_hitpoint).normalized(), (samples[j].sec_origin-samples[j].sec_hitpoint).normalized() );
-							double bw = FilterTask::vMFfromBandwidth( m_scope->m_sbuf->getSampleW( s.origIndex.x, s.origIndex.y, s.origIndex.z ) );
-							double vMF = exp( bw * anglecos - bw );	// non-normalized vMF, in [0,1]
-							if ( vMF < vMFThreshold )
-								continue;
-						}
+				const Vec3f td = toTangent[b] * (o-points[j]);								// p->o in tangent plane's coordinate system (z aligned to normal)
+				nb[b].add( (td*Vec3f(1,1,1+ANISOTROPIC_SCALE)).length(), j );			// anisotropic scale
+			}
 
-						// update per-sample priority queue
-						PQEntry e;
-						e.index = j;
-						e.key   = dist;
-						if(pq.numItems()==K1)
-						{
-							const PQEntry& me = pq.getMin();
-							if(e.key < me.key)
-							{
-								pq.removeMin();	// replace previous _largest_ (of K smallest)
-								pq.add( e );
-							}
-						}
-						else
-						{
-							pq.add( e );		// add
-						}
-					}
+			if(numTested[b] >= KNN_EMERGENCY_BREAK)
+				active[b] = false;
+			else
+				thresholdDist = max(thresholdDist, nb[b].getThreshold());
+		}
+	}
 
-					thresholdDist = (pq.numItems()==K1) ? pq.getMin().key : FW_F32_MAX;	// anything larger than this is of no interest
-				}
-				else
+	// Step 2: radii
+
+	for(int b=0;b<num;b++)
+	{
+		if(active[b])
+		{
+			m_averageVMF += VMF_THRESHOLD_MAX;
+			setRadius(first+b, nb[b], distances);
+		}
+		else
+			computeSample<M>(first+b, VMF_THRESHOLD_MAX*VMF_THRESHOLD_SCALE, heap, distances);
+	}
+}
+
+template<class M>
+void ReconstructIndirect::DensityTask::computeSample(int i, float firstThreshold, BinaryHeap<StackEntry>& heap, Array<float>& distances)
+{
+	const Array<Sample>& samples   = m_scope->m_samples;
+	const Array<Node>&   hierarchy = m_scope->m_hierarchy;
+	const Array<Vec3f>&  points    = m_scope->m_knnPoints;
+	const Array<Vec3f>&  dirs      = m_scope->m_knnDirs;
+	const Array<float>&  bws       = m_scope->m_knnBandwidths;
+	const bool  useBandwidthInformation = m_scope->m_useBandwidthInformation;
+	const float t = KNN_TIME;
+
+	const Vec3f& o = points[i];
+	const Mat3f  cameraToTangentplane = orthogonalBasis(samples[i].sec_normal).transposed();	// inverse (symmetric matrix)
+
+	Neighbors nb;
+	for(float vMFThreshold=firstThreshold; vMFThreshold>=0.01f; vMFThreshold*=VMF_THRESHOLD_SCALE)
+	{
+		const float logThreshold = logf(vMFThreshold);
+		nb.clear();
+		heap.clear();
+		heap.add( StackEntry(ROOT,0.f) );
+
+		// Try with a specific vMF threshold
+		int numSamplesTested = 0;
+		while(heap.numItems() && numSamplesTested<KNN_EMERGENCY_BREAK)
+		{
+			m_numSteps++;
+			const StackEntry se = heap.removeMin();
+			if(se.dist >= nb.getThreshold())
+				break;
+
+			const Node& node = hierarchy[se.index];
+			if(node.isLeaf())
+			{
+				m_numLeaf++;
+				for(int j=node.s0;j<node.s1;j++)
 				{
-					StackEntry se0( node.child0, hierarchy[node.child0].getDistance(o,t) );
-					StackEntry se1( node.child1, hierarchy[node.child1].getDistance(o,t) );
-					stack2.add( se0 );
-					stack2.add( se1 );
+					if(useBandwidthInformation)
+					{
+						numSamplesTested++;
+						if(bws[i]*(dot(dirs[i],dirs[j])-1.f) < logThreshold)
+							continue;
+					}
+
+					const Vec3f td = cameraToTangentplane * (o-points[j]);
+					nb.add( (td*Vec3f(1,1,1+ANISOTROPIC_SCALE)).length(), j );
 				}
 			}
-
-			// did we succeed?
-			if(numSamplesTested<EMERGENCY_BREAK_LIM)
+			else
 			{
-				m_averageVMF += vMFThreshold;
-				break;
+				heap.add( StackEntry(node.child0, hierarchy[node.child0].getDistance<M>(o,t)) );
+				heap.add( StackEntry(node.child1, hierarchy[node.child1].getDistance<M>(o,t)) );
 			}
 		}
 
-		// Step 2: Determine a sample's radius on its tangent plane from K2 nearest samples on the plane
+		// did we succeed?
+		if(numSamplesTested<KNN_EMERGENCY_BREAK)
+		{
+			m_averageVMF += vMFThreshold;
+			break;
+		}
+	}
+
+	setRadius(i, nb, distances);
+}
+
+void ReconstructIndirect::DensityTask::setRadius(int i, const Neighbors& nb, Array<float>& distances)
+{
+	// Determine a sample's radius on its tangent plane from K2 nearest samples on the plane
+
+	// Project the nearest points to the plane defined by sample i
+	//
+	// (p+t*n,1) | plane = 0
+	// t*n | plane.xyz = -(p,1) | plane
+	// t = -(p,1) | plane / (n | plane.xyz)
+
+	if(!nb.num)										// every candidate failed the vMF test
+	{
+		m_scope->m_samples[i].radius = -1.f;		// set after the pass, see assignIsolatedRadii()
+		m_numIsolated++;
+		return;
+	}
+
+	const Array<Vec3f>& points = m_scope->m_knnPoints;
+	const Vec3f& o = points[i];
+	const Vec3f& n = m_scope->m_samples[i].sec_normal;
+
+	if(K2 < K1)
+	{
+		distances.clear();
+		const Vec4f plane = Vec4f(n, -dot(n,o));	// ith sample lies on this plane
+		const float oon   = rcp( dot(n,plane.getXYZ()) );
+		for(int k=0;k<nb.num;k++)
+		{
+			const Vec3f p   = points[ nb.index[k] ];										// in 3D
+			const float t   = -dot(Vec4f(p,1),plane) * oon;
+			const Vec3f pip = p+t*n;											// projected to the plane along o's normal
+			distances.add( (o-pip).length() );
+		}
+
+		FW_SORT_ARRAY( distances, float, a < b );
+		m_scope->m_samples[i].radius = distances[ min((int)K2, distances.getSize()-1) ];
+	}
+	else
+	{
+		const Vec3f p   = points[ nb.index[nb.num-1] ];										// in 3D, the farthest
+		m_scope->m_samples[i].radius = (p-o).length();										// isotropic
+	}
+}
+
+float ReconstructIndirect::assignIsolatedRadii(void)
+{
+	// Samples whose neighbours were all rejected get the average radius of the others
+
+	double sum = 0;
+	int    num = 0;
+	for(int i=0;i<m_samples.getSize();i++)
+		if(m_samples[i].radius >= 0.f)
+		{
+			sum += m_samples[i].radius;
+			num++;
+		}
+
+	const float radius = (num) ? float(sum/num) : 0.f;
+	for(int i=0;i<m_samples.getSize();i++)
+		if(m_samples[i].radius < 0.f)
+			m_samples[i].radius = radius;
+	return radius;
+}
+
+//-----------------------------------------------------------------------
+// Densities from a hashed uniform grid
+//-----------------------------------------------------------------------
+
+void ReconstructIndirect::buildDensityGrid(void)
+{
+	profilePush("Density grid");
+
+	const int numSamples = m_samples.getSize();
+	Vec3f bbmin( FW_F32_MAX);
+	Vec3f bbmax(-FW_F32_MAX);
+	for(int i=0;i<numSamples;i++)
+	{
+		bbmin = min(bbmin, m_knnPoints[i]);
+		bbmax = max(bbmax, m_knnPoints[i]);
+	}
+
+	// Quick density estimate: a leaf of n samples on a locally flat surface spans about
+	// extent^2, so K1 of them fit in a cell of extent*sqrt(K1/n). Take the median over leaves.
+
+	Array<float> cellSizes;
+	for(int n=0;n<m_hierarchy.getSize();n++)
+	{
+		const Node& node = m_hierarchy[n];
+		const int num = node.s1-node.s0;
+		if(!node.isLeaf() || num<2)
+			continue;
+
+		Vec3f lo( FW_F32_MAX);
+		Vec3f hi(-FW_F32_MAX);
+		for(int j=node.s0;j<node.s1;j++)
+		{
+			lo = min(lo, m_knnPoints[j]);
+			hi = max(hi, m_knnPoints[j]);
+		}
+		const float extent = (hi-lo).max();
+		if(extent > 0.f)
+			cellSizes.add( extent * sqrt(float(K1)/num) );
+	}
+
+	const float diagonal = (bbmax-bbmin).length();
+	if(cellSizes.getSize())
+	{
+		FW_SORT_ARRAY( cellSizes, float, a < b );
+		m_gridCellSize = cellSizes[ cellSizes.getSize()/2 ];
+	}
+	else
+		m_gridCellSize = diagonal / max(powf(float(numSamples)/K1, 1.f/3), 1.f);
+	m_gridCellSize = max(m_gridCellSize, diagonal*1e-6f, FW_F32_MIN);	// keeps cell coordinates in range
+	m_gridOrigin   = bbmin;
+
+	// Counting sort of the samples by bucket
+
+	int numBuckets = 1;
+	while(numBuckets < 2*numSamples)
+		numBuckets *= 2;
+	m_gridMask = numBuckets-1;
+
+	m_gridStart.reset(numBuckets+1);
+	for(int b=0;b<=numBuckets;b++)
+		m_gridStart[b] = 0;
+	for(int i=0;i<numSamples;i++)
+		m_gridStart[ getGridBucket(getGridCell(m_knnPoints[i]))+1 ]++;
+	for(int b=0;b<numBuckets;b++)
+		m_gridStart[b+1] += m_gridStart[b];
+
+	Array<int> fill(m_gridStart.getPtr(), numBuckets);
+	m_gridSamples.reset(numSamples);
+	for(int i=0;i<numSamples;i++)
+		m_gridSamples[ fill[getGridBucket(getGridCell(m_knnPoints[i]))]++ ] = i;
+
+	profilePop();
+}
+
+void ReconstructIndirect::reportGridError(void)
+{
+	// Radii of a subset of the samples from the exact engine, compared to the ones from the grid
+
+	DensityTask task;
+	task.init(this);
+	const int stride = max(m_samples.getSize()/GRID_ERROR_PROBES, 1);
+	double sumError = 0;
+	float  maxError = 0;
+	int    num      = 0;
+	for(int i=0;i<m_samples.getSize();i+=stride)
+	{
+		const float approx = m_samples[i].radius;
+		task.computeExact(i);
+		const float exact  = m_samples[i].radius;
+		m_samples[i].radius = approx;
+		if(exact <= 0.f)
+			continue;
+
+		const float error = fabs(approx-exact) / exact;
+		sumError += error;
+		maxError  = max(maxError, error);
+		num++;
+	}
+	printf("  Grid KNN radius error %.2f%% average, %.2f%% max (%d samples vs. exact)\n", 100.0*sumError/max(num,1), 100.f*maxError, num);
+}
+
+void ReconstructIndirect::DensityTask::computeGrid(int taskIdx)
+{
+	if(m_scope->m_motionEnabled)	computeGridImpl<MovingScene>(taskIdx);
+	else							computeGridImpl<StaticScene>(taskIdx);
+}
 
-		// Project the nearest points to the plane defined by sample i
-		//
-		// (p+t*n,1) | plane = 0
-		// t*n | plane.xyz = -(p,1) | plane
-		// t = -(p,1) | plane / (n | plane.xyz)
+void ReconstructIndirect::DensityTask::computeExact(int i)
+{
+	BinaryHeap<StackEntry> heap;
+	Array<float> distances;
+	if(m_scope->m_motionEnabled)	computeSample<MovingScene>(i, VMF_THRESHOLD_MAX, heap, distances);
+	else							computeSample<StaticScene>(i, VMF_THRESHOLD_MAX, heap, distances);
+}
+
+template<class M>
+void ReconstructIndirect::DensityTask::computeGridImpl(int taskIdx)
+{
+	FW_UNREF(taskIdx);
+
+	m_numSteps = 0;
+	m_numIter  = 0;
+	m_numFallbacks = 0;
+	m_averageVMF = 0;
+
+	const Array<Sample>& samples     = m_scope->m_samples;
+	const Array<Vec3f>&  points      = m_scope->m_knnPoints;
+	const Array<Vec3f>&  dirs        = m_scope->m_knnDirs;
+	const Array<float>&  bws         = m_scope->m_knnBandwidths;
+	const Array<int>&    gridStart   = m_scope->m_gridStart;
+	const Array<int>&    gridSamples = m_scope->m_gridSamples;
+	const bool  useBandwidthInformation = m_scope->m_useBandwidthInformation;
+	const float logThreshold = logf(VMF_THRESHOLD_MAX);
+	const float cellSize     = m_scope->m_gridCellSize;
+
+	BinaryHeap<StackEntry> heap;		// for the fallback
+	Array<float> distances;
+	Neighbors nb;
 
-		if(K2 < K1)
+	Timer timer(true);
+	int lo,hi;
+	while(m_scope->m_chunks.next(lo,hi))
+	for(int i=lo;i<hi;i++)
+	{
+		m_numIter++;
+		const Vec3f& o    = points[i];
+		const Mat3f  cameraToTangentplane = orthogonalBasis(samples[i].sec_normal).transposed();	// inverse (symmetric matrix)
+		const Vec3i  cell = m_scope->getGridCell(o);
+
+		nb.clear();
+		int  numSamplesTested = 0;
+		bool found = false;
+		for(int r=0;r<=GRID_MAX_RINGS && numSamplesTested<KNN_EMERGENCY_BREAK;r++)
 		{
-			distances.clear();
-			const Vec4f plane = Vec4f(n, -dot(n,o));	// ith sample lies on this plane
-			const float oon   = rcp( dot(n,plane.getXYZ()) );
-			while(pq.numItems())
+			// cells at Chebyshev distance r from the sample's own
+			for(int dz=-r;dz<=r;dz++)
+			for(int dy=-r;dy<=r;dy++)
+			for(int dx=-r;dx<=r;dx++)
+			{
+				if(max(abs(dx),abs(dy),abs(dz)) != r)
+					continue;
+
+				m_numSteps++;
+				const Vec3i c = cell + Vec3i(dx,dy,dz);
+				const int   b = m_scope->getGridBucket(c);
+				for(int k=gridStart[b];k<gridStart[b+1];k++)
+				{
+					const int j = gridSamples[k];
+					if(m_scope->getGridCell(points[j]) != c)					// another cell in the same bucket
+						continue;
+
+					if(useBandwidthInformation)
+					{
+						numSamplesTested++;
+						if(bws[i]*(dot(dirs[i],dirs[j])-1.f) < logThreshold)
+							continue;
+					}
+
+					const Vec3f td = cameraToTangentplane * (o-points[j]);				// p->o in tangent plane's coordinate system (z aligned to normal)
+					nb.add( (td*Vec3f(1,1,1+ANISOTROPIC_SCALE)).length(), j );		// anisotropic scale
+				}
+			}
+
+			// The anisotropic distance is at least the Euclidean one, and the samples that were not
+			// searched are at least r cells away, so the K1 found are the nearest once the farthest
+			// of them is within that. Search at least GRID_RINGS, and at most GRID_MAX_RINGS.
+			if(r>=GRID_RINGS && nb.num==K1 && nb.getThreshold()<=r*cellSize)
 			{
-				const Vec3f p   = samples[ pq.removeMin().index ].getHitPoint(t);	// in 3D
-				const float t   = -dot(Vec4f(p,1),plane) * oon;
-				const Vec3f pip = p+t*n;											// projected to the plane along o's normal
-				distances.add( (o-pip).length() );
+				found = true;
+				break;
 			}
+		}
 
-			FW_SORT_ARRAY( distances, float, a < b );
-			samples[i].radius = distances[K2];
+		if(found && numSamplesTested<KNN_EMERGENCY_BREAK)
+		{
+			m_averageVMF += VMF_THRESHOLD_MAX;
+			setRadius(i, nb, distances);
 		}
 		else
 		{
-			const Vec3f p   = samples[ pq.removeMin().index ].getHitPoint(t);		// in 3D
-			samples[i].radius = (p-o).length();										// isotropic
+			m_numFallbacks++;
+			computeSample<M>(i, VMF_THRESHOLD_MAX, heap, distances);
 		}
 	}
+	m_busyTime = timer.getElapsed();
 }
 
 void ReconstructIndirect::DensityTask::shrink(int taskIdx)
 {
-	if(taskIdx<0 || taskIdx>=NUM_DENSITY_TASKS)
-		fail("ReconstructIndirect::DensityTask::shrink");
+	if(m_scope->m_motionEnabled)	shrinkImpl<MovingScene>(taskIdx);
+	else							shrinkImpl<StaticScene>(taskIdx);
+}
 
-	      Array<Sample>& samples  = m_scope->m_samples;
-	const Array<Node>&	hierarchy = m_scope->m_hierarchy;
+template<class M>
+void ReconstructIndirect::DensityTask::shrinkImpl(int taskIdx)
+{
+	FW_UNREF(taskIdx);
 
-	Array<int> stack;
+	const Array<Sample>&      samples   = m_scope->m_samples;
+	const Array<CompactNode>& hierarchy = m_scope->m_compactHierarchy;
+	const Array<int>&         order     = m_scope->m_shrinkOrder;
+	const Array<int>&         packets   = m_scope->m_shrinkPackets;
+
+	Array<int>  stack;
+	Array<Node> stackBounds;									// decoded
+	Array<int>  stackMasks;										// rays that hit the parent
 
-	m_numShrank = 0;
 	m_numSelfHits = 0;
+	m_shrinkHits.clear();
 
-	const int TASK_SIZE = (samples.getSize()+NUM_DENSITY_TASKS-1) / NUM_DENSITY_TASKS;	// #samples in each task, rounded up
-	const int lo = taskIdx*TASK_SIZE;													// inc
-	const int hi = min(lo+TASK_SIZE, samples.getSize());								// exc
-	for(int i=lo;i<hi;i++)
+	Timer timer(true);
+	int lo,hi;
+	while(m_scope->m_chunks.next(lo,hi))
+	for(int pi=lo;pi<hi;pi++)
 	{
-		// we know this ray didn't hit anything
-		const Sample& sa = samples[i];
-		const float time = sa.t;
-		const Vec3f orig = sa.sec_origin;
-		const Vec3f hitp = sa.getHitPoint(time);
-
-		const float rayLen = (hitp-orig).length();
-		const Vec3f dir    = (hitp-orig) / rayLen;	// unit length
-
-		// prepare the ray for fast traversal
-        const float ooeps = 1e-20f;
-		Vec3f idir;
-        idir.x = 1.0f / (fabs(dir.x)>ooeps ? dir.x : (dir.x<0 ? -ooeps : ooeps));
-        idir.y = 1.0f / (fabs(dir.y)>ooeps ? dir.y : (dir.y<0 ? -ooeps : ooeps));
-        idir.z = 1.0f / (fabs(dir.z)>ooeps ? dir.z : (dir.z<0 ? -ooeps : ooeps));
-		const Vec3f ood = orig * idir;
-
-		// adaptive epsilon similar to from PBRT (takes max because for defocus the rays start from the origin of camera space)
-		const float eps = 1e-3f * max(orig.length(),hitp.length());
+		// we know these rays didn't hit anything
+		ShrinkPacket packet;
+		packet.numRays = packets[pi+1]-packets[pi];
+		for(int k=0;k<ShrinkPacket::WIDTH;k++)
+		{
+			const int     i  = order[ packets[pi] + min(k,packet.numRays-1) ];	// unused lanes repeat the last ray
+			const Sample& sa = samples[i];
+			const float time = sa.t;
+			const Vec3f orig = sa.sec_origin;
+			const Vec3f hitp = sa.getHitPoint<M>(time);
+
+			const float rayLen = (hitp-orig).length();
+			const Vec3f dir    = (hitp-orig) / rayLen;	// unit length
+
+			// prepare the ray for fast traversal
+	        const float ooeps = 1e-20f;
+			Vec3f idir;
+	        idir.x = 1.0f / (fabs(dir.x)>ooeps ? dir.x : (dir.x<0 ? -ooeps : ooeps));
+	        idir.y = 1.0f / (fabs(dir.y)>ooeps ? dir.y : (dir.y<0 ? -ooeps : ooeps));
+	        idir.z = 1.0f / (fabs(dir.z)>ooeps ? dir.z : (dir.z<0 ? -ooeps : ooeps));
+
+			// adaptive epsilon similar to from PBRT (takes max because for defocus the rays start from the origin of camera space)
+			const float eps = 1e-3f * max(orig.length(),hitp.length());
+
+			packet.setRay(k, i, orig, dir, idir, time, rayLen, eps);
+		}
 
 		stack.clear();
+		stackBounds.clear();
+		stackMasks.clear();
 		stack.add(ROOT);
+		m_scope->decodeCompactNode<M>(stackBounds.add(), ROOT, m_scope->m_compactBounds);
+		stackMasks.add( (1<<packet.numRays)-1 );
 		while(stack.getSize())
 		{
-			const int nodeIndex = stack.removeLast();
-			const Node& node = hierarchy[nodeIndex];
+			const int  nodeIndex = stack.removeLast();
+			const Node bounds    = stackBounds.removeLast();
+			const int  mask      = packet.intersect<M>(bounds) & stackMasks.removeLast();
+			const CompactNode& node = hierarchy[nodeIndex];
+			if(!mask)
+				continue;
 
-			if(node.intersect(idir,ood,time))
+			if(node.isLeaf())
 			{
-				if(node.isLeaf())
+				for(int k=0;k<packet.numRays;k++)
+				if(mask & (1<<k))
 				{
-					for(int j=node.s0;j<node.s1;j++)
+					const int    i      = packet.index[k];
+					const float  time   = packet.time[k];
+					const Vec3f& orig   = packet.orig[k];
+					const Vec3f& dir    = packet.dir[k];
+					const float  rayLen = packet.rayLen[k];
+					const float  eps    = packet.eps[k];
+					for(int j=node.index;j<node.index+node.numSamples;j++)
 					{
 						const Sample& s = samples[j];
-						const Vec3f& p = s.getHitPoint(time);
+						const Vec3f& p = s.getHitPoint<M>(time);
 
 						float t;
-						const Vec3f tp = intersectRayPlane(t, orig,dir, s.getTangentPlane(time));
+						const Vec3f tp = intersectRayPlane(t, orig,dir, s.getTangentPlane<M>(time));
 						const float tpDist = (tp-p).length();			// distance on the tangent plane
 						if(tpDist >= s.radius)							// (extended) ray doesn't hit the splat
 							continue;
@@ -820,19 +2143,80 @@ void ReconstructIndirect::DensityTask::shrink(int taskIdx)
 							continue;
 						}
 
-						samples[j].radius = tpDist;						// NOTE: theoretically this doesn't work with multicore, probably OK in practice
-						//samples[j].color = Vec3f(0,0,1);				// DEBUG visualization: make the shrank splats blue
-						m_numShrank++;
+						ShrinkHit& hit = m_shrinkHits.add();			// radii are tested as they were before shrinking
+						hit.index  = j;
+						hit.radius = tpDist;
 					}
 				}
-				else
+			}
+			else
+			{
+				for(int c=node.index;c<node.index+2;c++)
 				{
-					stack.add( node.child0 );
-					stack.add( node.child1 );
+					stack.add(c);
+					m_scope->decodeCompactNode<M>(stackBounds.add(), c, bounds);
+					stackMasks.add(mask);
 				}
 			}
 		}
 	}
+	m_busyTime = timer.getElapsed();
+}
+
+void ReconstructIndirect::buildShrinkPackets(void)
+{
+	// Rays of the same pixel start from nearly the same origin. Group them by pixel and direction
+	// octant, and cut each group into packets.
+
+	const int w = m_sbuf->getWidth();
+	Array<RadixSortEntry> order(NULL, m_samples.getSize());
+	for(int i=0;i<m_samples.getSize();i++)
+	{
+		const Sample& s = m_samples[i];
+		const Vec3f   d = s.sec_hitpoint - s.sec_origin;
+		const int octant = (d.x<0 ? 1 : 0) | (d.y<0 ? 2 : 0) | (d.z<0 ? 4 : 0);
+		const int pixel  = (int)floor(s.xy[1])*w + (int)floor(s.xy[0]);
+		order[i].key   = (U64(U32(pixel) ^ 0x80000000u) << 3) | octant;	// signed -> unsigned order
+		order[i].value = i;
+	}
+	radixSort(order, true);
+
+	m_shrinkOrder.reset(order.getSize());
+	m_shrinkPackets.clear();
+	for(int k=0;k<order.getSize();k++)
+	{
+		m_shrinkOrder[k] = order[k].value;
+		if(k==0 || order[k].key!=order[k-1].key || k-m_shrinkPackets.getLast()==ShrinkPacket::WIDTH)
+			m_shrinkPackets.add(k);
+	}
+	m_shrinkPackets.add(order.getSize());
+}
+
+int ReconstructIndirect::applyShrinkHits(const Array<DensityTask>& tasks)
+{
+	// Each splat shrinks to the closest ray that hit it. The minimum doesn't depend on the order of
+	// the hits, so the result doesn't depend on the number of threads or their timing either.
+
+	Array<float> radii(NULL, m_samples.getSize());
+	for(int i=0;i<m_samples.getSize();i++)
+		radii[i] = m_samples[i].radius;
+
+	for(int t=0;t<tasks.getSize();t++)
+	{
+		const Array<DensityTask::ShrinkHit>& hits = tasks[t].m_shrinkHits;
+		for(int k=0;k<hits.getSize();k++)
+			radii[hits[k].index] = min(radii[hits[k].index], hits[k].radius);
+	}
+
+	int numShrank = 0;
+	for(int i=0;i<m_samples.getSize();i++)
+	if(radii[i] < m_samples[i].radius)
+	{
+		m_samples[i].radius = radii[i];
+		//m_samples[i].color = Vec3f(0,0,1);					// DEBUG visualization: make the shrank splats blue
+		numShrank++;
+	}
+	return numShrank;
 }
 
 //-----------------------------------------------------------------------
@@ -848,9 +2232,7 @@ void ReconstructIndirect::FilterTask::filter(int y)
 
 	const int w = sbuf.getWidth ();
 	const int h = sbuf.getHeight();
-	const int n = sbuf.getNumSamples()/SUBSAMPLE_SBUF;
 	FW_UNREF(h);
-	FW_UNREF(n);
 
 	const int xmin = this->m_scope->m_scissor[0];
 	const int xmax = this->m_scope->m_scissor[2];
@@ -862,6 +2244,7 @@ void ReconstructIndirect::FilterTask::filter(int y)
 	for(int x=0;x<w;x++)
 	{
 		Vec2f duv(random.getF32(),random.getF32());
+		const int n = sbuf.getNumSamples(x,y)/SUBSAMPLE_SBUF;		// varies per pixel in irregular buffers
 
 	#ifdef EXPORT_HEMISPHERE
 		if(!EXPORT_HEMISPHERE)
@@ -881,6 +2264,14 @@ void ReconstructIndirect::FilterTask::filter(int y)
 			continue;
 		}
 
+		if(n==0)										// empty pixel of an irregular buffer, invalid color is black
+		{
+			m_image->setVec4f(Vec2i(x,y),Vec4f(0,0,0,1));
+			if(m_debugImage)
+				m_debugImage->setVec4f(Vec2i(x,y),Vec4f(0,0,0,1));
+			continue;
+		}
+
 		//---------------------------------------------------------------
 
 		clearNumUniqueInputSamplesUsed();
@@ -897,16 +2288,16 @@ void ReconstructIndirect::FilterTask::filter(int y)
 		const int N = hemisphereSize.x * hemisphereSize.y;
 	#else
 		// baseline scenario
-		const int N = m_scope->m_numReconstructionRays / n;		// # samples to take
+		const int N = m_scope->m_numReconstructionRays / max(n,1);	// # samples to take
 		for( ;i<n;i++)		
-		if(isSecondaryOriginValid(sbuf,x,y,i))
+		if(isSecondaryOriginValid(sbuf,m_scope->m_cidSecOrigin,x,y,i))
 	#endif
 		{
 			// data at the origin of the secondary ray
 			const float eps = 1e-3f;																// TODO: theoretically this could be 0 (and apparently is in PBRT)
-			const Vec3f normal = sbuf.getSampleExtra<Vec3f>(CID_PRI_NORMAL,  x,y,i);				// orientation of hemisphere
-			const Vec3f origin = sbuf.getSampleExtra<Vec3f>(CID_SEC_ORIGIN,  x,y,i) + eps*normal;	// shoot secondary from here
-			      Vec3f albedo = sbuf.getSampleExtra<Vec3f>(CID_ALBEDO,      x,y,i);				// albedo (needed once incident light has been computed)
+			const Vec3f normal = sbuf.getSampleExtra<Vec3f>(m_scope->m_cidPriNormal, x,y,i);				// orientation of hemisphere
+			const Vec3f origin = sbuf.getSampleExtra<Vec3f>(m_scope->m_cidSecOrigin, x,y,i) + eps*normal;	// shoot secondary from here
+			      Vec3f albedo = sbuf.getSampleExtra<Vec3f>(m_scope->m_cidAlbedo,    x,y,i);				// albedo (needed once incident light has been computed)
 			const Mat3f unitHemisphereToCamera = orthogonalBasis(normal);							// hemisphere -> camera coordinates
 
 			if(ambientOcclusion)
@@ -987,9 +2378,7 @@ void ReconstructIndirect::FilterTask::filterPBRT(int y)
 
 	const int w = sbuf.getWidth ();
 	const int h = sbuf.getHeight();
-	const int n = sbuf.getNumSamples()/SUBSAMPLE_SBUF;
 	FW_UNREF(h);
-	FW_UNREF(n);
 
 	const int xmin = this->m_scope->m_scissor[0];
 	const int xmax = this->m_scope->m_scissor[2];
@@ -1114,9 +2503,7 @@ void ReconstructIndirect::FilterTask::filterDofMotion(int y)
 
 	const int w = sbuf.getWidth ();
 	const int h = sbuf.getHeight();
-	const int n = sbuf.getNumSamples()/SUBSAMPLE_SBUF;
 	FW_UNREF(h);
-	FW_UNREF(n);
 
 	Mat4f screenToFocusPlane;
 	screenToFocusPlane.set(sbuf.getPixelToFocalPlaneMatrix());
@@ -1265,7 +2652,7 @@ Vec4f ReconstructIndirect::FilterTask::sampleRadiance(const Vec3f& o,const Vec3f
 			{
 				m_vMFSupport = maxWeight;
 				const Sample& s = m_scope->m_samples[ rs[maxIndex].index ];
-				const float cosangle = dot(lp.dir,(s.getHitPoint(lp.time)-s.sec_origin).normalized());	// 0,1
+				const float cosangle = dot(lp.dir,(m_scope->getHitPoint(s,lp.time)-s.sec_origin).normalized());	// 0,1
 				m_vMFAngle = acos( clamp(cosangle,0.f,1.f) ) / (FW_PI/2);	// angle between the vectors [0,1]
 			}
 
@@ -1302,9 +2689,19 @@ Vec4f ReconstructIndirect::FilterTask::sampleRadiance(const Vec3f& o,const Vec3f
 }
 
 void ReconstructIndirect::FilterTask::collectSamples(const LocalParameterization& lp)
+{
+	if(m_scope->m_motionEnabled)	collectSamplesImpl<MovingScene>(lp);
+	else							collectSamplesImpl<StaticScene>(lp);
+}
+
+template<class M>
+void ReconstructIndirect::FilterTask::collectSamplesImpl(const LocalParameterization& lp)
 {
 	const Array<Sample>& samples  = m_scope->m_samples;
 	const Array<Node>&	hierarchy = m_scope->m_hierarchy;
+	const Array<ClipBox>& clipBoxes = m_scope->m_clipBoxes;
+	const Array<WideNode>& wideHierarchy = m_scope->m_wideHierarchy;
+	const Array<WideNode::Bounds>& wideHierarchyT1 = m_scope->m_wideHierarchyT1;
 
 	const Vec3f& idir   = lp.idir;
 	const Vec3f& ood    = lp.ood;
@@ -1324,31 +2721,35 @@ void ReconstructIndirect::FilterTask::collectSamples(const LocalParameterization
 
 	rs.clear();
 	stack.clear();
-	stack.add(ROOT);
+	stack.add(wideHierarchy.getSize() ? ROOT : ~ROOT);	// a lone leaf has no wide node
 
 	while(stack.getSize())
 	{
 		m_stats.numTraversalSteps[0]++;
-		const int nodeIndex = stack.removeLast();
-		const Node& node = hierarchy[nodeIndex];
+		const int entry = stack.removeLast();			// wide node index, or ~leaf index in the binary hierarchy
 		const float eps = 1e-3f * orig.length();		// PBRT epsilon: 1e-3f * distance of previous ray. We're in camera space, meaning the primary ray is (0,0,0)->lp.orig...
 
-		if(node.isLeaf())
+		if(entry < 0)
 		{
+			const Node& node = hierarchy[~entry];
 			m_stats.numSamplesTested[0] += node.ns;
 			for(int sidx=node.s0;sidx<node.s1;sidx++)
 			{
 				const Sample& s = samples[sidx];		// a sample whose SECONDARY HITPOINT is near our query ray
-				const Vec3f& p = s.getHitPoint(time);
+				const Vec3f& p = s.getHitPoint<M>(time);
 
 				// intersection point on the sample's tangent plane
 				float t;
-				const Vec3f tp = intersectRayPlane(t, orig,dir, s.getTangentPlane(time));	// intersection point on sample's tangent plane
+				const Vec3f tp = intersectRayPlane(t, orig,dir, s.getTangentPlane<M>(time));	// intersection point on sample's tangent plane
 				const float f  = (tp-p).length() / s.radius;
 
 				// intersects the splat and t>0
 				if(f<1.f && t>eps)
 				{
+					// a split splat is hit through the one reference whose cell contains the hit point
+					if(clipBoxes.getSize() && !clipBoxes[sidx].contains(tp))
+						continue;
+
 					const bool backface = dot(s.sec_normal, p-orig) >= 0;
 
 	#ifdef ENABLE_BACKFACE_CULLING
@@ -1377,10 +2778,10 @@ void ReconstructIndirect::FilterTask::collectSamples(const LocalParameterization
 		else
 		{
 			// intersect child nodes (since we collect all samples, sorting wouldn't help)
-			const int nodeIdx0 = node.child0;
-			const int nodeIdx1 = node.child1;
-			if( hierarchy[nodeIdx0].intersect(idir,ood,time) )	stack.add( nodeIdx0 );
-			if( hierarchy[nodeIdx1].intersect(idir,ood,time) )	stack.add( nodeIdx1 );
+			const WideNode& node = wideHierarchy[entry];
+			const int hits = node.intersect<M>(idir,ood,time, M::MOTION ? wideHierarchyT1[entry] : node.bounds);
+			for(int k=0;k<node.numChildren;k++)
+				if(hits & (1<<k))	stack.add( node.child[k] );
 		}
 	}
 
@@ -1461,18 +2862,18 @@ Vec2i ReconstructIndirect::FilterTask::getNextSurface(Vec2i samplesInPrevSurface
 				// - angle1<=0 && angle2<=0
 				// - z difference is smaller than the min/average size of splats (not sure how exactly to do this)
 
-				const float cosAngle1 = dot(normal1, (sa2.getHitPoint(time)-sa1.getHitPoint(time)).normalized());	// cos(n1,sep)
-				const float cosAngle2 = dot(normal2, (sa1.getHitPoint(time)-sa2.getHitPoint(time)).normalized());
+				const float cosAngle1 = dot(normal1, (m_scope->getHitPoint(sa2,time)-m_scope->getHitPoint(sa1,time)).normalized());	// cos(n1,sep)
+				const float cosAngle2 = dot(normal2, (m_scope->getHitPoint(sa1,time)-m_scope->getHitPoint(sa2,time)).normalized());
 				const float eps = sin(2*FW_PI/180);
 				if( (cosAngle1+eps)>=0 && (cosAngle2+eps)>=0 )	continue;
 				if( (cosAngle1-eps)<=0 && (cosAngle2-eps)<=0 )	continue;
 //				if( fabs(rs[i].zdist-rs[j].zdist) < (sa1.size+sa2.size)/2 )	continue;
-				if( fabs(dot(sa1.getTangentPlane(time),Vec4f(sa2.getHitPoint(time),1))) < min(sa1.radius,sa2.radius) )	continue;
+				if( fabs(dot(m_scope->getTangentPlane(sa1,time),Vec4f(m_scope->getHitPoint(sa2,time),1))) < min(sa1.radius,sa2.radius) )	continue;
 				bConflict = true;
 
 /*				// OPTION 2: alternative interpretation, which is explained in the paper
-				const Vec3f p1 = sa1.getHitPoint(time);
-				const Vec3f p2 = sa2.getHitPoint(time);
+				const Vec3f p1 = m_scope->getHitPoint(sa1,time);
+				const Vec3f p2 = m_scope->getHitPoint(sa2,time);
 				const Vec4f plane1(normal1, -dot(normal1,p1));
 				const Vec4f plane2(normal2, -dot(normal2,p2));
 				const Vec3f sep  = p2-p1;	// 1->2
@@ -27,30 +27,21 @@
 
 #pragma once
 #include "Reconstruction.hpp"
+#include "base/BinaryHeap.hpp"
+#include <xmmintrin.h>
 
 
 namespace FW
 {
 //#define ENABLE_BACKFACE_CULLING			// PBRT does not use backface culling. Disabled by default.
 
-static int CID_PRI_MV      ;
-static int CID_PRI_NORMAL  ;
-static int CID_ALBEDO      ;
-static int CID_SEC_ORIGIN  ;
-static int CID_SEC_HITPOINT;
-static int CID_SEC_MV      ;
-static int CID_SEC_NORMAL  ;
-static int CID_DIRECT      ;
-static int CID_SEC_ALBEDO  ;
-static int CID_SEC_DIRECT  ;
-
 static const float UVPLANE_DISTANCE = 1.f;	// In light field parameterization. This value shouldn't affect the results, kept for debug purposes.
 
 
 class ReconstructIndirect
 {
 public:
-	ReconstructIndirect		(const UVTSampleBuffer& sbuf, int numReconstructionRays, String rayDumpFileName=String(""), float aoLength=0, bool print=true, bool enableCUDA=false, bool enableMotion=false, Vec4i rectangle=Vec4i(0));
+	ReconstructIndirect		(const UVTSampleBuffer& sbuf, int numReconstructionRays, String rayDumpFileName=String(""), float aoLength=0, bool print=true, bool enableCUDA=false, bool enableMotion=false, Vec4i rectangle=Vec4i(0), Reconstruction::Builder builder=Reconstruction::BUILDER_MORTON, bool spatialSplits=false, bool motionPartition=false, Reconstruction::DensityEngine density=Reconstruction::DENSITY_EXACT);
 	void	filterImage		(Image& image, Image* debugImage);
 	
 	void	filterImageCuda	(Image& image);
@@ -67,10 +58,25 @@ private:
 		K1					= 12,
 		K2					= 12,
 		ANISOTROPIC_SCALE	= 2,
-		NUM_DENSITY_TASKS	= 32,
+		CHUNKS_PER_WORKER	= 16,				// density and shrink passes hand out this many chunks of samples per worker
+		BUILD_SPLIT_LEVELS	= 3,				// octree levels above the subtrees that are built in parallel
+		REFIT_CHUNK_SIZE	= 1024,				// nodes per refit task
+		RESTRUCTURE_PASSES	= 3,				// at most, stops when the SAH cost improves by less than 1%
+		SPLIT_RADIUS_SCALE	= 4,				// splats larger than this times the average radius are split
+		MAX_SPLITS_PER_AXIS	= 4,
+		NUM_PROBE_RAYS		= 4096,				// for reporting the effect of splitting
+		KNN_BATCH_SIZE		= 16,				// consecutive samples that search their neighbours together
+		KNN_EMERGENCY_BREAK	= 1000,				// stop searching if not found the requested kind of samples within this amount of work
+		GRID_RINGS			= 1,				// grid KNN: rings of cells around the sample's own that are searched, at least
+		GRID_MAX_RINGS		= 4,				// grid KNN: fall back to the hierarchy search if the K1 nearest are not certain by then
+		GRID_ERROR_PROBES	= 4096,				// grid KNN: samples compared against the exact search
 		NUM_SAMPLE_COUNTERS = 10,
 	};
 
+	static const float VMF_THRESHOLD_MAX;		// KNN: we're really happy if we get this, but if not, we'll lower it until things work out
+	static const float VMF_THRESHOLD_SCALE;
+	static const float KNN_TIME;				// densities are computed @ t=0.5
+
 	enum BloatMode
 	{
 		SPHERE,
@@ -78,11 +84,13 @@ private:
 		POINT
 	};
 
-	struct SortEntry
-	{
-		U64		code;			// morton
-		Vec3i	idx;			// index in sample buffer
-	};
+	// Motion policies. The hot loops are instantiated for both, and each reconstruction picks one.
+
+	struct StaticScene	{ enum { MOTION = 0 }; };
+	struct MovingScene	{ enum { MOTION = 1 }; };
+
+	typedef RadixSortEntry SortEntry;	// key = morton code, value = sample index in sample buffer
+	static const U64 MOVING_BIT = U64(1) << 63;		// above the morton code, while partitioning static and moving samples
 
 	struct Node
 	{
@@ -101,21 +109,23 @@ private:
 			bbmaxT1= max(n0.bbmaxT1,n1.bbmaxT1);
 		};
 
+		// The t=1 bounds of a static scene equal the t=0 ones, so the areas can always interpolate.
 		inline float	getExpectedCost(float t) const							{ return ns *  getSurfaceArea(t); }
-		inline float	getSurfaceArea(float t) const							{ const Vec3f bb = getBBMax(t)-getBBMin(t); return 2*(bb.x*bb.y + bb.y*bb.z + bb.z*bb.x); }	// box
-		inline Vec3f	getCenter(float t) const								{ return (getBBMin(t)+getBBMax(t))/2.f; }
-		inline float	getRadius(float t) const								{ return (getBBMax(t)-getBBMin(t)).length()/2.f; }
-		inline float	getDistance(const Vec3f& p,float t) const				{ return max(getBBMin(t)-p, p-getBBMax(t), Vec3f(0)).length(); }							// Thanks, Eberly
-		inline bool		inside(const Vec3f& p,float t) const					{ return (p.x>=getBBMin(t).x && p.x<=getBBMax(t).x) && (p.y>=getBBMin(t).y && p.y<=getBBMax(t).y) && (p.z>=getBBMin(t).z && p.z<=getBBMax(t).z); }
-
-		inline float	getFarthestCornerDist(const Vec4f& pleq,float t) const	{ return dot(pleq, Vec4f((pleq.x>=0 ? getBBMax(t).x : getBBMin(t).x), (pleq.y>=0 ? getBBMax(t).y : getBBMin(t).y), (pleq.z>=0 ? getBBMax(t).z : getBBMin(t).z), 1)); }
-		inline float	getNearestCornerDist (const Vec4f& pleq,float t) const	{ return dot(pleq, Vec4f((pleq.x<=0 ? getBBMax(t).x : getBBMin(t).x), (pleq.y<=0 ? getBBMax(t).y : getBBMin(t).y), (pleq.z<=0 ? getBBMax(t).z : getBBMin(t).z), 1)); }
-
-		inline bool intersect(const Vec3f& idir,const Vec3f& ood,float t) const	{ float tenter; return intersect(tenter,idir,ood,t); }
-		inline bool intersect(float& tenter, const Vec3f& idir,const Vec3f& ood,float time) const
+		inline float	getSurfaceArea(float t) const							{ const Vec3f bb = getBBMax<MovingScene>(t)-getBBMin<MovingScene>(t); return 2*(bb.x*bb.y + bb.y*bb.z + bb.z*bb.x); }	// box
+		inline float	getAverageSurfaceArea() const							{ return 0.5f*(getSurfaceArea(0.f) + getSurfaceArea(1.f)); }	// over the shutter interval
+		template<class M> inline Vec3f	getCenter(float t) const								{ return (getBBMin<M>(t)+getBBMax<M>(t))/2.f; }
+		template<class M> inline float	getRadius(float t) const								{ return (getBBMax<M>(t)-getBBMin<M>(t)).length()/2.f; }
+		template<class M> inline float	getDistance(const Vec3f& p,float t) const				{ return max(getBBMin<M>(t)-p, p-getBBMax<M>(t), Vec3f(0)).length(); }							// Thanks, Eberly
+		template<class M> inline bool	inside(const Vec3f& p,float t) const					{ return (p.x>=getBBMin<M>(t).x && p.x<=getBBMax<M>(t).x) && (p.y>=getBBMin<M>(t).y && p.y<=getBBMax<M>(t).y) && (p.z>=getBBMin<M>(t).z && p.z<=getBBMax<M>(t).z); }
+
+		template<class M> inline float	getFarthestCornerDist(const Vec4f& pleq,float t) const	{ return dot(pleq, Vec4f((pleq.x>=0 ? getBBMax<M>(t).x : getBBMin<M>(t).x), (pleq.y>=0 ? getBBMax<M>(t).y : getBBMin<M>(t).y), (pleq.z>=0 ? getBBMax<M>(t).z : getBBMin<M>(t).z), 1)); }
+		template<class M> inline float	getNearestCornerDist (const Vec4f& pleq,float t) const	{ return dot(pleq, Vec4f((pleq.x<=0 ? getBBMax<M>(t).x : getBBMin<M>(t).x), (pleq.y<=0 ? getBBMax<M>(t).y : getBBMin<M>(t).y), (pleq.z<=0 ? getBBMax<M>(t).z : getBBMin<M>(t).z), 1)); }
+
+		template<class M> inline bool intersect(const Vec3f& idir,const Vec3f& ood,float t) const	{ float tenter; return intersect<M>(tenter,idir,ood,t); }
+		template<class M> inline bool intersect(float& tenter, const Vec3f& idir,const Vec3f& ood,float time) const
 		{
-			const Vec3f ta = getBBMin(time) * idir - ood;	// inaccurate -- the node needs to have been bloated a little bit
-			const Vec3f tb = getBBMax(time) * idir - ood;
+			const Vec3f ta = getBBMin<M>(time) * idir - ood;	// inaccurate -- the node needs to have been bloated a little bit
+			const Vec3f tb = getBBMax<M>(time) * idir - ood;
 			const Vec3f t0 = min(ta,tb);				// minimum of per-axis enter times
 			const Vec3f t1 = max(ta,tb);				// maximum of per-axis enter times
 
@@ -132,36 +142,351 @@ private:
 		Vec3f	bbmin,bbmax;	// @ t=0 (not renamed yet because of dependencies)
 		Vec3f	bbminT1,bbmaxT1;// @ t=1
 
-		inline Vec3f		getBBMin(float t) const							{ return (s_motionEnabled) ? bbmin + t*(bbminT1-bbmin) : bbmin; }
-		inline Vec3f		getBBMax(float t) const							{ return (s_motionEnabled) ? bbmax + t*(bbmaxT1-bbmax) : bbmax; }
-		static bool s_motionEnabled;
+		template<class M> inline Vec3f		getBBMin(float t) const			{ return (M::MOTION) ? bbmin + t*(bbminT1-bbmin) : bbmin; }
+		template<class M> inline Vec3f		getBBMax(float t) const			{ return (M::MOTION) ? bbmax + t*(bbmaxT1-bbmax) : bbmax; }
+	};
+
+	struct ClipBox						// half-open region of space owned by a reference of a split splat
+	{
+		Vec3f	lo,hi;
+		inline bool		contains(const Vec3f& p) const		{ return p.x>=lo.x && p.y>=lo.y && p.z>=lo.z && p.x<hi.x && p.y<hi.y && p.z<hi.z; }
+	};
+
+	// Collapsed hierarchy for the all-hits traversal of the CPU filter. The child bounds are stored per
+	// axis (SoA), so that the 4 children are tested at once with SSE. The t=1 bounds are kept in a parallel
+	// array that only moving scenes build, so a static scene traverses 116-byte nodes instead of 212-byte ones.
+	struct WideNode
+	{
+		enum { WIDTH = 4 };
+
+		struct Bounds
+		{
+			inline void	set(int k, const Vec3f& lo, const Vec3f& hi)	{ for(int a=0;a<3;a++) { bbmin[a][k] = lo[a]; bbmax[a][k] = hi[a]; } }
+
+			float	bbmin[3][WIDTH];		// per axis, per child
+			float	bbmax[3][WIDTH];
+		};
+
+		WideNode()												{ numChildren = 0; for(int k=0;k<WIDTH;k++) setChild(k, Node(), 0); }
+
+		inline void	setChild(int k, const Node& node, int ref)	{ bounds.set(k, node.bbmin, node.bbmax); child[k] = ref; }	// the t=1 bounds are set by the caller
+
+		template<class M> inline int	intersect(const Vec3f& idir,const Vec3f& ood,float time,const Bounds& boundsT1) const	// bit mask of the hit children, same test as Node::intersect()
+		{
+			__m128 tenter = _mm_setzero_ps();
+			__m128 texit  = _mm_setzero_ps();
+			for(int a=0;a<3;a++)
+			{
+				__m128 lo = _mm_loadu_ps(bounds.bbmin[a]);
+				__m128 hi = _mm_loadu_ps(bounds.bbmax[a]);
+				if(M::MOTION)
+				{
+					const __m128 t = _mm_set1_ps(time);
+					lo = _mm_add_ps(lo, _mm_mul_ps(t, _mm_sub_ps(_mm_loadu_ps(boundsT1.bbmin[a]), lo)));
+					hi = _mm_add_ps(hi, _mm_mul_ps(t, _mm_sub_ps(_mm_loadu_ps(boundsT1.bbmax[a]), hi)));
+				}
+				const __m128 id = _mm_set1_ps(idir[a]);
+				const __m128 od = _mm_set1_ps(ood[a]);
+				const __m128 ta = _mm_sub_ps(_mm_mul_ps(lo,id), od);
+				const __m128 tb = _mm_sub_ps(_mm_mul_ps(hi,id), od);
+				tenter = _mm_max_ps(tenter, _mm_min_ps(ta,tb));
+				texit  = a ? _mm_min_ps(texit, _mm_max_ps(ta,tb)) : _mm_max_ps(ta,tb);
+			}
+			return _mm_movemask_ps(_mm_cmple_ps(tenter,texit)) & ((1<<numChildren)-1);
+		}
+
+		Bounds	bounds;					// @ t=0
+		int		child[WIDTH];			// wide node index, or ~leaf index in m_hierarchy
+		int		numChildren;
 	};
 
-	Node*		buildRecursive		(const Array<SortEntry>& codes, int& sampleIdx, const int MAX_LEAF, const U64 octreeCode,const int octreeBitPos);
+	// Box quantized to 16 bits per plane relative to the decoded bounds of the parent, conservatively.
+	struct QuantizedBox
+	{
+		void	encode(const Vec3f& bbmin, const Vec3f& bbmax, const Vec3f& parentMin, const Vec3f& parentMax);
+		void	decode(Vec3f& bbmin, Vec3f& bbmax, const Vec3f& parentMin, const Vec3f& parentMax) const;
+
+		U16		lo[3],hi[3];
+	};
+
+	// 20-byte node for the shrinking traversal (vs. 76 bytes). The two children of an inner node are consecutive.
+	// As with WideNode, the t=1 bounds are in a parallel array that only moving scenes build.
+	struct CompactNode
+	{
+		bool	isLeaf() const										{ return numSamples>0; }
+
+		QuantizedBox box;					// @ t=0
+		S32		index;						// first child, or first sample of a leaf
+		S32		numSamples;					// 0 for inner nodes
+	};
+	typedef char CompactNodeSizeCheck[(sizeof(CompactNode) == 20) ? 1 : -1];	// fails to compile if the layout grows
+
+	// Up to four shrink rays of the same pixel and direction octant, traversed together. The box test is
+	// SoA over the rays like WideNode is over the children, the splat tests are per ray.
+	struct ShrinkPacket
+	{
+		enum { WIDTH = 4 };
+
+		inline void	setRay(int k, int i, const Vec3f& o, const Vec3f& d, const Vec3f& id, float t, float len, float e)
+		{
+			for(int a=0;a<3;a++)
+			{
+				idir[a][k] = id[a];
+				ood [a][k] = o[a]*id[a];
+			}
+			time  [k] = t;
+			orig  [k] = o;
+			dir   [k] = d;
+			rayLen[k] = len;
+			eps   [k] = e;
+			index [k] = i;
+		}
+
+		template<class M> inline int	intersect(const Node& node) const	// bit mask of the hit rays, same test as Node::intersect()
+		{
+			const __m128 t = _mm_loadu_ps(time);
+			__m128 tenter = _mm_setzero_ps();
+			__m128 texit  = _mm_setzero_ps();
+			for(int a=0;a<3;a++)
+			{
+				__m128 lo = _mm_set1_ps(node.bbmin[a]);
+				__m128 hi = _mm_set1_ps(node.bbmax[a]);
+				if(M::MOTION)
+				{
+					lo = _mm_add_ps(lo, _mm_mul_ps(t, _mm_sub_ps(_mm_set1_ps(node.bbminT1[a]), lo)));
+					hi = _mm_add_ps(hi, _mm_mul_ps(t, _mm_sub_ps(_mm_set1_ps(node.bbmaxT1[a]), hi)));
+				}
+				const __m128 id = _mm_loadu_ps(idir[a]);
+				const __m128 od = _mm_loadu_ps(ood[a]);
+				const __m128 ta = _mm_sub_ps(_mm_mul_ps(lo,id), od);
+				const __m128 tb = _mm_sub_ps(_mm_mul_ps(hi,id), od);
+				tenter = _mm_max_ps(tenter, _mm_min_ps(ta,tb));
+				texit  = a ? _mm_min_ps(texit, _mm_max_ps(ta,tb)) : _mm_max_ps(ta,tb);
+			}
+			return _mm_movemask_ps(_mm_cmple_ps(tenter,texit)) & ((1<<numRays)-1);
+		}
+
+		float	idir  [3][WIDTH];		// per axis, per ray
+		float	ood   [3][WIDTH];
+		float	time  [WIDTH];
+		Vec3f	orig  [WIDTH];			// for the splat tests
+		Vec3f	dir   [WIDTH];			// unit length
+		float	rayLen[WIDTH];
+		float	eps   [WIDTH];
+		int		index [WIDTH];			// in m_samples
+		int		numRays;
+	};
+
+	int			ingestSamples		(Array<SortEntry>& codes, bool partitionMotion, bool print);	// returns the first moving sample if partitioned
+	void		buildHierarchy		(const Array<SortEntry>& codes, int firstMoving=-1);
+	bool		buildSubtree		(Node& root, const Array<SortEntry>& codes, int begin, int end);	// nodes below the root are added to m_hierarchy
 	float		getHierarchyArea	(int nodeIdx, bool leafOnly=false) const;
-	void		validateNodeBounds	(int nodeIdx, BloatMode mode);
+	void		relayoutHierarchy	(void);								// depth-first nodes and samples, rebuilds the refit levels
+	void		buildRefitLevels	(void);
+	void		validateNodeBounds	(BloatMode mode);					// refits the whole hierarchy bottom-up
+	void		refitNode			(int nodeIdx, BloatMode mode);		// from its samples or its (refit) children
+	float		getSAHCost			(void) const;						// relative to the root, unit traversal and sample costs
+	void		restructureHierarchy(void);
+	void		rotateNode			(int nodeIdx);
+	void		splitOversizedSplats(bool print);
+	void		buildWideHierarchy	(void);								// from the final binary hierarchy
+	void		buildCompactHierarchy(void);							// from the current binary hierarchy
+	void		encodeCompactNode	(int index, const Node& node, Node& decoded, const Node& parent);	// decoded = as seen by the traversal
+
+	template<class M> inline void	decodeCompactNode(Node& bounds, int index, const Node& parent) const	// only the bounds of the result are valid
+	{
+		m_compactHierarchy[index].box.decode(bounds.bbmin, bounds.bbmax, parent.bbmin, parent.bbmax);
+		if(M::MOTION)
+			m_compactHierarchyT1[index].decode(bounds.bbminT1, bounds.bbmaxT1, parent.bbminT1, parent.bbmaxT1);
+	}
+	void		buildShrinkPackets	(void);								// m_shrinkOrder and m_shrinkPackets
+	float		getTraversalSteps	(const Array<Vec3f>& probes) const;	// per (origin,direction) pair
 
 	struct ReconSample;
 
+	// Dynamic scheduling of the per-sample passes. Each worker grabs the next chunk of samples until none are
+	// left, so the workers that get cheap samples take over the work of the ones that get expensive ones.
+
+	class ChunkQueue
+	{
+	public:
+		void	init	(int numItems, int numWorkers, int granularity);	// chunk size is a multiple of granularity
+		bool	next	(int& lo, int& hi);									// [lo,hi) of the next chunk, false when all are taken
+
+	private:
+		Spinlock	m_lock;
+		int			m_numItems;
+		int			m_chunkSize;
+		int			m_next;
+	};
+
 	class DensityTask
 	{
 	public:
-		void	init(ReconstructIndirect* scope) { m_scope = scope; }
+		void	init(ReconstructIndirect* scope) { m_scope = scope; m_numSteps = m_numLeaf = m_numIter = m_numSelfHits = m_numFallbacks = m_numIsolated = 0; m_averageVMF = 0; m_busyTime = 0; }
+
+		struct StackEntry
+		{
+			StackEntry()							{ }
+			StackEntry(int i,float d)				{ index=i; dist=d; }
+			bool	operator<(const StackEntry& s)	{ return dist<s.dist; }
+			int		index;		// m_hierarchy
+			float	dist;		// distance to node
+		};
+
+		struct Neighbors		// K1 nearest so far, sorted by increasing distance
+		{
+			void	clear			()					{ num = 0; }
+			float	getThreshold	() const			{ return (num==K1) ? dist[K1-1] : FW_F32_MAX; }	// anything larger than this is of no interest
+			void	add				(float d, int i)
+			{
+				if(num==K1 && d>=dist[K1-1])
+					return;
+				int k = (num<K1) ? num++ : K1-1;		// replace previous _largest_ (of K smallest)
+				for(;k>0 && dist[k-1]>d;k--)
+				{
+					dist [k] = dist [k-1];
+					index[k] = index[k-1];
+				}
+				dist [k] = d;
+				index[k] = i;
+			}
+
+			float	dist [K1];
+			int		index[K1];		// in m_samples
+			int		num;
+		};
+
+		static	void	prepare			(MulticoreLauncher::Task& task) { DensityTask* ttask = (DensityTask*)task.data; ttask->prepare(task.idx); }
+				void	prepare			(int taskIdx);		// per-sample KNN inputs
 
 		static	void	compute			(MulticoreLauncher::Task& task) { DensityTask* ttask = (DensityTask*)task.data; ttask->compute(task.idx); }
 				void	compute			(int taskIdx);
+		template<class M>	void	computeImpl		(int taskIdx);
+		template<class M>	void	computeBatch	(int first, int last, BinaryHeap<StackEntry>& heap, Array<float>& distances);
+		template<class M>	void	computeSample	(int i, float firstThreshold, BinaryHeap<StackEntry>& heap, Array<float>& distances);
+							void	setRadius		(int i, const Neighbors& nb, Array<float>& distances);
+
+		static	void	computeGrid		(MulticoreLauncher::Task& task) { DensityTask* ttask = (DensityTask*)task.data; ttask->computeGrid(task.idx); }
+				void	computeGrid		(int taskIdx);		// from m_gridSamples
+		template<class M>	void	computeGridImpl	(int taskIdx);
+				void	computeExact	(int i);			// radius of a single sample
+
+		struct ShrinkHit
+		{
+			int		index;		// in m_samples
+			float	radius;		// distance from the splat's center to the ray on its tangent plane
+		};
 
 		static	void	shrink			(MulticoreLauncher::Task& task) { DensityTask* ttask = (DensityTask*)task.data; ttask->shrink(task.idx); }
 				void	shrink			(int taskIdx);
+		template<class M>	void	shrinkImpl		(int taskIdx);
 
 		ReconstructIndirect*	m_scope;
 
 		U64		m_numSteps;
 		U64		m_numLeaf;
 		U64		m_numIter;
-		U64		m_numShrank;
 		U64		m_numSelfHits;
+		U64		m_numFallbacks;		// grid KNN samples that needed the exact search
+		U64		m_numIsolated;		// samples without any neighbour, see assignIsolatedRadii()
 		double	m_averageVMF;
+		F32		m_busyTime;			// seconds until the worker ran out of chunks
+		Array<ShrinkHit> m_shrinkHits;	// samples are not written while shrinking, see applyShrinkHits()
+	};
+
+	void		printBusyTimes		(const Array<DensityTask>& tasks) const;
+	int			applyShrinkHits		(const Array<DensityTask>& tasks);	// returns the number of splats that shrank
+	float		assignIsolatedRadii	(void);								// returns the radius given to samples without neighbours
+
+	// Hashed uniform grid over m_knnPoints for the grid density engine. The cell size is chosen so that a
+	// cell holds about K1 samples of a locally flat surface. A search grows ring by ring until the K1 nearest
+	// are certain, so it finds the same neighbours as the hierarchy search at VMF_THRESHOLD_MAX.
+	void		buildDensityGrid	(void);
+	void		reportGridError		(void);								// radii vs. the exact engine, on a subset of samples
+	Vec3i		getGridCell			(const Vec3f& p) const				{ const Vec3f c = (p-m_gridOrigin) / m_gridCellSize; return Vec3i((S32)floor(c.x),(S32)floor(c.y),(S32)floor(c.z)); }
+	int			getGridBucket		(const Vec3i& c) const				{ return int(((U32)c.x*73856093u) ^ ((U32)c.y*19349663u) ^ ((U32)c.z*83492791u)) & m_gridMask; }
+
+	// Parallel ingest of the sample buffer. scan() counts the valid samples of a scanline and bounds their
+	// hit points at t=0, encode() writes their Morton codes to the scanline's range of m_codes, and
+	// gather() copies a range of the sorted samples to m_samples.
+	class IngestTask
+	{
+	public:
+		void	init(ReconstructIndirect* scope, bool knownBounds, bool ingested);
+
+		static	void	scan			(MulticoreLauncher::Task& task) { IngestTask* ttask = (IngestTask*)task.data; ttask->scan(task.idx); }
+				void	scan			(int y);
+
+		static	void	encode			(MulticoreLauncher::Task& task) { IngestTask* ttask = (IngestTask*)task.data; ttask->encode(task.idx); }
+				void	encode			(int y);
+
+		static	void	gather			(MulticoreLauncher::Task& task) { IngestTask* ttask = (IngestTask*)task.data; ttask->gather(task.idx); }
+				void	gather			(int chunk);
+
+		ReconstructIndirect*	m_scope;
+		bool					m_knownBounds;	// bbox given by the sample buffer's statistics
+		bool					m_ingested;		// t=0 hit points precomputed by the sample buffer
+		bool					m_partitionMotion;	// moving samples get MOVING_BIT in encode()
+		Vec3f					m_bbmin;		// quantization bounds for encode()
+		Vec3f					m_bbmax;
+		int						m_numChunks;	// for gather()
+		Array<SortEntry>*		m_codes;
+
+		Array<int>				m_rowFirst;		// first code of each scanline
+		Array<int>				m_rowValid;		// number of valid samples in each scanline
+		Array<int>				m_rowInvalid;
+		Array<Vec3f>			m_rowMin;		// bounds of each scanline's valid hit points @ t=0
+		Array<Vec3f>			m_rowMax;
+	};
+
+	// Refits (or rotates) a range of nodes of one level of m_refitOrder. The nodes of a level are independent.
+	class RefitTask
+	{
+	public:
+		void	init(ReconstructIndirect* scope, BloatMode mode, int first, int last, bool rotate=false);
+
+		static	void	refit			(MulticoreLauncher::Task& task) { RefitTask* ttask = (RefitTask*)task.data; ttask->refit(task.idx); }
+				void	refit			(int chunk);
+
+		ReconstructIndirect*	m_scope;
+		BloatMode				m_mode;
+		bool					m_rotate;		// rotateNode() instead of refitNode()
+		int						m_first;		// range in m_refitOrder
+		int						m_last;
+		int						m_numChunks;
+	};
+
+	// Builds the hierarchy of one octree cell into a node array. The subtrees below BUILD_SPLIT_LEVELS are
+	// built in parallel into their own arrays, and spliced in by the task that builds the top levels.
+	class BuildTask
+	{
+	public:
+		void	init(ReconstructIndirect* scope, const Array<SortEntry>* codes, Array<Node>* nodes, const Array<BuildTask>* subtrees, int first, int end, U64 octreeCode, int octreeBitPos);
+
+		static	void	build			(MulticoreLauncher::Task& task) { BuildTask* ttask = (BuildTask*)task.data; ttask->build(); }
+				void	build			(void);
+
+		bool	buildRecursive			(Node& node, int& sampleIdx, const U64 octreeCode,const int octreeBitPos);
+		bool	splice					(Node& node, int& sampleIdx, const BuildTask& subtree);
+
+		ReconstructIndirect*	m_scope;
+		const Array<SortEntry>*	m_codes;
+		Array<Node>*			m_nodes;		// output, child indices are relative to this
+		const Array<BuildTask>*	m_subtrees;		// cells at BUILD_SPLIT_LEVELS, NULL if this is one of them
+		int						m_first;		// samples [m_first,m_last)
+		int						m_last;
+		int						m_end;			// of the codes this task may consume
+		U64						m_octreeCode;
+		int						m_octreeBitPos;
+
+		Array<Node>				m_arena;		// nodes of a subtree
+		Node					m_root;			// not in the node array
+		bool					m_valid;		// false if the cell is empty
+
+		int						m_numSamples;	// STATS
+		int						m_numLeafNodes;
+		int						m_numMixedLeaf;
 	};
 
 public:
@@ -197,7 +522,7 @@ public:
 			float anglecos = dot( splatDir, -d );
 
 			// Support of von Mises-Fischer to the query direction
-			float bw = vMFfromBandwidth( m_scope->m_sbuf->getSampleW( s.origIndex.x, s.origIndex.y, s.origIndex.z ) );
+			float bw = vMFfromBandwidth( m_scope->m_sbuf->getSampleW( s.origIndex ) );
 			float vMF = expf( bw * anglecos - bw );	// vMF but normalized to [0,1]
 
 			// Scale the vMF support based on a near field tweak. How large is the splat compared to the length of the ray?
@@ -308,7 +633,7 @@ public:
 				const ReconSample& r = samples[i];
 				const Sample& s = m_scope->m_samples[ r.index ];
 
-				const Vec3f pip = intersectRayPlane(lp.orig,(s.getHitPoint(lp.time)-lp.orig), lp.uvplane);	// intersection point in camera space
+				const Vec3f pip = intersectRayPlane(lp.orig,(m_scope->getHitPoint(s,lp.time)-lp.orig), lp.uvplane);	// intersection point in camera space
 				const Vec2f xy  = (lp.cameraToUVPlane * pip).getXY();										// on the UV plane
 				const float R   = UVPLANE_DISTANCE * s.radius / r.zdist;									// project the (isotropic) size to splane
 
@@ -346,6 +671,7 @@ public:
 		}
 
 		void	collectSamples	(const LocalParameterization& lp);
+		template<class M> void	collectSamplesImpl	(const LocalParameterization& lp);
 		Vec2i	getNextSurface	(Vec2i samplesInPrevSurface, const LocalParameterization& lp);
 
 		static inline int	ternaryCompare	(float a, float b, float eps)	{ return (fabs(a-b)<eps) ? 0 : (a<b ? -1 : 1); }	// 0==don't care
@@ -367,8 +693,8 @@ public:
 public:
 	struct Sample
 	{
-		inline Vec4f		getTangentPlane(float time) const	{ return Vec4f(sec_normal, -dot(sec_normal,getHitPoint(time))); }	// @ secondary hit point
-		inline Vec3f		getHitPoint(float time) const		{ return (s_motionEnabled) ? sec_hitpoint + (time-t)*sec_mv : sec_hitpoint; }
+		template<class M> inline Vec4f	getTangentPlane(float time) const	{ return Vec4f(sec_normal, -dot(sec_normal,getHitPoint<M>(time))); }	// @ secondary hit point
+		template<class M> inline Vec3f	getHitPoint(float time) const		{ return (M::MOTION) ? sec_hitpoint + (time-t)*sec_mv : sec_hitpoint; }
 
 		Vec2f	xy;
 		float	t;
@@ -383,12 +709,15 @@ public:
 		Vec3f   sec_albedo;
 		Vec3f   sec_direct;
 
-		Vec3i	origIndex;		// for experimentation, indexes input samplebuffer
+		int		origIndex;		// for experimentation, sample index in input samplebuffer
 
 		float	radius;
-		static bool s_motionEnabled;
 	};
 
+	// outside the hot loops
+	inline Vec3f	getHitPoint		(const Sample& s, float time) const	{ return m_motionEnabled ? s.getHitPoint<MovingScene>(time) : s.getHitPoint<StaticScene>(time); }
+	inline Vec4f	getTangentPlane	(const Sample& s, float time) const	{ return m_motionEnabled ? s.getTangentPlane<MovingScene>(time) : s.getTangentPlane<StaticScene>(time); }
+
 	// for piping reconstruction rays from PBRT
 	#pragma pack(push, 1)
 	struct PBRTReconstructionRay
@@ -405,6 +734,9 @@ private:
 	Array64<PBRTReconstructionRay>	m_PBRTReconstructionRays;
 	Array<int>						m_PBRTReconstructionRaysScanlineStart;
 
+	static void		sortByScanline	(PBRTReconstructionRay* rays, int num);
+	static Vec3f	getSplatExtent	(const Sample& s, BloatMode mode);	// half size of the bounds
+
 	struct ReconSample
 	{
 		bool	backface;
@@ -414,32 +746,37 @@ private:
 		int		index;			// in m_samples
 	};
 
-	void fetchSample(Sample& s, const Vec3i& index) const
-	{
-		const int x=index[0], y=index[1], i=index[2];
-		s.xy			= m_sbuf->getSampleXY	(x,y,i);
-		s.t				= m_sbuf->getSampleT	(x,y,i);
-		s.color			= m_sbuf->getSampleColor(x,y,i).getXYZ();
-//		s.pri_mv		= m_sbuf->getSampleMV	(x,y,i);
-		s.pri_normal	= m_sbuf->getSampleExtra<Vec3f>(CID_PRI_NORMAL  ,x,y,i);
-		s.pri_albedo	= m_sbuf->getSampleExtra<Vec3f>(CID_ALBEDO      ,x,y,i);
-		s.sec_origin	= m_sbuf->getSampleExtra<Vec3f>(CID_SEC_ORIGIN  ,x,y,i);
-		s.sec_hitpoint	= m_sbuf->getSampleExtra<Vec3f>(CID_SEC_HITPOINT,x,y,i);
-		s.sec_mv		= m_sbuf->getSampleExtra<Vec3f>(CID_SEC_MV      ,x,y,i);
-		s.sec_normal	= m_sbuf->getSampleExtra<Vec3f>(CID_SEC_NORMAL  ,x,y,i);
-		s.sec_albedo    = m_sbuf->getSampleExtra<Vec3f>(CID_SEC_ALBEDO  ,x,y,i);
-		s.sec_direct    = m_sbuf->getSampleExtra<Vec3f>(CID_SEC_DIRECT  ,x,y,i);
-		s.origIndex		= index;
-	}
-
 	Array<Sample>	m_samples;
 	Array<Node>		m_hierarchy;		// root @ index 0
+	Array<int>		m_refitOrder;		// node indices in breadth-first order
+	Array<int>		m_refitLevels;		// first index of each level in m_refitOrder, plus the total
+	Array<ClipBox>	m_clipBoxes;		// parallel to m_samples once oversized splats have been split, empty otherwise
+	Array<WideNode>	m_wideHierarchy;	// root @ index 0, empty if the root is a leaf or when filtering with CUDA
+	Array<WideNode::Bounds> m_wideHierarchyT1;	// parallel to m_wideHierarchy @ t=1, empty for static scenes
+	ChunkQueue		m_chunks;			// of m_samples, for the pass in flight
+	Array<Vec3f>	m_knnPoints;		// hit points @ KNN_TIME, exist while computing densities
+	Array<Vec3f>	m_knnDirs;			// unit directions towards the secondary origins
+	Array<float>	m_knnBandwidths;	// vMF bandwidths, only with bandwidth information
+	Array<int>		m_gridStart;		// first index of each bucket in m_gridSamples, plus the total
+	Array<int>		m_gridSamples;		// sample indices sorted by bucket
+	Vec3f			m_gridOrigin;
+	float			m_gridCellSize;
+	int				m_gridMask;			// #buckets-1, a power of two
+	Array<CompactNode> m_compactHierarchy;	// root @ index 0, exists while shrinking on the CPU
+	Array<QuantizedBox> m_compactHierarchyT1;	// parallel to m_compactHierarchy @ t=1, empty for static scenes
+	Node			m_compactBounds;	// of the root, full precision
+	Array<int>		m_shrinkOrder;		// samples grouped by pixel and direction octant, exists while shrinking on the CPU
+	Array<int>		m_shrinkPackets;	// first index of each packet in m_shrinkOrder, plus the total
 
 	int m_totalNumSamples;
 	int	m_totalNumLeafNodes;
 	int m_totalNumMixedLeaf;
 
 	const UVTSampleBuffer* m_sbuf;
+	bool	m_motionEnabled;			// selects the motion policy
+	int		m_cidPriNormal;				// channel IDs of m_sbuf
+	int		m_cidAlbedo;
+	int		m_cidSecOrigin;
 	int		m_numReconstructionRays;
 	float	m_aoLength;					// >0 enables AO
 	String	m_rayDumpFileName;
@@ -285,9 +285,6 @@ void CudaReconstructionInd::shrinkGPU(const Array<CudaShrinkRayInd>& in_rays,
 
 //-------------------------------------------------------------------------------------------------
 
-inline bool isSecondaryHitpointValid(const UVTSampleBuffer& sbuf,int x,int y,int i)	{ Vec3f sec_hitpoint=sbuf.getSampleExtra<Vec3f>(CID_SEC_HITPOINT, x,y,i); return sec_hitpoint.max() < 1e10f; }
-inline bool isSecondaryOriginValid  (const UVTSampleBuffer& sbuf,int x,int y,int i)	{ Vec3f sec_origin=sbuf.getSampleExtra<Vec3f>(CID_SEC_ORIGIN, x,y,i);   return sec_origin.max() < 1e10f; }
-
 void ReconstructIndirect::filterImageCuda(Image& resultImage)
 {
 	profilePush("Filter");
@@ -321,7 +318,7 @@ void ReconstructIndirect::filterImageCuda(Image& resultImage)
 		osmp.color  = ismp.color;
 		osmp.size   = ismp.radius;
 		osmp.plen   = ismp.sec_origin.length(); // camera is at origin, so this is primary ray length
-		osmp.bw     = m_sbuf->getSampleW(ismp.origIndex.x, ismp.origIndex.y, ismp.origIndex.z);
+		osmp.bw     = m_sbuf->getSampleW(ismp.origIndex);
 
 		tsmp.posSize    = Vec4f(osmp.pos, osmp.size);
 		tsmp.normalPlen = Vec4f(osmp.normal, osmp.plen);
@@ -395,12 +392,17 @@ void ReconstructIndirect::filterImageCuda(Image& resultImage)
 	for (int i=0; i < size.x * size.y; i++)
 		validCount[i] = 0.f;
 
+	// the kernel traces the same number of rays from every receiver. In irregular buffers it is chosen so
+	// that the total matches a regular buffer with the same number of samples.
 	Array<CudaReceiverInd> receivers;
-	int n  = m_sbuf->getNumSamples() / SUBSAMPLE_SBUF;
-	int nr = m_numReconstructionRays / n;
+	int numOrigins = 0;
+	for (int y=0; y < size.y; y++)
+	for (int x=0; x < size.x; x++)
+		numOrigins += m_sbuf->getNumSamples(x, y) / SUBSAMPLE_SBUF;
+	int nr = max(1, (int)((S64)m_numReconstructionRays * size.x * size.y / max(numOrigins, 1)));
 	for (int y=0; y < size.y; y++)
 	for (int x=0; x < size.x; x++)
-	for (int i=0; i < n; i++)
+	for (int i=0; i < m_sbuf->getNumSamples(x, y) / SUBSAMPLE_SBUF; i++)
 	{
 		Vec3f origin = m_sbuf->getSampleExtra<Vec3f>(cid_sec_origin, x, y, i);	// shoot secondary from here
 		Vec3f normal = m_sbuf->getSampleExtra<Vec3f>(cid_pri_normal, x, y, i);	// orientation of hemisphere
@@ -436,10 +438,8 @@ void ReconstructIndirect::filterImageCuda(Image& resultImage)
 
 	// construct the "sobol" table
 	Array<Vec2f> sobolTbl(0, m_numReconstructionRays);
-	for (int i=0; i < n;  i++) // number of origins per pixel
-	for (int j=0; j < nr; j++) // number of reconstruction rays per origin
+	for (int idx0=0; idx0 < m_numReconstructionRays; idx0++) // indexed by ray number within the pixel
 	{
-		int idx0 = nr*i + j;
    		sobolTbl[idx0].x = sobol(1, idx0);
    		sobolTbl[idx0].y = sobol(4, idx0);
 	}
@@ -488,7 +488,7 @@ void ReconstructIndirect::filterImageCuda(Image& resultImage)
 			// load a set of rays and sort them
 			Array<PBRTReconstructionRay> subRays(0, num);
 			fread(subRays.getPtr(), sizeof(PBRTReconstructionRay), num, fp);
-			FW_SORT_ARRAY_MULTICORE(subRays, ReconstructIndirect::PBRTReconstructionRay, ((int)floor(a.xy[1])*4096+(int)floor(a.xy[0]) < ((int)floor(b.xy[1])*4096+(int)floor(b.xy[0]))));
+			sortByScanline(subRays.getPtr(), subRays.getSize());
 
 			// construct local ray array
 			Array<CudaPBRTRay> pbrtRays;
@@ -632,7 +632,7 @@ void ReconstructIndirect::filterImageCuda(Image& resultImage)
 		{
 			Vec2i pos(i % size.x, i / size.x);
 			Vec4f c = resultImage.getVec4f(pos);
-			float r = validCount[i].y / validCount[i].x; // ratio of valid pixels
+			float r = (validCount[i].x > 0) ? validCount[i].y / validCount[i].x : 0.f; // ratio of valid pixels, empty pixels of irregular buffers are invalid
 			Vec4f ic(0, 0, 0, 1); // invalid color is black
 			c = r * c + (1.f - r) * ic;
 			resultImage.setVec4f(pos, c);
@@ -167,53 +167,51 @@ void Reconstruction::reconstructRPF(const UVTSampleBuffer& sbuf, Image& resultIm
 
 RPF::RPF(Image* resultImage, Image* debugImage, const UVTSampleBuffer& sbuf, float aoLength)
 {
-	if(sbuf.isIrregular())
-		fail("RPF implementation does not support irregular sample buffers");
-
-	CID_PRI_MV       = sbuf.getChannelID(CID_PRI_MV_NAME      );
-	CID_PRI_NORMAL   = sbuf.getChannelID(CID_PRI_NORMAL_SMOOTH_NAME  );
-	CID_ALBEDO       = sbuf.getChannelID(CID_ALBEDO_NAME      );
-	CID_SEC_ORIGIN   = sbuf.getChannelID(CID_SEC_ORIGIN_NAME  );
-	CID_SEC_HITPOINT = sbuf.getChannelID(CID_SEC_HITPOINT_NAME);
-	CID_SEC_MV       = sbuf.getChannelID(CID_SEC_MV_NAME      );
-	CID_SEC_NORMAL   = sbuf.getChannelID(CID_SEC_NORMAL_NAME  );
-	CID_DIRECT       = sbuf.getChannelID(CID_DIRECT_NAME      );
-	CID_SEC_ALBEDO   = sbuf.getChannelID(CID_SEC_ALBEDO_NAME  );
-	CID_SEC_DIRECT   = sbuf.getChannelID(CID_SEC_DIRECT_NAME  );
-
+	const SampleChannels channels(sbuf);
 	const int w = sbuf.getWidth();
 	const int h = sbuf.getHeight();
-	const int s = sbuf.getNumSamples(); 
 
 	m_image      = resultImage;
 	m_debugImage = debugImage;
 	m_w			 = w;
 	m_h			 = h;
-	m_spp		 = s;
+
+	// per pixel sample offsets (irregular buffers have varying sample counts)
+
+	m_firstSample.reset(w*h+1);
+	m_firstSample[0] = 0;
+	for(int y=0;y<h;y++)
+	for(int x=0;x<w;x++)
+		m_firstSample[y*w+x+1] = m_firstSample[y*w+x] + sbuf.getNumSamples(x,y);
+
+	const int numSamples = m_firstSample[w*h];
+	m_spp		 = max(1, (numSamples + w*h/2) / (w*h));
 
 	// fetch samples to local structs (replaces invalid input samples with average of pixel's valid samples)
 
 	Random random(242);
 	int	statsValidSamples[4] = {0};
+	double initialEnergy = 0;			// how much energy did we have initially?
 
-	m_unNormalizedSamples.reset(w*h*s);
-	m_inputColors. reset(w*h*s);
-	m_outputColors.reset(w*h*s);
+	m_unNormalizedSamples.reset(numSamples);
+	m_inputColors. reset(numSamples);
+	m_outputColors.reset(numSamples);
 
 	for(int y=0;y<h;y++)
 	for(int x=0;x<w;x++)
 	{
 		Array<int> validSampleIndices;
 		SampleVector avg(0);
+		const int n = getNumSamples(x,y);
 
-		for(int i=0;i<s;i++)
+		for(int i=0;i<n;i++)
 		{
 			const int index = getSampleIndex(x,y,i);
 			SampleVector& s = m_unNormalizedSamples[index];
-			s.fetch(sbuf,x,y,i);								// some samples in sbuf may be invalid
+			s.fetch(sbuf,channels,x,y,i);								// some samples in sbuf may be invalid
 
 	#ifdef PRE_MULTIPLY_ALBEDO
-			s.c.rgb *= sbuf.getSampleExtra<Vec3f>(CID_ALBEDO,x,y,i);
+			s.c.rgb *= sbuf.getSampleExtra<Vec3f>(channels.albedo,x,y,i);
 	#endif
 
 			if(aoLength>0)
@@ -229,13 +227,13 @@ RPF::RPF(Image* resultImage, Image* debugImage, const UVTSampleBuffer& sbuf, flo
 		// average of valid samples
 		const int numValidSamples = validSampleIndices.getSize();
 		if(numValidSamples>0)
-			avg.divide(s);
+			avg.divide(n);
 
 		if(numValidSamples<4)
 			statsValidSamples[numValidSamples]++;
 
 		// "fix" invalid samples
-		for(int i=0;i<s;i++)
+		for(int i=0;i<n;i++)
 		{
 			const int index = getSampleIndex(x,y,i);
 			SampleVector& s = m_unNormalizedSamples[index];
@@ -260,6 +258,7 @@ RPF::RPF(Image* resultImage, Image* debugImage, const UVTSampleBuffer& sbuf, flo
 			}
 			m_inputColors [index] = s.c.rgb;
 			m_outputColors[index] = s.c.rgb;
+			initialEnergy += dot(s.c.rgb, Vec3f(0.30f,0.59f,0.11f));
 		}
 	}
 
@@ -269,19 +268,13 @@ RPF::RPF(Image* resultImage, Image* debugImage, const UVTSampleBuffer& sbuf, flo
 			printf("WARNING: %d pixels had only %d valid samples\n", statsValidSamples[i], i);
 	}
 
-	// how much energy did we have initially?
-
-	double initialEnergy = 0;
-	for(int i=0;i<m_inputColors.getSize();i++)
-		initialEnergy += dot(m_inputColors[i], Vec3f(0.30f,0.59f,0.11f));
-
 	// multiple iterations
 
 	for(int iteration=0;BOX_WIDTH[iteration];iteration++)
 	{
 		filter(iteration);				// writes output colors, also writes image (useful for debug purposes at least)
 
-		for(int i=0;i<w*h*s;i++)		// copy output -> input
+		for(int i=0;i<numSamples;i++)	// copy output -> input
 			m_inputColors[i]  = m_outputColors[i];
 	}
 
@@ -302,7 +295,7 @@ RPF::RPF(Image* resultImage, Image* debugImage, const UVTSampleBuffer& sbuf, flo
 	for(int x=0;x<w;x++)
 	{
 		Vec4f pixelColor(0);
-		for(int i=0;i<s;i++)
+		for(int i=0;i<getNumSamples(x,y);i++)
 		{
 			const int index = getSampleIndex(x,y,i);
 	#ifdef PRE_MULTIPLY_ALBEDO
@@ -348,7 +341,7 @@ void RPFTask::getPixelMeanAndStddev(const Vec2i& pixel,SceneFeatures& E, SceneFe
 {
 	const int x = pixel.x;
 	const int y = pixel.y;
-	const int s = m_scope->m_spp;
+	const int s = m_scope->getNumSamples(x,y);
 	SceneFeatures E2;
 
 	for(int f=0;f<SceneFeatures::getSize();f++)
@@ -369,8 +362,8 @@ void RPFTask::getPixelMeanAndStddev(const Vec2i& pixel,SceneFeatures& E, SceneFe
 
 	for(int f=0;f<SceneFeatures::getSize();f++)
 	{
-		E [f] /= s;
-		E2[f] /= s;
+		E [f] /= max(s,1);								// empty pixels of irregular buffers have zero mean and stddev
+		E2[f] /= max(s,1);
 		stddev[f] = sqrt(max(0.f,E2[f] - E[f]*E[f]));	// max() avoids accidental NaNs
 	}
 }
@@ -382,7 +375,7 @@ void RPFTask::determineNeighborhood(Array<int>& neighborIndices, const Vec2i& pi
 
 	const int w = m_scope->m_w;
 	const int h = m_scope->m_h;
-	const int s = m_scope->m_spp;
+	const int s = m_scope->getNumSamples(pixel.x,pixel.y);
 
 	if(DEBUG_PIXEL!=Vec2i(-1,-1))
 	{
@@ -423,8 +416,11 @@ void RPFTask::determineNeighborhood(Array<int>& neighborIndices, const Vec2i& pi
 		while(Vec2i(x,y)==pixel ||								// same pixel -> retry
 			  x<0 || y<0 || x>=w || y>=h);						// outside the screen -> retry
 
-		// select a random sample inside the chosen pixel
-		const int index = m_scope->getSampleIndex(x,y,random.getU32()%s);
+		// select a random sample inside the chosen pixel (irregular buffers may have empty pixels)
+		const int ns = m_scope->getNumSamples(x,y);
+		if(!ns)
+			continue;
+		const int index = m_scope->getSampleIndex(x,y,random.getU32()%ns);
 
 		// compare features
 		const SceneFeatures& v = m_scope->getUnNormalizedSampleVector(index).f;
@@ -834,11 +830,11 @@ void RPFTask::printAllWeights(const Array<SampleVector>& samples) const
 // NOTE: assumes [0,spp-1] are the samples from pixel itself
 //-----------------------------------------------------------------------
 
-Vec4f RPFTask::filterColorSamples(const ColorFeatures& alpha,const SceneFeatures& beta,float W_r_c, const Array<SampleVector>& normalizedSamples,const Array<int>& neighborIndices)
+Vec4f RPFTask::filterColorSamples(const ColorFeatures& alpha,const SceneFeatures& beta,float W_r_c, const Array<SampleVector>& normalizedSamples,const Array<int>& neighborIndices,int numPixelSamples)
 {
 	Vec3f* outputColors = ((RPF*)m_scope)->getOutputColorPtr(neighborIndices[0]);	// NOTE: [0] must be the first sample of this pixel
 
-	const int s = m_scope->m_spp;
+	const int s = numPixelSamples;
 
 	const float var_8 = Jouni;								// Sen: for path traced scenes 0.002, others 0.02
 	const float var   = 8*var_8/s;							// Q: Spatial filter may need to get larger but why range filter?
@@ -958,6 +954,13 @@ void RPFTask::filter(int y)
 		if(DEBUG_PIXEL!=Vec2i(-1,-1) && DEBUG_PIXEL!=pixel)
 			continue;
 
+		const int numPixelSamples = m_scope->getNumSamples(x,y);
+		if(!numPixelSamples)
+		{
+			image.setVec4f(pixel, Vec4f(0,0,0,1));						// background
+			continue;
+		}
+
 		// Determine neighborhood (collects indices of the samples that seem to belong to the same cluster)
 
 		const int b = BOX_WIDTH[m_iteration];							// box width for this iteration
@@ -998,7 +1001,7 @@ void RPFTask::filter(int y)
 		// Filter samples
 
 //		Vec4f color(W_r_c,1);
-		Vec4f color = filterColorSamples(alpha,beta,W_r_c, normalizedSamples,neighborIndices);
+		Vec4f color = filterColorSamples(alpha,beta,W_r_c, normalizedSamples,neighborIndices,numPixelSamples);
 		image.setVec4f(pixel, color);
 	}
 }
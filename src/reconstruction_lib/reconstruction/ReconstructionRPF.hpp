@@ -36,21 +36,28 @@ Implementation of random parameter filtering [Sen et al. 2012].
 namespace FW
 {
 
-static int CID_PRI_MV      ;
-static int CID_PRI_NORMAL  ;
-static int CID_ALBEDO      ;
-static int CID_SEC_ORIGIN  ;
-static int CID_SEC_HITPOINT;
-static int CID_SEC_MV      ;
-static int CID_SEC_NORMAL  ;
-static int CID_DIRECT      ;
-static int CID_SEC_ALBEDO  ;
-static int CID_SEC_DIRECT  ;
-
 //-----------------------------------------------------------------------
 // 
 //-----------------------------------------------------------------------
 
+struct SampleChannels	// channel IDs of the input buffer, -1 if missing
+{
+	int priNormal;
+	int albedo;
+	int secOrigin;
+	int secHitpoint;
+	int secNormal;
+
+	SampleChannels(const UVTSampleBuffer& sbuf)
+	{
+		priNormal   = sbuf.getChannelID(CID_PRI_NORMAL_SMOOTH_NAME);
+		albedo      = sbuf.getChannelID(CID_ALBEDO_NAME      );
+		secOrigin   = sbuf.getChannelID(CID_SEC_ORIGIN_NAME  );
+		secHitpoint = sbuf.getChannelID(CID_SEC_HITPOINT_NAME);
+		secNormal   = sbuf.getChannelID(CID_SEC_NORMAL_NAME  );
+	}
+};
+
 #define ACCESSOR(X)	static int	 getSize()					{ return sizeof(X)/sizeof(float); }\
 					void   operator+=(const X& s)			{ for(int i=0;i<getSize();i++) (*this)[i] += s[i]; } \
 					void   divide(int s)					{ for(int i=0;i<getSize();i++) (*this)[i] /= float(s); } \
@@ -66,14 +73,14 @@ static int CID_SEC_DIRECT  ;
 struct ScreenPosition
 {
 	UnalignedVec2f xy;
-	void fetch(const UVTSampleBuffer& sbuf,int x,int y,int i)	{ xy=sbuf.getSampleXY(x,y,i); }
+	void fetch(const UVTSampleBuffer& sbuf,const SampleChannels&,int x,int y,int i)	{ xy=sbuf.getSampleXY(x,y,i); }
 	ACCESSOR(ScreenPosition);
 };
 
 struct ColorFeatures
 {
 	UnalignedVec3f rgb;
-	void fetch(const UVTSampleBuffer& sbuf,int x,int y,int i)	{ rgb=sbuf.getSampleColor(x,y,i).getXYZ(); }
+	void fetch(const UVTSampleBuffer& sbuf,const SampleChannels&,int x,int y,int i)	{ rgb=sbuf.getSampleColor(x,y,i).getXYZ(); }
 	ACCESSOR(ColorFeatures);
 };
 
@@ -82,12 +89,12 @@ struct RandomParams
 //	UnalignedVec2f uv;		// lens position		NEW_RANDOM_PARAM
 //	float t;				// time
 	UnalignedVec3f dir;		// first reflection direction (for path tracing)
-	void fetch(const UVTSampleBuffer& sbuf,int x,int y,int i)
+	void fetch(const UVTSampleBuffer& sbuf,const SampleChannels& ch,int x,int y,int i)
 	{
 //		uv  = sbuf.getSampleUV(x,y,i);			//	NEW_RANDOM_PARAM
 //		t   = sbuf.getSampleT(x,y,i);
-		if(CID_SEC_ORIGIN!=-1 && CID_SEC_HITPOINT!=-1)
-			dir = (sbuf.getSampleExtra<Vec3f>(CID_SEC_HITPOINT,x,y,i) - sbuf.getSampleExtra<Vec3f>(CID_SEC_ORIGIN,x,y,i)).normalized();
+		if(ch.secOrigin!=-1 && ch.secHitpoint!=-1)
+			dir = (sbuf.getSampleExtra<Vec3f>(ch.secHitpoint,x,y,i) - sbuf.getSampleExtra<Vec3f>(ch.secOrigin,x,y,i)).normalized();
 		else
 			dir = Vec3f(0.f);
 	}
@@ -103,15 +110,15 @@ struct SceneFeatures
 	UnalignedVec3f n2;		// secondary normal
 	UnalignedVec3f albedo;	// albedo (Sen uses "texture values")
 
-	void fetch(const UVTSampleBuffer& sbuf,int x,int y,int i)
+	void fetch(const UVTSampleBuffer& sbuf,const SampleChannels& ch,int x,int y,int i)
 	{
-		if(CID_SEC_ORIGIN!=-1 && CID_SEC_HITPOINT!=-1 && CID_PRI_NORMAL!=-1 && CID_SEC_NORMAL!=-1 && CID_ALBEDO!=-1)
+		if(ch.secOrigin!=-1 && ch.secHitpoint!=-1 && ch.priNormal!=-1 && ch.secNormal!=-1 && ch.albedo!=-1)
 		{
-			p1 = sbuf.getSampleExtra<Vec3f>(CID_SEC_ORIGIN,x,y,i);
-			p2 = sbuf.getSampleExtra<Vec3f>(CID_SEC_HITPOINT,x,y,i);
-			n1 = sbuf.getSampleExtra<Vec3f>(CID_PRI_NORMAL,x,y,i);
-			n2 = sbuf.getSampleExtra<Vec3f>(CID_SEC_NORMAL,x,y,i);
-			albedo = sbuf.getSampleExtra<Vec3f>(CID_ALBEDO,x,y,i);
+			p1 = sbuf.getSampleExtra<Vec3f>(ch.secOrigin,x,y,i);
+			p2 = sbuf.getSampleExtra<Vec3f>(ch.secHitpoint,x,y,i);
+			n1 = sbuf.getSampleExtra<Vec3f>(ch.priNormal,x,y,i);
+			n2 = sbuf.getSampleExtra<Vec3f>(ch.secNormal,x,y,i);
+			albedo = sbuf.getSampleExtra<Vec3f>(ch.albedo,x,y,i);
 		}
 		else
 			p1=p2=n1=n2=albedo = Vec3f(0);
@@ -126,7 +133,7 @@ struct SampleVector		// Do not reorder the members, some debug functionality rel
 	RandomParams	r;
 	SceneFeatures	f;
 	ColorFeatures	c;
-	void fetch(const UVTSampleBuffer& sbuf,int x,int y,int i)	{ p.fetch(sbuf,x,y,i); r.fetch(sbuf,x,y,i); f.fetch(sbuf,x,y,i); c.fetch(sbuf,x,y,i); }
+	void fetch(const UVTSampleBuffer& sbuf,const SampleChannels& ch,int x,int y,int i)	{ p.fetch(sbuf,ch,x,y,i); r.fetch(sbuf,ch,x,y,i); f.fetch(sbuf,ch,x,y,i); c.fetch(sbuf,ch,x,y,i); }
 	ACCESSOR(SampleVector);
 };
 
@@ -151,14 +158,16 @@ public:
 private:
 	friend class RPFTask;
 
-	int					getSampleIndex(int x,int y,int i) const					{ return (y*m_w+x)*m_spp+i; }
+	int					getSampleIndex(int x,int y,int i) const					{ return m_firstSample[y*m_w+x]+i; }
+	int					getNumSamples (int x,int y) const						{ return m_firstSample[y*m_w+x+1]-m_firstSample[y*m_w+x]; }
 
 	Image*					m_image;
 	Image*					m_debugImage;
 
 	int						m_w;
 	int						m_h;
-	int						m_spp;
+	int						m_spp;							// average over pixels (irregular buffers have varying counts)
+	Array<int>				m_firstSample;					// w*h+1 offsets into the sample arrays, last one is the total
 
 	Array<SampleVector>		m_unNormalizedSamples;			// "raw" sample data, normalized separately for each environment
 	Array<Vec3f>			m_inputColors;					// current iteration uses these colors
@@ -182,7 +191,7 @@ private:
 	void	getPixelMeanAndStddev		(const Vec2i& pixel, SceneFeatures& E, SceneFeatures& stddev) const;
 	void	determineNeighborhood		(Array<int>& neighborIndices, const Vec2i& pixel,int b,int M, Random2D& random) const;
 	Vec3f	computeWeights				(ColorFeatures& alpha,SceneFeatures& beta,float& W_r_c, const Array<SampleVector>& normalizedSamples, int iteration);
-	Vec4f 	filterColorSamples			(const ColorFeatures& alpha,const SceneFeatures& beta,float W_r_c, const Array<SampleVector>& normalizedSamples,const Array<int>& neighborIndices);
+	Vec4f 	filterColorSamples			(const ColorFeatures& alpha,const SceneFeatures& beta,float W_r_c, const Array<SampleVector>& normalizedSamples,const Array<int>& neighborIndices,int numPixelSamples);
 
 	void	printAllWeights				(const Array<SampleVector>& normalizedSamples) const;					// DEBUG function
 